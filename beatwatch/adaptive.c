@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Adaptive timeout, with --adaptive. The gaps between TIMEOUT=N (or
+   TIMEOUT_MS=N) messages are kept in a histogram, and the timeout is set
+   to a quantile of them times a safety factor, clamped between a minimum
+   and a maximum, instead of N. Until ADAPTIVE_MIN_SAMPLES gaps have been
+   seen, N is used as it is.
+
+   The buckets are logarithmic, four per power of two, so a quantile is
+   off by at most 1/4. When ADAPTIVE_WINDOW gaps have been counted, all
+   counts are halved, so that the recent cadence weighs more. */
+
+#define NBUCKETS    (4 * 32)
+
+long long adaptive_min = 0;         /* in millisecond, 0 if disabled */
+long long adaptive_max = 0;         /* in millisecond */
+double adaptive_quantile = 0.99;
+double adaptive_factor = 3.0;
+
+static unsigned int buckets[NBUCKETS];
+static unsigned int total = 0;
+static unsigned int samples = 0;
+static long long last_beat = 0;
+static long long last_logged = 0;
+
+static int bucket_of(long long gap);
+static long long bucket_upper(int i);
+static long long quantile(void);
+
+/* Forgets the cadence learned so far, for a new monitoring-target on
+   --restart. */
+void init_adaptive() {
+    memset(buckets, 0, sizeof(buckets));
+    total = samples = 0;
+    last_beat = last_logged = 0;
+}
+
+/* Takes the timeout requested with a heartbeat, in millisecond, and
+   returns the one to be used. TIMEOUT=0, to time out now, is not a
+   heartbeat, and is used as it is. */
+long long adapt_timeout(long long now, long long requested) {
+    if (adaptive_min <= 0 || requested <= 0)
+        return requested;
+
+    if (last_beat > 0) {
+        buckets[bucket_of(now - last_beat)]++;
+        samples++;
+        if (++total >= ADAPTIVE_WINDOW) {
+            total = 0;
+            for (int i = 0; i < NBUCKETS; i++) {
+                buckets[i] /= 2;
+                total += buckets[i];
+            }
+        }
+    }
+    last_beat = now;
+
+    if (samples < ADAPTIVE_MIN_SAMPLES)
+        return requested;
+
+    long long gap = quantile();
+    long long timeout = gap * adaptive_factor;
+    if (timeout < adaptive_min)
+        timeout = adaptive_min;
+    if (timeout > adaptive_max)
+        timeout = adaptive_max;
+
+    /* log it when it has changed by 10% or more */
+    if (timeout * 10 < last_logged * 9 || last_logged * 11 < timeout * 10) {
+        noticepf("adaptive timeout %lld ms (%g%% of gaps within %lld ms, %u samples)",
+                 timeout, adaptive_quantile * 100, gap, samples);
+        last_logged = timeout;
+    }
+    return timeout;
+}
+
+static int bucket_of(long long gap) {
+    int msb = 0;
+
+    if (gap < 1)
+        gap = 1;
+    for (long long g = gap; g > 1; g >>= 1)
+        msb++;
+
+    /* the two bits below the most significant one */
+    int frac = (msb >= 2) ? (gap >> (msb - 2)) & 3 : (gap << (2 - msb)) & 3;
+    int i = msb * 4 + frac;
+    return (i < NBUCKETS) ? i : NBUCKETS - 1;
+}
+
+static long long bucket_upper(int i) {
+    int msb = i / 4, frac = i % 4;
+
+    if (msb >= 2)
+        return (long long) (4 + frac + 1) << (msb - 2);
+    return ((4 + frac + 1) << msb) / 4;
+}
+
+static long long quantile() {
+    unsigned int sum = 0, count = 0;
+
+    for (int i = 0; i < NBUCKETS; i++)
+        count += buckets[i];
+
+    for (int i = 0; i < NBUCKETS; i++) {
+        sum += buckets[i];
+        if (sum >= count * adaptive_quantile)
+            return bucket_upper(i);
+    }
+    return bucket_upper(NBUCKETS - 1);
+}
+
+/* vim: set et sw=4 sts=4: */
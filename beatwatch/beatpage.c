@@ -0,0 +1,115 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for memfd_create() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "errorpf.h"
+#include "global.h"
+#include "beatwatch.h"
+
+/* The shared-memory heartbeat page, see beatwatch.h. Only the watchdog
+   creates it, and the monitoring-target gets it as beat_kfd. */
+
+int beat_kfd = -1;
+static int page_fd = -1;
+static struct beatwatch_page *page = NULL;
+
+void create_beatpage() {
+    if (beat_kfd < 0)
+        return;
+
+#ifdef __linux__
+    page_fd = memfd_create("beatwatch", MFD_CLOEXEC);
+    if (page_fd < 0) {
+        errorpf(errno, "memfd_create()");
+        exit(FATAL_EXIT);
+    }
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/beatwatch.%d", (int) getpid());
+    page_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (page_fd < 0) {
+        errorpf(errno, "shm_open(%s)", name);
+        exit(FATAL_EXIT);
+    }
+    shm_unlink(name);
+#endif
+
+    int ret = ftruncate(page_fd, sizeof(*page));
+    if (ret != 0) {
+        errorpf(errno, "ftruncate()");
+        exit(FATAL_EXIT);
+    }
+
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, page_fd, 0);
+    if (page == MAP_FAILED) {
+        page = NULL;
+        errorpf(errno, "mmap()");
+        exit(FATAL_EXIT);
+    }
+    page->magic = BEATWATCH_PAGE_MAGIC;
+    page->version = BEATWATCH_PAGE_VERSION;
+}
+
+/* called by the monitoring-target just before execvp() */
+void pass_beatpage() {
+    char str[16];
+
+    if (page_fd < 0)
+        return;
+
+    /* ctrl_wfd is still needed if execvp() fails, so move it out of the
+       way rather than have it replaced with the page */
+    if (ctrl_wfd == beat_kfd) {
+        int fd = fcntl(ctrl_wfd, F_DUPFD_CLOEXEC, beat_kfd + 1);
+        if (fd == -1) {
+            errorpf(errno, "fcntl(F_DUPFD_CLOEXEC)");
+            exit(FATAL_EXIT);
+        }
+        ctrl_wfd = fd;
+    }
+
+    /* page_fd itself has FD_CLOEXEC, and the copy has not */
+    int ret;
+    if (page_fd == beat_kfd) {
+        int flags = fcntl(page_fd, F_GETFD);
+        ret = (flags == -1) ? -1 : fcntl(page_fd, F_SETFD, flags & ~FD_CLOEXEC);
+    } else
+        ret = dup2(page_fd, beat_kfd);
+    if (ret == -1) {
+        errorpf(errno, "dup2()");
+        exit(FATAL_EXIT);
+    }
+    snprintf(str, sizeof(str), "%d", beat_kfd);
+    ret = setenv("BEATWATCH_BEAT_FD", str, 1);
+    if (ret != 0) {
+        errorpf(errno, "setenv()");
+        exit(FATAL_EXIT);
+    }
+}
+
+/* Returns the deadline stored by the monitoring-target, or 0 if none. */
+long long beatpage_deadline() {
+    if (page == NULL)
+        return 0;
+    return __atomic_load_n(&page->deadline, __ATOMIC_ACQUIRE);
+}
+
+void close_beatpage() {
+    if (page) {
+        munmap(page, sizeof(*page));
+        page = NULL;
+    }
+    if (page_fd >= 0) {
+        close(page_fd);
+        page_fd = -1;
+    }
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,124 @@
+/* Interface for the monitoring-targets of beatwatch.
+
+   LIBBEATWATCH
+     SYNOPSIS
+       int bw_init(void);
+       int bw_beat(void);
+       int bw_set_timeout(unsigned int msec);
+       int bw_beat_named(const char *name, unsigned int msec);
+       int bw_detach(void);
+       int bw_exit(int status);
+       int bw_store_fds(const int *fds, int n);
+       int bw_stored_fds(int *fds, int max);
+       int bw_standby(void);
+
+       Link with libbeatwatch.a.
+
+     DESCRIPTION
+       bw_init() finds the control fd (BEATWATCH_CTRL_FD, or 3) and the
+       heartbeat page (BEATWATCH_BEAT_FD), both set up by beatwatch, and
+       puts the control fd in non-blocking mode. The other functions call
+       it on their first use, but calling it once at start up is needed
+       for them to be async-signal-safe from then on.
+
+       bw_beat() tells that the caller is alive, and extends the timeout
+       by the last msec given to bw_set_timeout() (5000 if none). It is
+       cheap enough to be called on every request. With the heartbeat
+       page it is a single atomic store. Otherwise, beats within 1/8 of
+       the timeout after the last one sent are coalesced, so that at most
+       eight TIMEOUT_MS=N messages are written per timeout period.
+
+       bw_set_timeout() sets msec and sends TIMEOUT_MS=msec immediately.
+
+       bw_beat_named() beats the heartbeat channel name of its own, such
+       as "worker-7", by sending "BEAT name TIMEOUT_MS=msec". The watchdog
+       terminates the target when any of the channels misses its deadline,
+       and logs which one. msec 0 closes the channel. name is up to 64
+       bytes without a space. Each call sends a message, so call it about
+       once per a fraction of msec, not on every request.
+       bw_detach() and bw_exit() send DETACH and EXIT=status.
+
+       bw_store_fds() deposits n file descriptors, such as listening
+       sockets, with the watchdog by sending FDSTORE=n along with them.
+       It works only with --restart, where the control fd is a unix domain
+       socket, and not with --standby. n is at most 32, and 0 empties the
+       store. bw_stored_fds() gets up to max of the ones deposited before
+       a restart, which are inherited from the watchdog and listed in
+       BEATWATCH_FDS.
+
+       bw_standby() is the readiness barrier of --standby. Call it when
+       initialized, before serving. In a standby, it says READY and waits
+       until the watchdog promotes it, then says PROMOTED. Otherwise it
+       returns at once.
+
+       All of them but bw_stored_fds() and bw_standby() are thread-safe and
+       async-signal-safe, and none of them but bw_standby() blocks. If the
+       control pipe is full, the message is not sent.
+
+     RETURN VALUE
+       bw_beat() returns 1 if a message has been sent, or 0 if the beat
+       has been coalesced or stored on the page. bw_stored_fds() returns
+       the number of the file descriptors, 0 if none. bw_standby() returns
+       1 when promoted, or 0 if not a standby. The others return 0.
+       On error, -1 is returned and errno is set; EAGAIN if the control
+       pipe is full, EBADF if not running under beatwatch, ENOTSOCK from
+       bw_store_fds() without --restart, EINVAL from bw_beat_named() with
+       an invalid name.
+
+   SHARED-MEMORY HEARTBEAT
+       When beatwatch is run with --beat-fd <N>, the watchdog passes a
+       shared memory page to the monitoring-target as file descriptor <N>,
+       and also sets BEATWATCH_BEAT_FD=<N> in the environment. Map it with
+
+           page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+
+       and beat by storing a new deadline, the CLOCK_MONOTONIC time in
+       millisecond until which the target is known to be alive:
+
+           beatwatch_page_beat(page, 30 * 1000);
+
+       A beat costs no system call. The watchdog looks at the deadline
+       only when its own timer falls due, and then relays the extended
+       timeout upstream as a TIMEOUT_MS=N control message. Text control
+       messages on the control fd keep working along with this. */
+
+#ifndef BEATWATCH_H
+#define BEATWATCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define BEATWATCH_PAGE_MAGIC    0x42575047  /* "BWPG" */
+#define BEATWATCH_PAGE_VERSION  1
+
+struct beatwatch_page {
+    uint32_t magic;             /* BEATWATCH_PAGE_MAGIC */
+    uint32_t version;           /* BEATWATCH_PAGE_VERSION */
+    uint64_t deadline;          /* CLOCK_MONOTONIC in millisecond */
+    uint64_t beats;             /* number of beats, for information only */
+};
+
+static inline void beatwatch_page_beat(struct beatwatch_page *page, unsigned timeout_ms) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    __atomic_store_n(&page->deadline,
+                     (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout_ms,
+                     __ATOMIC_RELEASE);
+    __atomic_add_fetch(&page->beats, 1, __ATOMIC_RELAXED);
+}
+
+int bw_init(void);
+int bw_beat(void);
+int bw_set_timeout(unsigned int msec);
+int bw_beat_named(const char *name, unsigned int msec);
+int bw_detach(void);
+int bw_exit(int status);
+int bw_store_fds(const int *fds, int n);
+int bw_stored_fds(int *fds, int max);
+int bw_standby(void);
+
+#endif
+
+/* vim: set et sw=4 sts=4: */
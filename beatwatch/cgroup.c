@@ -0,0 +1,237 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for asprintf() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Containment of the monitoring-target in a cgroup v2 leaf, with --cgroup.
+   The watchdog creates the leaf, and the monitoring-target moves itself
+   into it just after setpgid(). SIGKILL is then delivered by writing to
+   cgroup.kill, which kills the whole tree at once, including descendants
+   that have left the process group with setsid(). Whatever is left in the
+   leaf when the watchdog exits is killed the same way.
+
+   If the leaf cannot be created, or the monitoring-target cannot move into
+   it (no delegation), only the process group is used as before. */
+
+const char *cgroup_parent = NULL;   /* "" for the watchdog's own cgroup */
+static char *leaf = NULL;           /* NULL if not in use */
+static int keep = 0;                /* the monitoring-target is left running */
+static int killed = 0;              /* cgroup.kill has been written */
+
+static char *own_cgroup(void);
+static int write_file(const char *name, const char *str);
+static int read_file(const char *name, char *buf, int size);
+static int is_populated(void);
+static void report_stats(void);
+
+void create_cgroup() {
+    if (cgroup_parent == NULL)
+        return;
+
+    char *parent = (*cgroup_parent) ? strdup(cgroup_parent) : own_cgroup();
+    if (parent == NULL) {
+        noticepf("cgroup v2 is not available, using the process group");
+        return;
+    }
+
+    int ret = asprintf(&leaf, "%s/beatwatch.%d", parent, (int) getpid());
+    free(parent);
+    if (ret < 0) {
+        errorpf(errno, "asprintf()");
+        exit(FATAL_EXIT);
+    }
+
+    if (mkdir(leaf, 0755) != 0) {
+        noticepf("cannot create cgroup %s (%s), using the process group",
+                 leaf, strerror(errno));
+        free(leaf);
+        leaf = NULL;
+    }
+}
+
+/* called by the monitoring-target */
+void enter_cgroup() {
+    if (leaf == NULL)
+        return;
+
+    if (write_file("cgroup.procs", "0") < 0)
+        noticepf("cannot move into cgroup %s (%s), using the process group",
+                 leaf, strerror(errno));
+
+    /* the leaf belongs to the watchdog */
+    free(leaf);
+    leaf = NULL;
+}
+
+/* Kills everything in the leaf. Returns -1 if no leaf is in use. */
+int kill_cgroup() {
+    if (leaf == NULL)
+        return -1;
+
+    killed = 1;
+    return write_file("cgroup.kill", "1");
+}
+
+/* Gets the CPU time in microsecond and the memory usage in byte of the
+   leaf, or -1 for each not available. Returns -1 if no leaf is in use. */
+int cgroup_usage(long long *rcpu, long long *rmem) {
+    char buf[1024];
+
+    if (leaf == NULL)
+        return -1;
+
+    *rcpu = *rmem = -1;
+    if (read_file("cpu.stat", buf, sizeof(buf)) > 0)
+        sscanf(buf, "usage_usec %lld", rcpu);
+    if (read_file("memory.current", buf, sizeof(buf)) > 0)
+        *rmem = atoll(buf);
+    return 0;
+}
+
+/* The monitoring-target is going to be left running, on BYE. */
+void keep_cgroup() {
+    keep = 1;
+}
+
+/* called by the watchdog on exit */
+void close_cgroup() {
+    int interval = 10;  /* millisecond */
+
+    if (leaf == NULL)
+        return;
+
+    report_stats();
+
+    if (keep) {
+        /* rmdir() fails while it is populated, and that is fine */
+        rmdir(leaf);
+        goto out;
+    }
+
+    if (is_populated()) {
+        /* after SIGKILL, they may just not have gone yet */
+        if (!killed)
+            noticepf("killing the processes left in cgroup %s", leaf);
+        kill_cgroup();
+    }
+
+    long long until = monotonic_ms() + SIGKILL_DELAY * 1000LL;
+    while (rmdir(leaf) != 0 && errno == EBUSY && monotonic_ms() < until)
+        usleep(interval * 1000);
+
+out:
+    free(leaf);
+    leaf = NULL;
+}
+
+/* Returns the directory of the cgroup v2 hierarchy that this process
+   belongs to, or NULL. */
+static char *own_cgroup() {
+    char line[4096], mount[4096] = "", path[4096] = "";
+    FILE *fp;
+
+    fp = fopen("/proc/self/mountinfo", "r");
+    if (fp == NULL)
+        return NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        /* ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS... - FSTYPE ... */
+        char *sep = strstr(line, " - cgroup2 ");
+        if (sep && sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1)
+            break;
+        mount[0] = '\0';
+    }
+    fclose(fp);
+
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL)
+        return NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), "%s", line + 3);
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (mount[0] == '\0' || path[0] != '/')
+        return NULL;
+
+    char *dir;
+    if (asprintf(&dir, "%s%s", mount, (strcmp(path, "/") == 0) ? "" : path) < 0)
+        return NULL;
+    return dir;
+}
+
+static int write_file(const char *name, const char *str) {
+    int len = strlen(leaf) + strlen(name) + 2;
+    char path[len];
+
+    snprintf(path, len, "%s/%s", leaf, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int n = write(fd, str, strlen(str));
+    int eno = errno;
+    close(fd);
+    errno = eno;
+    return (n < 0) ? -1 : 0;
+}
+
+/* Reads a small file in the leaf. Returns the length, or -1. */
+static int read_file(const char *name, char *buf, int size) {
+    int len = strlen(leaf) + strlen(name) + 2;
+    char path[len];
+
+    snprintf(path, len, "%s/%s", leaf, name);
+    return read_small(path, buf, size);
+}
+
+static int is_populated() {
+    char buf[256];
+
+    if (read_file("cgroup.events", buf, sizeof(buf)) < 0)
+        return 0;
+    return strstr(buf, "populated 1") != NULL;
+}
+
+/* Logs the CPU time from cpu.stat, and the peak memory usage if the memory
+   controller is enabled for the leaf. */
+static void report_stats() {
+    char buf[1024];
+    long long usage = -1, user = -1, system = -1, peak = -1;
+
+    if (read_file("cpu.stat", buf, sizeof(buf)) > 0) {
+        for (char *cp = strtok(buf, "\n"); cp; cp = strtok(NULL, "\n")) {
+            sscanf(cp, "usage_usec %lld", &usage);
+            sscanf(cp, "user_usec %lld", &user);
+            sscanf(cp, "system_usec %lld", &system);
+        }
+    }
+    if (read_file("memory.peak", buf, sizeof(buf)) > 0)
+        peak = atoll(buf);
+
+    if (usage < 0)
+        return;
+    if (peak < 0)
+        noticepf("cgroup usage: cpu=%lld.%03lds user=%lld.%03lds system=%lld.%03lds",
+                 usage / 1000000, (long) (usage % 1000000 / 1000),
+                 user / 1000000, (long) (user % 1000000 / 1000),
+                 system / 1000000, (long) (system % 1000000 / 1000));
+    else
+        noticepf("cgroup usage: cpu=%lld.%03lds user=%lld.%03lds system=%lld.%03lds memory.peak=%lld",
+                 usage / 1000000, (long) (usage % 1000000 / 1000),
+                 user / 1000000, (long) (user % 1000000 / 1000),
+                 system / 1000000, (long) (system % 1000000 / 1000), peak);
+}
+
+/* vim: set et sw=4 sts=4: */
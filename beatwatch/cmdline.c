@@ -105,8 +105,8 @@ static int child_posttask() {
     /* At this point, the parent side can go beyond the waitpid() */
 
     /* child created via fork() inherits a copy of its parent's signal
-       dispositions, but not inherit its parent's interval timer. */
-    set_alarm_timer();
+       dispositions, but must not share its parent's deadline timer. */
+    init_deadline_timer();
 
     send_ctrlmsgf("KILLPID=%d", getpid());
 
@@ -128,11 +128,8 @@ static int parent_posttask(int child_pid) {
     /* only watchdog can run run_onexit_script() */
     set_onexit_script(NULL);
 
-    /* only watchdog can write to ctrl_logfp */
-    if (ctrl_logfp != NULL) {
-        fclose(ctrl_logfp);
-        ctrl_logfp = NULL;
-    }
+    /* only watchdog can write to the control log */
+    close_ctrl_log();
 
     /* Wait for daemon() on the child side to complete */
     int status;
@@ -178,7 +175,7 @@ static int parent_posttask(int child_pid) {
     /* need update pid */
     set_killpid(pid);
 
-    send_ctrlmsgf("%c %s", done, line);
+    send_ctrlack(done, line);
 
     return pid;
 }
@@ -195,19 +192,25 @@ static int ctrlmsg_handler(char type, int val, const char *line, int *rexit) {
                 close(ctrl_rfd);
                 ctrl_rfd = -1;
             }
-            send_ctrlmsgf("%c %s", done, line);
+            send_ctrlack(done, line);
             ret = 1;
             break;
 
         case 'E':   /* EXIT=N       */
             *rexit = val;
-            send_ctrlmsgf("%c %s", done, line);
+            send_ctrlack(done, line);
             ret = 0;
             break;
 
         case 'T':   /* TIMEOUT=N    */
             set_timeout(val);
-            send_ctrlmsgf("%c %s", done, line);
+            send_ctrlack(done, line);
+            ret = 0;
+            break;
+
+        case 't':   /* TIMEOUT_MS=N */
+            set_timeout_ms(val);
+            send_ctrlack(done, line);
             ret = 0;
             break;
 
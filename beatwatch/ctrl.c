@@ -7,25 +7,77 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
-#include <time.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "errorpf.h"
 #include "global.h"
 
 int ctrl_rfd = -1;
 int ctrl_wfd = -1;
-FILE *ctrl_logfp = NULL;
+int ctrl_binary = 0;                /* use frames between cmdline and watchdog */
+int ctrl_rfd_binary = 0;            /* ctrl_rfd carries frames */
+int ctrl_wfd_binary = 0;            /* ctrl_wfd carries frames */
+int ctrl_fds = 0;                   /* let the next ctrl_rfd carry fds */
+int ctrl_rfd_fds = 0;               /* ctrl_rfd may carry fds, see restart.c */
+
+/* A frame of the binary protocol, followed by len bytes of the line if
+   the type is CTRL_FRAME_LINE. A packet holds one or more frames. */
+struct ctrlframe {
+    char type;                      /* see parse_ctrlmsg() */
+    char acktype;                   /* of the message done, with CTRL_FRAME_ACK */
+    char done;                      /* the done mark, with CTRL_FRAME_ACK */
+    char pad;
+    int val;
+    int len;
+};
+#define CTRL_FRAME_LINE     'L'     /* a line to be forwarded as it is */
+#define CTRL_FRAME_ACK      'A'     /* the done mark of a control message */
+#define CTRL_PACKET_MAX     (CTRL_LINE_MAX + 2 * (int) sizeof(struct ctrlframe))
+
+/* The outbound queue, see enable_ctrlmsg_queue(). */
+struct qline {
+    struct qline *next;
+    int len;                    /* including the '\n', or of the frame */
+    int high;                   /* never dropped */
+    char buf[];
+};
+static struct {
+    int enabled;
+    struct qline *head;
+    struct qline **tailp;
+    int offset;                 /* of head, already written */
+    int count;                  /* of lines */
+    long long bytes;            /* of low priority lines */
+    long dropped;
+    int low;                    /* in forward_ctrlmsg() or send_ctrlack() */
+    int blocked;                /* the pipe has been full since emptied */
+    struct qline **timeoutp;    /* where the TIMEOUT relay queued is linked */
+} queue = { 0, NULL, &queue.head, 0, 0, 0, 0, 0, 0, NULL };
 
 static int recv_line(const char **rline);
+static int recv_frame(char *rtype, int *rval, const char **rline);
+static const char *format_ctrlmsg(char type, int val);
+static int encode_frame(const char *str, int len, char *dst);
 static int send_ctrlmsgf_internal(const char *fmt, va_list ap);
-static const char *logtime(void);
+static void handle_send_error(int ret);
+static int write_line(char *str, int len);
+static int enqueue(const char *str, int len, int high);
+static int push_dropped(void);
+static int push(const char *str, int len, int high);
+static void coalesce_timeout(const char *str);
+static int write_queue(void);
+static void drop_queue(void);
 
 int recv_ctrlmsg(char *rtype, int *rval, const char **rline) {
     *rtype = '\0';
     *rval = 0;
     *rline = NULL;
 
+    if (ctrl_rfd_binary)
+        return recv_frame(rtype, rval, rline);
+
     const char *line;
     int len = recv_line(&line);
     if (len < 0) {
@@ -38,80 +90,277 @@ int recv_ctrlmsg(char *rtype, int *rval, const char **rline) {
     }
     *rline = line;
 
-    int tmpint;
-    if (strcmp(line, "BYE") == 0) {
-        *rtype = *line;
-        *rval = 0;
+    parse_ctrlmsg(line, rtype, rval);
+    return len;
+}
+
+/* Sets *rtype to the type letter of a known control message, or to '\0'
+   if the line is to be forwarded as it is. */
+static const struct {
+    const char *keyword;
+    int len;
+    char type;
+    int hasval;                 /* followed by an integer */
+} table[] = {
+    { "BYE",         3, 'B', 0 },
+    { "DETACH",      6, 'D', 0 },
+    { "EXIT=",       5, 'E', 1 },
+    { "FDSTORE=",    8, 'F', 1 },
+    { "KILLPID=",    8, 'K', 1 },
+    { "PROMOTED",    8, 'P', 0 },
+    { "READY",       5, 'R', 0 },
+    { "TIMEOUT=",    8, 'T', 1 },
+    { "TIMEOUT_MS=", 11, 't', 1 },
+};
+
+void parse_ctrlmsg(const char *line, char *rtype, int *rval) {
+    *rtype = '\0';
+    *rval = 0;
+
+    for (unsigned int i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (*line != *table[i].keyword ||
+            strncmp(line, table[i].keyword, table[i].len) != 0)
+            continue;
+
+        const char *str = line + table[i].len;
+        if (!table[i].hasval) {
+            if (*str != '\0')
+                continue;
+            *rtype = table[i].type;
+            return;
+        }
+
+        char *end;
+        long val = strtol(str, &end, 10);
+        if (end == str)
+            continue;
+        *rtype = table[i].type;
+        *rval = (int) val;
+        return;
+    }
+}
+
+/* The reverse of parse_ctrlmsg(). The line is valid until the next call. */
+static const char *format_ctrlmsg(char type, int val) {
+    static char buf[32];
+
+    for (unsigned int i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (table[i].type != type)
+            continue;
+        if (table[i].hasval)
+            snprintf(buf, sizeof(buf), "%s%d", table[i].keyword, val);
+        else
+            snprintf(buf, sizeof(buf), "%s", table[i].keyword);
+        return buf;
+    }
+    return NULL;
+}
+
+/* Receives the next frame of the binary protocol. A read() gets a whole
+   packet, and the frames in it are handed out one by one. */
+static int recv_frame(char *rtype, int *rval, const char **rline) {
+    static char *buf = NULL;
+    static int head = 0, tail = 0;
+    struct ctrlframe frame;
+
+    if (buf == NULL) {
+        buf = malloc(CTRL_PACKET_MAX);
+        if (buf == NULL) {
+            errorpf(errno, "malloc()");
+            exit(FATAL_EXIT);
+        }
     }
-    else if (strcmp(line, "DETACH") == 0) {
-        *rtype = *line;
-        *rval = 0;
+
+    while (head >= tail) {
+        if (wait_readable(ctrl_rfd) < 0)
+            return -1;
+
+        int n = read(ctrl_rfd, buf, CTRL_PACKET_MAX);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno != EINTR) {
+                fixme(errno);
+                exit(FATAL_EXIT);
+            }
+            return -1;
+        }
+        head = 0;
+        tail = n;
     }
-    else if (sscanf(line, "EXIT=%d", &tmpint) == 1) {
-        *rtype = *line;
-        *rval = tmpint;
+
+    if (tail - head < (int) sizeof(frame)) {
+        fixme(0);
+        exit(FATAL_EXIT);
     }
-    else if (sscanf(line, "KILLPID=%d", &tmpint) == 1) {
-        *rtype = *line;
-        *rval = tmpint;
+    memcpy(&frame, buf + head, sizeof(frame));
+    head += sizeof(frame);
+
+    if (frame.type == CTRL_FRAME_LINE) {
+        if (frame.len < 0 || frame.len > tail - head) {
+            fixme(0);
+            exit(FATAL_EXIT);
+        }
+        /* moved over the last byte of the header, for the room of '\0'
+           without touching the next frame */
+        char *line = buf + head - 1;
+        memmove(line, line + 1, frame.len);
+        line[frame.len] = '\0';
+        head += frame.len;
+        *rline = line;
+        parse_ctrlmsg(line, rtype, rval);
+        return frame.len + 1;
     }
-    else if (sscanf(line, "TIMEOUT=%d", &tmpint) == 1) {
-        *rtype = *line;
-        *rval = tmpint;
+
+    if (frame.type == CTRL_FRAME_ACK) {
+        /* turned back into the line, to be forwarded as it is */
+        static char ack[40];
+        const char *line = format_ctrlmsg(frame.acktype, frame.val);
+        if (line == NULL) {
+            fixme(0);
+            exit(FATAL_EXIT);
+        }
+        snprintf(ack, sizeof(ack), "%c %s", frame.done, line);
+        *rline = ack;
+        return strlen(ack) + 1;
     }
-    return len;
+
+    const char *line = format_ctrlmsg(frame.type, frame.val);
+    if (line == NULL) {
+        fixme(0);
+        exit(FATAL_EXIT);
+    }
+    *rtype = frame.type;
+    *rval = frame.val;
+    *rline = line;
+    return strlen(line) + 1;
 }
 
 static int recv_line(const char **rline) {
-    static char buf[256];
-    static char *nextp = buf;
-    static int nread = 0;
+    static struct linebuf lb = LINEBUF_INITIALIZER;
+    int len;
 
     *rline = NULL;
 
-    if (nextp > buf && nread > 0) {
-        memmove(buf, nextp, nread);
-    }
+    while (1) {
+        char *line = linebuf_next(&lb, &len);
+        if (line) {
+            *rline = line;
+            return len;
+        }
 
-    int n = 0;
-    do {
-        nread += n;
-
-        /* make sure '\n' has been read */
-        int odd = nread;
-        nextp = buf;
-        while (odd > 0) {
-            if (*nextp == '\n') {
-                *nextp++ = '\0';
-                nread = --odd;
-                *rline = buf;
-                return (nextp - buf) - 1;
+        if (wait_readable(ctrl_rfd) < 0) {
+            /* interrupted, and keep what has been read so far */
+            return -1;
+        }
+
+        int n = linebuf_fill(&lb, ctrl_rfd);
+        if (n == 0) {
+            /* got an EOF, and a line left unterminated is not one */
+            lb.head = lb.tail = lb.scan = lb.skip = 0;
+            return 0;
+        }
+        if (n < 0) {
+            if (errno != EINTR) {
+                /* got an unexpected errno */
+                fixme(errno);
+                exit(FATAL_EXIT);
             }
-            odd--;
-            nextp++;
+            /* interrupted by a signal before any data was read */
+            return -1;
         }
+    }
+}
 
-        if (sizeof(buf) - nread <= 0) {
-            errorpf(0, "too long control message received");
-            exit(OTHER_ERROR_EXIT);
+/* A line buffer for a control channel. A read() pulls in as many lines as
+   fit, and linebuf_next() hands them out in place, one by one. The data is
+   moved to the front only when the buffer has got full, and the buffer
+   grows up to CTRL_LINE_MAX for long lines. A line even longer than that
+   is truncated, and the rest of it is discarded. */
+int linebuf_fill(struct linebuf *lb, int fd) {
+    if (lb->buf == NULL) {
+        lb->buf = malloc(CTRL_BUFSIZE);
+        if (lb->buf == NULL) {
+            errorpf(errno, "malloc()");
+            exit(FATAL_EXIT);
         }
-        n = read(ctrl_rfd, buf + nread, sizeof(buf) - nread);
+        lb->size = CTRL_BUFSIZE;
+    }
 
-    } while (n > 0);
+    /* one byte is kept for the '\0' of a truncated line */
+    if (lb->tail >= lb->size - 1) {
+        if (lb->head > 0) {
+            memmove(lb->buf, lb->buf + lb->head, lb->tail - lb->head);
+            lb->tail -= lb->head;
+            lb->scan -= lb->head;
+            lb->head = 0;
+        } else {
+            int size = (lb->size * 2 < CTRL_LINE_MAX) ? lb->size * 2 : CTRL_LINE_MAX;
+            char *buf = realloc(lb->buf, size);
+            if (buf == NULL) {
+                errorpf(errno, "realloc()");
+                exit(FATAL_EXIT);
+            }
+            lb->buf = buf;
+            lb->size = size;
+        }
+    }
 
-    if (n == 0) {
-        /* got an EOF */
-        return 0;
+    int n = (fd == ctrl_rfd && ctrl_rfd_fds)
+        ? recv_ctrl_fds(fd, lb->buf + lb->tail, lb->size - 1 - lb->tail)
+        : read(fd, lb->buf + lb->tail, lb->size - 1 - lb->tail);
+    if (n > 0)
+        lb->tail += n;
+    return n;
+}
+
+/* Returns the next complete line with '\0' in place of '\n', or NULL if
+   none. The line is valid until the next linebuf_fill(). *rlen is set to
+   the length including the '\n', or, for a line truncated at CTRL_LINE_MAX,
+   to the length of what is kept, which has no '\n'. It is never 0. */
+char *linebuf_next(struct linebuf *lb, int *rlen) {
+    char *line, *nl;
+
+    if (lb->buf == NULL)
+        return NULL;
+
+    if (lb->skip) {
+        /* the rest of a truncated line */
+        nl = memchr(lb->buf + lb->head, '\n', lb->tail - lb->head);
+        if (nl == NULL) {
+            lb->head = lb->tail = lb->scan = 0;
+            return NULL;
+        }
+        lb->head = lb->scan = nl + 1 - lb->buf;
+        lb->skip = 0;
     }
 
-    /* n < 0 */
-    if (errno != EINTR) {
-        /* got an unexpected errno */
-        fixme(errno);
-        exit(FATAL_EXIT);
+    nl = memchr(lb->buf + lb->scan, '\n', lb->tail - lb->scan);
+    if (nl) {
+        *nl = '\0';
+        line = lb->buf + lb->head;
+        *rlen = nl + 1 - line;
+        lb->head = lb->scan = nl + 1 - lb->buf;
+        if (lb->head == lb->tail)
+            lb->head = lb->tail = lb->scan = 0;
+        return line;
     }
-    /* interrupted by a signal before any data was read */
-    return -1;
+    lb->scan = lb->tail;
+
+    if (lb->tail - lb->head >= CTRL_LINE_MAX - 1) {
+        lb->buf[lb->tail] = '\0';
+        line = lb->buf + lb->head;
+        *rlen = lb->tail - lb->head;
+        lb->head = lb->tail = lb->scan = 0;
+        lb->skip = 1;
+        return line;
+    }
+    return NULL;
+}
+
+void linebuf_free(struct linebuf *lb) {
+    free(lb->buf);
+    *lb = (struct linebuf) LINEBUF_INITIALIZER;
 }
 
 void send_ctrlmsgf(const char *fmt, ...) {
@@ -122,6 +371,10 @@ void send_ctrlmsgf(const char *fmt, ...) {
     ret = send_ctrlmsgf_internal(fmt, ap);
     va_end(ap);
 
+    handle_send_error(ret);
+}
+
+static void handle_send_error(int ret) {
     if (ret > 0) {
         return;
     }
@@ -134,6 +387,7 @@ void send_ctrlmsgf(const char *fmt, ...) {
 
         if (ret == EPIPE) {
             /* reading end has closed the fd */
+            drop_queue();
             close(ctrl_wfd);
             ctrl_wfd = -1;
             errorpf(ret, "control channel is closed");
@@ -141,6 +395,7 @@ void send_ctrlmsgf(const char *fmt, ...) {
         }
         else {
             /* got an unexpected errno */
+            drop_queue();
             close(ctrl_wfd);
             ctrl_wfd = -1;
             fixme(ret);
@@ -162,84 +417,349 @@ void send_ctrlmsgf_without_error_handling(const char *fmt, ...) {
 }
 
 static int send_ctrlmsgf_internal(const char *fmt, va_list ap) {
-    char *str;
+    char stackbuf[256], *str = stackbuf;
     int ret;
+    va_list ap2;
 
-    ret = vasprintf(&str, fmt, ap);
-    if (ret < 0 || str == NULL)
+    /* most messages fit in stackbuf, with a room for '\n' below */
+    va_copy(ap2, ap);
+    ret = vsnprintf(stackbuf, sizeof(stackbuf), fmt, ap2);
+    va_end(ap2);
+    if (ret < 0)
         return 0;
+    if (ret >= (int) sizeof(stackbuf)) {
+        ret = vasprintf(&str, fmt, ap);
+        if (ret < 0 || str == NULL)
+            return 0;
+    }
 
     ret = 1;
 
     if (ctrl_wfd >= 0) {
-        char *wptr = str;
         int len = strlen(str);
-        int n, wsize = len + 1;
 
         *(str + len) = '\n';    /* once, overwrite '\0' with '\n' */
+        ret = write_line(str, len + 1);
+        *(str + len) = '\0';    /* restore the '\0' above */
+    }
+    write_ctrl_log(str);
+    if (str != stackbuf)
+        free(str);
+    return ret;
+}
 
-        do {
-            n = write(ctrl_wfd, wptr, wsize);
-            if (n < 0) {
-                if (errno == EINTR) {
-                    /* try again */
-                    continue;
-                }
-                ret = -errno;
-                break;
+static int write_line(char *str, int len) {
+    char *wptr = str, *frame = NULL;
+    int n, wsize = len;
 
-            } else if (n == 0) {
-                /* write() returns 0 when nothing was written */
-                continue;
+    if (queue.enabled) {
+        int low = queue.low || strncmp(str, "NOTICE: ", 8) == 0;
 
-            } else if (n > 0) {
-                wptr += n;
-                wsize -= n;
-                if (wsize < 0) {
-                    errorpf(0, "BUG at %s:%d", __FILE__, __LINE__);
-                    exit(FATAL_EXIT);
-                }
+        if (enqueue(str, len, !low) < 0)
+            return -ENOMEM;
+
+        /* otherwise, written before waiting for the next, see
+           wait_readable() */
+        if (queue.count < CTRL_QUEUE_IOV)
+            return 1;
+        n = write_queue();
+        return (n < 0) ? n : 1;
+    }
+
+    if (ctrl_wfd_binary) {
+        /* a packet is written at once, or not at all */
+        frame = malloc(sizeof(struct ctrlframe) + len);
+        if (frame == NULL)
+            return -ENOMEM;
+        wptr = frame;
+        wsize = encode_frame(str, len, frame);
+    }
+
+    do {
+        n = write(ctrl_wfd, wptr, wsize);
+        if (n < 0) {
+            if (errno == EINTR) {
+                /* try again */
+                continue;
             }
-        } while (wsize > 0);
+            n = -errno;
+            free(frame);
+            return n;
+
+        } else if (n == 0) {
+            /* write() returns 0 when nothing was written */
+            continue;
+
+        } else if (n > 0) {
+            wptr += n;
+            wsize -= n;
+            if (wsize < 0) {
+                errorpf(0, "BUG at %s:%d", __FILE__, __LINE__);
+                exit(FATAL_EXIT);
+            }
+        }
+    } while (wsize > 0);
 
-        *(str + len) = '\0';    /* restore the '\0' above */
+    free(frame);
+    return 1;
+}
+
+/* Sends the done mark of a control message. */
+void send_ctrlack(char done, const char *line) {
+    queue.low = 1;
+    send_ctrlmsgf("%c %s", done, line);
+    queue.low = 0;
+}
+
+/* Encodes a line, which ends with '\n' at len, into dst, which has a
+   room for sizeof(struct ctrlframe) + len bytes. A known control message
+   takes no payload, nor does the done mark of one, such as "+ EXIT=0".
+   Returns the size of the frame. */
+static int encode_frame(const char *str, int len, char *dst) {
+    struct ctrlframe frame;
+    char *line = dst + sizeof(frame);
+
+    /* longer lines are truncated as recv_line() does */
+    if (--len > CTRL_LINE_MAX)
+        len = CTRL_LINE_MAX;
+    memcpy(line, str, len);
+    line[len] = '\0';
+
+    memset(&frame, 0, sizeof(frame));
+    parse_ctrlmsg(line, &frame.type, &frame.val);
+    if (frame.type == '\0' && len > 2 && line[1] == ' ' &&
+        (line[0] == '+' || line[0] == '%')) {
+        parse_ctrlmsg(line + 2, &frame.acktype, &frame.val);
+        if (frame.acktype != '\0') {
+            frame.type = CTRL_FRAME_ACK;
+            frame.done = line[0];
+        }
     }
-    if (ctrl_logfp) {
-        fprintf(ctrl_logfp, "%s\t%s\n", logtime(), str);
-        fflush(ctrl_logfp);
+    if (frame.type == '\0') {
+        frame.type = CTRL_FRAME_LINE;
+        frame.len = len;
     }
-    free(str);
-    return ret;
+    memcpy(dst, &frame, sizeof(frame));
+    return sizeof(frame) + frame.len;
 }
 
-static const char *logtime() {
-    static char fmt[64];
-    static char retbuf[64];
-    int ret;
-    struct tm* tm;
-    struct timeval tv;
+/* The outbound queue of the watchdog. ctrl_wfd is made non-blocking, and
+   send_ctrlmsgf() puts a line at the tail of the queue. The queue is
+   written out with writev(), as much as the pipe takes, when the watchdog
+   is going to wait for the next message, or CTRL_QUEUE_IOV lines are
+   pending. The rest is written when the pipe has become writable again,
+   see wait_readable(), so a slow reader never holds up the handling of
+   the deadline.
+
+   NOTICE: lines, the done marks and the lines forwarded from the
+   monitoring-target are dropped when CTRL_QUEUE_SIZE bytes of them are
+   pending, and the number of them is sent once there is room again, in
+   order with the rest. A forwarded line is dropped even if it looks like
+   a STDERR: line, as the monitoring-target may send any number of them.
+
+   The control messages, such as EXIT=N, and the STDERR: lines of the
+   watchdog itself are never dropped. While the pipe is full, a TIMEOUT=N
+   or TIMEOUT_MS=N relay replaces the one still queued, if any, so only
+   the latest is kept, and a heartbeat storm does not grow the queue
+   without a bound.
+
+   ctrl_wfd must not be shared with another process, since O_NONBLOCK is
+   set on the open file description. */
+void enable_ctrlmsg_queue() {
+    if (ctrl_wfd < 0)
+        return;
+
+    int flags = fcntl(ctrl_wfd, F_GETFL);
+    if (flags == -1 || fcntl(ctrl_wfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        errorpf(errno, "fcntl(O_NONBLOCK)");
+        return;
+    }
+    queue.enabled = 1;
+}
+
+/* A child of fork() has a new ctrl_wfd, and does not take over the lines
+   queued by its parent. */
+void disable_ctrlmsg_queue() {
+    drop_queue();
+    queue.dropped = 0;
+    queue.enabled = 0;
+}
+
+/* Returns 1 if some lines are waiting for ctrl_wfd to become writable. */
+int ctrlmsg_pending() {
+    return queue.head != NULL && ctrl_wfd >= 0;
+}
+
+/* Writes out the queue as far as possible without blocking. */
+void send_pending_ctrlmsg() {
+    if (!ctrlmsg_pending())
+        return;
+
+    int ret = write_queue();
+    handle_send_error((ret < 0) ? ret : 1);
+}
+
+/* Sends a line from the monitoring-target as it is. It is the first to be
+   dropped when the upstream is slow. */
+void forward_ctrlmsg(const char *line) {
+    queue.low = 1;
+    send_ctrlmsgf("%s", line);
+    queue.low = 0;
+}
+
+/* Writes out the whole queue, blocking if needed. This is done before
+   ctrl_wfd is closed, and errors are ignored as the fd is going. */
+void flush_ctrlmsg() {
+    if (queue.dropped > 0 && ctrl_wfd >= 0)
+        push_dropped();
 
-    ret = gettimeofday(&tv, NULL);
-    if (ret != 0)
-        goto fail;
+    while (ctrlmsg_pending()) {
+        if (write_queue() < 0) {
+            drop_queue();
+            break;
+        }
+        if (queue.head) {
+            struct pollfd pfd = { ctrl_wfd, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+        }
+    }
+}
+
+static int enqueue(const char *str, int len, int high) {
+    if (!high) {
+        /* with a room for the notice of push_dropped() */
+        long long room = CTRL_QUEUE_SIZE - queue.bytes - (queue.dropped ? 64 : 0);
+        if (len > room) {
+            queue.dropped++;
+            return 0;
+        }
+    }
+    /* before a control message, such as EXIT=N, even if no room */
+    if (queue.dropped > 0 && push_dropped() < 0)
+        return -1;
+    if (high)
+        coalesce_timeout(str);
+    return push(str, len, high);
+}
+
+/* Unlinks the TIMEOUT relay queued, if str is another one. The head is
+   kept once it has been partly written. */
+static void coalesce_timeout(const char *str) {
+    if (strncmp(str, "TIMEOUT=", 8) != 0 && strncmp(str, "TIMEOUT_MS=", 11) != 0)
+        return;
+
+    struct qline **pq = queue.timeoutp;
+    if (pq && queue.blocked && !(*pq == queue.head && queue.offset > 0)) {
+        struct qline *q = *pq;
+        *pq = q->next;
+        if (queue.tailp == &q->next)
+            queue.tailp = pq;
+        queue.count--;
+        free(q);
+    }
+    /* the new one is linked at the tail, see push() */
+    queue.timeoutp = queue.tailp;
+}
+
+static int push_dropped() {
+    char notice[64];
+
+    int n = snprintf(notice, sizeof(notice), "NOTICE: %ld control messages dropped",
+                     queue.dropped);
+    queue.dropped = 0;
+    write_ctrl_log(notice);
+    notice[n] = '\n';
+    return push(notice, n + 1, 0);
+}
 
-    tm = localtime(&tv.tv_sec);
-    if (tm == NULL)
-        goto fail;
+static int push(const char *str, int len, int high) {
+    int size = ctrl_wfd_binary ? (int) sizeof(struct ctrlframe) + len : len;
 
-    ret = strftime(fmt, sizeof(fmt), "%F %T.%%03d (%z)", tm);
-    if (ret <= 0)
-        goto fail;
+    struct qline *q = malloc(sizeof(*q) + size);
+    if (q == NULL)
+        return -1;
+    q->next = NULL;
+    q->high = high;
+    if (ctrl_wfd_binary) {
+        q->len = encode_frame(str, len, q->buf);
+    } else {
+        q->len = len;
+        memcpy(q->buf, str, len);
+    }
 
-    ret = snprintf(retbuf, sizeof(retbuf), fmt, tv.tv_usec / 1000);
-    if (ret <= 0 || ret >= (int) sizeof(retbuf))
-        goto fail;
+    *queue.tailp = q;
+    queue.tailp = &q->next;
+    queue.count++;
+    if (!high)
+        queue.bytes += q->len;
+    return 0;
+}
 
-    return retbuf;
+/* Returns 0, or -errno. EAGAIN is not an error. */
+static int write_queue() {
+    struct iovec iov[CTRL_QUEUE_IOV];
+
+    while (queue.head) {
+        int iovcnt = 0, size = 0;
+        for (struct qline *q = queue.head; q && iovcnt < CTRL_QUEUE_IOV; q = q->next) {
+            /* frames are coalesced into a packet the reader can take */
+            if (ctrl_wfd_binary && iovcnt > 0 && size + q->len > CTRL_PACKET_MAX)
+                break;
+            size += q->len;
 
-fail:
-    strcpy(retbuf, "0000-00-00 00:00:00.000 (+0000)");
-    return retbuf;
+            int skip = (q == queue.head) ? queue.offset : 0;
+            iov[iovcnt].iov_base = q->buf + skip;
+            iov[iovcnt].iov_len = q->len - skip;
+            iovcnt++;
+        }
+
+        ssize_t n = writev(ctrl_wfd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                queue.blocked = 1;
+                return 0;
+            }
+            return -errno;
+        }
+
+        /* pop the lines written out, and remember where the next starts */
+        n += queue.offset;
+        while (queue.head && n >= queue.head->len) {
+            struct qline *q = queue.head;
+            if (queue.timeoutp == &queue.head)
+                queue.timeoutp = NULL;
+            else if (queue.timeoutp == &q->next)
+                queue.timeoutp = &queue.head;
+            n -= q->len;
+            queue.head = q->next;
+            queue.count--;
+            if (!q->high)
+                queue.bytes -= q->len;
+            free(q);
+        }
+        queue.offset = n;
+        if (queue.head == NULL) {
+            queue.tailp = &queue.head;
+            queue.blocked = 0;
+        }
+    }
+    return 0;
+}
+
+static void drop_queue() {
+    while (queue.head) {
+        struct qline *q = queue.head;
+        queue.head = q->next;
+        free(q);
+    }
+    queue.tailp = &queue.head;
+    queue.timeoutp = NULL;
+    queue.blocked = 0;
+    queue.offset = 0;
+    queue.count = 0;
+    queue.bytes = 0;
 }
 
 /* vim: set et sw=4 sts=4: */
@@ -0,0 +1,207 @@
+/* Microbenchmark of the control channel parser, recv_ctrlmsg().
+
+   usage: ctrlbench [-n COUNT] [-l LENGTH]
+          ctrlbench -e BEATWATCH [-p PROTO] [-n COUNT]
+        -n COUNT    number of messages (default 2000000)
+        -l LENGTH   length of the STDERR: lines, every tenth message
+                    (default 100)
+        -e BEATWATCH
+                    measure the whole chain instead, see below
+        -p PROTO    passed to --ctrl-proto (default text)
+
+   A child process writes the messages to a pipe in large chunks, and
+   the parent parses them with recv_ctrlmsg() until EOF.
+
+   With -e, the child runs BEATWATCH with ctrlbench -t as the target,
+   which writes COUNT TIMEOUT=N messages to the control fd as fast as it
+   can. They go through the watchdog and the command-line process, and the
+   parent counts the lines coming out of the control fd of the latter. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* defined in main.c, which is not linked */
+int debug = 0;
+int verbose = 0;
+int last_exit_code = -1;
+int ctrl_kfd = -1;
+
+#define CHUNK   (64 * 1024)
+
+static void writer(int fd, long count, int length) {
+    static char chunk[CHUNK];
+    char stderr_line[length + 9];
+    int len = 0;
+
+    /* no STDERR: lines if length is 0 */
+    memset(stderr_line, 'x', length);
+    memcpy(stderr_line, "STDERR: ", 8);
+    stderr_line[length] = '\n';
+    stderr_line[length + 1] = '\0';
+
+    for (long i = 0; i < count; i++) {
+        const char *msg = (length > 0 && i % 10 == 9) ? stderr_line : "TIMEOUT=30\n";
+        int n = strlen(msg);
+
+        if (len + n > CHUNK) {
+            if (write(fd, chunk, len) != len)
+                _exit(1);
+            len = 0;
+        }
+        memcpy(chunk + len, msg, n);
+        len += n;
+    }
+    if (len > 0 && write(fd, chunk, len) != len)
+        _exit(1);
+    _exit(0);
+}
+
+/* Runs beatwatch with "ctrlbench -t" as the target, and counts the lines
+   from its control fd until EOF. */
+static int chain(const char *argv0, const char *beatwatch, const char *proto, long count) {
+    char countstr[32];
+    long nline = 0, ntimeout = 0;
+    int fd[2];
+
+    snprintf(countstr, sizeof(countstr), "%ld", count);
+    if (pipe(fd) != 0) {
+        perror("pipe()");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        if (dup2(fd[1], 5) != 5)
+            _exit(1);
+        execl(beatwatch, beatwatch, "--ctrl-fd", "5", "--ctrl-proto", proto, "--",
+              argv0, "-t", "-n", countstr, (char *) NULL);
+        perror(beatwatch);
+        _exit(1);
+    }
+    close(fd[1]);
+
+    FILE *fp = fdopen(fd[0], "r");
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        nline++;
+        if (strncmp(line, "% TIMEOUT=", 10) == 0)
+            ntimeout++;
+    }
+    fclose(fp);
+    waitpid(pid, NULL, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("proto=%s messages=%ld lines=%ld timeouts=%ld seconds=%.3f messages/s=%.0f\n",
+           proto, count, nline, ntimeout, sec, count / sec);
+
+    /* the first one is BASE_TIMEOUT from beatwatch itself */
+    return (ntimeout == count + 1) ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    long count = 2000000, nmsg = 0, ntimeout = 0;
+    int opt, length = 100, target = 0, fd[2];
+    const char *beatwatch = NULL, *proto = "text";
+
+    while ((opt = getopt(argc, argv, "n:l:e:p:t")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 'l':
+                length = atoi(optarg);
+                break;
+            case 'e':
+                beatwatch = optarg;
+                break;
+            case 'p':
+                proto = optarg;
+                break;
+            case 't':
+                target = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n COUNT] [-l LENGTH]\n"
+                                "       %s -e BEATWATCH [-p PROTO] [-n COUNT]\n",
+                        argv[0], argv[0]);
+                return 1;
+        }
+    }
+
+    if (target) {
+        /* the monitoring-target of chain() */
+        const char *str = getenv("BEATWATCH_CTRL_FD");
+        writer(str ? atoi(str) : 3, count, 0);
+    }
+    if (beatwatch) {
+        last_exit_code = chain(argv[0], beatwatch, proto, count);
+        return last_exit_code;
+    }
+
+    if (count <= 0 || length < 9) {
+        fprintf(stderr, "%s: invalid argument\n", argv[0]);
+        return 1;
+    }
+
+    errorpf_outfp = stderr;
+    errorpf_prefix = "ctrlbench";
+
+    if (pipe(fd) != 0) {
+        perror("pipe()");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        writer(fd[1], count, length);
+    }
+    close(fd[1]);
+    ctrl_rfd = fd[0];
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char type;
+    int val, ret;
+    const char *line;
+    while ((ret = recv_ctrlmsg(&type, &val, &line)) != 0) {
+        if (ret < 0)
+            continue;
+        nmsg++;
+        if (type == 'T')
+            ntimeout++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    waitpid(pid, NULL, 0);
+
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("messages=%ld timeouts=%ld seconds=%.3f messages/s=%.0f\n",
+           nmsg, ntimeout, sec, nmsg / sec);
+
+    last_exit_code = (nmsg == count) ? 0 : 1;
+    return last_exit_code;
+}
+
+/* vim: set et sw=4 sts=4: */
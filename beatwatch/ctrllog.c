@@ -0,0 +1,298 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for dup3() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* The control log writer. write_ctrl_log() only appends a line to the
+   front buffer, and a writer thread writes out the back buffer, so that
+   a stalled disk never delays the handling of control messages. If the
+   front buffer fills up, lines are dropped, and the number of them is
+   logged once there is room again.
+
+   Only the process that has written to the log runs the writer thread.
+   A child created via fork() starts with an empty buffer, the pending
+   lines belong to the parent. */
+
+#ifndef CONFIG_CTRL_LOG_BUFSIZE
+#define CONFIG_CTRL_LOG_BUFSIZE     (64 * 1024)
+#endif
+
+#define CTRL_LOG_BUFSIZE            (CONFIG_CTRL_LOG_BUFSIZE)
+
+long long ctrl_log_maxsize = 0;     /* rotate at this size if not 0 */
+
+static int log_fd = -1;
+static char *log_filename = NULL;
+static long long log_size = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int writer_running = 0;
+static int writer_busy = 0;         /* writing out the back buffer */
+static int closing = 0;
+static char buffers[2][CTRL_LOG_BUFSIZE];
+static char *front = buffers[0];
+static char *back = buffers[1];
+static int front_len = 0;
+static long dropped = 0;
+
+static int append(const char *stamp, int stamplen, const char *str);
+static void *writer_main(void *arg);
+static void write_out(const char *buf, int len);
+static void rotate(void);
+static int reopen(void);
+static int logtime(char *buf, int size);
+static void atfork_prepare(void);
+static void atfork_parent(void);
+static void atfork_child(void);
+
+int open_ctrl_log(const char *filename) {
+    log_filename = strdup(filename);
+    if (log_filename == NULL)
+        return -1;
+    if (reopen() < 0)
+        return -1;
+
+    int ret = pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+void write_ctrl_log(const char *str) {
+    char stamp[64];
+
+    if (log_fd < 0)
+        return;
+
+    int stamplen = logtime(stamp, sizeof(stamp));
+
+    pthread_mutex_lock(&lock);
+
+    if (!writer_running) {
+        int ret = pthread_create(&writer, NULL, writer_main, NULL);
+        if (ret == 0)
+            writer_running = 1;
+    }
+
+    if (dropped > 0) {
+        char notice[64];
+        snprintf(notice, sizeof(notice), "NOTICE: %ld control log lines dropped", dropped);
+        if (append(stamp, stamplen, notice) == 0)
+            dropped = 0;
+    }
+    if (append(stamp, stamplen, str) != 0)
+        dropped++;
+    pthread_cond_broadcast(&cond);
+
+    pthread_mutex_unlock(&lock);
+
+    if (!writer_running) {
+        /* no thread is available, so write it out by ourselves */
+        flush_ctrl_log();
+    }
+}
+
+/* Appends a line to the front buffer, or returns -1 if no room. */
+static int append(const char *stamp, int stamplen, const char *str) {
+    int len = strlen(str);
+
+    if (front_len + stamplen + 1 + len + 1 > CTRL_LOG_BUFSIZE)
+        return -1;
+
+    char *cp = front + front_len;
+    memcpy(cp, stamp, stamplen);
+    cp += stamplen;
+    *cp++ = '\t';
+    memcpy(cp, str, len);
+    cp += len;
+    *cp++ = '\n';
+    front_len = cp - front;
+    return 0;
+}
+
+/* Waits until all the lines written so far are on the disk. */
+void flush_ctrl_log() {
+    if (log_fd < 0)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (writer_running) {
+        while (front_len > 0 || writer_busy)
+            pthread_cond_wait(&cond, &lock);
+    } else if (front_len > 0) {
+        write_out(front, front_len);
+        front_len = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void close_ctrl_log() {
+    if (log_fd < 0)
+        return;
+
+    flush_ctrl_log();
+
+    if (writer_running) {
+        pthread_mutex_lock(&lock);
+        closing = 1;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(writer, NULL);
+        writer_running = 0;
+        closing = 0;
+    }
+
+    close(log_fd);
+    log_fd = -1;
+}
+
+static void *writer_main(void *arg) {
+    UNUSED(arg);
+
+    leave_realtime_thread();
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (front_len == 0 && !closing)
+            pthread_cond_wait(&cond, &lock);
+        if (front_len == 0 && closing)
+            break;
+
+        /* swap the buffers, and write out the back one without the lock */
+        char *buf = front;
+        int len = front_len;
+        front = back;
+        back = buf;
+        front_len = 0;
+        writer_busy = 1;
+        pthread_mutex_unlock(&lock);
+
+        write_out(buf, len);
+
+        pthread_mutex_lock(&lock);
+        writer_busy = 0;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void write_out(const char *buf, int len) {
+    if (ctrl_log_maxsize > 0 && log_size > 0 && log_size + len > ctrl_log_maxsize)
+        rotate();
+
+    while (len > 0) {
+        int n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* nowhere to report it; give up these lines */
+            return;
+        }
+        buf += n;
+        len -= n;
+        log_size += n;
+    }
+}
+
+static void rotate() {
+    int len = strlen(log_filename) + 16;
+    char from[len], to[len];
+
+    for (int i = CTRL_LOG_GENERATIONS - 1; i >= 0; i--) {
+        if (i == 0)
+            snprintf(from, len, "%s", log_filename);
+        else
+            snprintf(from, len, "%s.%d", log_filename, i);
+        snprintf(to, len, "%s.%d", log_filename, i + 1);
+        rename(from, to);
+    }
+    reopen();
+}
+
+/* (Re)opens the log file, keeping the fd number of the previous one. */
+static int reopen() {
+    int fd = open(log_filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+
+    if (log_fd >= 0 && fd != log_fd) {
+        int ret = dup3(fd, log_fd, O_CLOEXEC);
+        close(fd);
+        if (ret < 0)
+            return -1;
+        fd = log_fd;
+    }
+    log_fd = fd;
+
+    struct stat st;
+    log_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    return 0;
+}
+
+/* The strftime() part is cached, and redone only when the second changes.
+   Returns the length of the string. */
+static int logtime(char *buf, int size) {
+    static time_t cached_sec = -1;
+    static char head[32];       /* "%F %T." */
+    static char tail[16];       /* " (%z)" */
+    struct timeval tv;
+    struct tm *tm;
+
+    if (gettimeofday(&tv, NULL) != 0)
+        goto fail;
+
+    if (tv.tv_sec != cached_sec) {
+        tm = localtime(&tv.tv_sec);
+        if (tm == NULL)
+            goto fail;
+        if (strftime(head, sizeof(head), "%F %T.", tm) <= 0 ||
+            strftime(tail, sizeof(tail), " (%z)", tm) <= 0)
+            goto fail;
+        cached_sec = tv.tv_sec;
+    }
+
+    int ret = snprintf(buf, size, "%s%03d%s", head, (int) (tv.tv_usec / 1000), tail);
+    if (ret <= 0 || ret >= size)
+        goto fail;
+    return ret;
+
+fail:
+    cached_sec = -1;
+    return snprintf(buf, size, "%s", "0000-00-00 00:00:00.000 (+0000)");
+}
+
+static void atfork_prepare() {
+    pthread_mutex_lock(&lock);
+}
+
+static void atfork_parent() {
+    pthread_mutex_unlock(&lock);
+}
+
+static void atfork_child() {
+    /* the writer thread does not exist here */
+    writer_running = 0;
+    writer_busy = 0;
+    front_len = 0;
+    dropped = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+/* vim: set et sw=4 sts=4: */
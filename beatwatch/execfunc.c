@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 
 #include "errorpf.h"
 #include "global.h"
@@ -30,6 +31,17 @@ int execfunc() {
         exit(FATAL_EXIT);
     }
 
+    /* for libbeatwatch */
+    char str[16];
+    snprintf(str, sizeof(str), "%d", ctrl_kfd);
+    ret = setenv("BEATWATCH_CTRL_FD", str, 1);
+    if (ret != 0) {
+        errorpf(errno, "setenv()");
+        exit(FATAL_EXIT);
+    }
+
+    pass_beatpage();
+
     execvp(exec_argv[0], exec_argv);
     errorpf(errno, "execvp(%s)", exec_argv[0]);
 
@@ -39,6 +51,11 @@ int execfunc() {
 
     close(ctrl_kfd);
     ctrl_kfd = -1;
+    if (beat_kfd >= 0) {
+        close(beat_kfd);
+        beat_kfd = -1;
+    }
+    close_beatpage();
     return OTHER_ERROR_EXIT;
 }
 
@@ -0,0 +1,544 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for pipe2(), splice(), tee() and close_range() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* The flight recorder, with --flight-recorder. The stdout and stderr of
+   the monitoring-target are pipes to the watchdog, and a relay thread
+   passes the bytes through to the original fds, keeping the last
+   FLIGHT_RECORDER_SIZE bytes of each in a ring. The rings are written to
+   a file when the monitoring-target has timed out or exited abnormally.
+
+   On Linux, the bytes are passed through with splice(), after tee() has
+   duplicated them into a spare pipe, from which they are read into the
+   ring. The pass-through is never copied to user space. If the original
+   fd does not support splice(), such as on some terminals, or elsewhere,
+   read() and write() are used instead.
+
+   The relay stops when the monitoring-target has gone, after draining
+   what is in the pipes. If it is left running on BYE, the relay goes on
+   in a process of its own, left to init, until the monitoring-target has
+   closed its stdout and stderr, so that it never gets EPIPE. */
+
+#ifndef CONFIG_FLIGHT_RECORDER_SIZE
+#define CONFIG_FLIGHT_RECORDER_SIZE (2 * 1024 * 1024)  /* for each stream */
+#endif
+
+#define FLIGHT_RECORDER_SIZE        (CONFIG_FLIGHT_RECORDER_SIZE)
+#define RELAY_CHUNK                 (64 * 1024)
+
+const char *flight_recorder_filename = NULL;
+
+static struct stream {
+    const char *name;
+    int fd;                         /* 1 or 2 */
+    int pipefd[2];                  /* the monitoring-target writes to [1] */
+    int outfd;                      /* the original fd, or -1 if gone */
+    int spare[2];                   /* for tee(), or -1 if not used */
+    char *ring;
+    long long total;                /* bytes ever written to the ring */
+} streams[2] = {
+    { "stdout", 1, { -1, -1 }, -1, { -1, -1 }, NULL, 0 },
+    { "stderr", 2, { -1, -1 }, -1, { -1, -1 }, NULL, 0 },
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t relay;
+static int relay_running = 0;
+static int stop_pipe[2] = { -1, -1 };
+static int relay_errno = 0;         /* why the relay has stopped, read after join */
+
+static void *relay_main(void *arg);
+static void keep_relaying(void);
+static void close_other_fds(void);
+static int is_relay_fd(int fd);
+static int relay_once(struct stream *s, int nonblock);
+static int relay_copy(struct stream *s);
+static void pass_through(struct stream *s, const char *buf, int len);
+static void record(struct stream *s, const char *buf, int len);
+#ifdef __linux__
+static void record_from(struct stream *s, int fd, long long len);
+static void close_spare(struct stream *s);
+#endif
+static void wait_writable(int fd);
+static void dump_stream(FILE *fp, struct stream *s);
+static int open_pipe(int fds[2]);
+
+void create_flight_recorder() {
+    if (flight_recorder_filename == NULL)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        struct stream *s = &streams[i];
+
+        /* kept over --restart */
+        if (s->ring == NULL)
+            s->ring = malloc(FLIGHT_RECORDER_SIZE);
+        if (s->ring == NULL) {
+            errorpf(errno, "malloc()");
+            exit(FATAL_EXIT);
+        }
+        if (open_pipe(s->pipefd) < 0) {
+            errorpf(errno, "pipe()");
+            exit(FATAL_EXIT);
+        }
+#ifdef __linux__
+        if (open_pipe(s->spare) < 0) {
+            errorpf(errno, "pipe()");
+            exit(FATAL_EXIT);
+        }
+#endif
+        s->outfd = fcntl(s->fd, F_DUPFD_CLOEXEC, 3);
+    }
+    if (open_pipe(stop_pipe) < 0) {
+        errorpf(errno, "pipe()");
+        exit(FATAL_EXIT);
+    }
+}
+
+/* called by the monitoring-target */
+void enter_flight_recorder() {
+    if (flight_recorder_filename == NULL)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        struct stream *s = &streams[i];
+
+        /* the copy has not FD_CLOEXEC */
+        int ret = dup2(s->pipefd[1], s->fd);
+        if (ret == -1) {
+            errorpf(errno, "dup2()");
+            exit(FATAL_EXIT);
+        }
+        /* the others have FD_CLOEXEC, and are gone on execvp() */
+    }
+}
+
+/* called by the watchdog after fork() */
+void start_flight_recorder() {
+    sigset_t all, saved;
+
+    if (flight_recorder_filename == NULL)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        close(streams[i].pipefd[1]);
+        streams[i].pipefd[1] = -1;
+    }
+
+    /* signals are for the main thread, which waits on the control channel */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int ret = pthread_create(&relay, NULL, relay_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (ret != 0) {
+        errorpf(ret, "pthread_create()");
+        exit(FATAL_EXIT);
+    }
+    relay_running = 1;
+}
+
+/* Stops the relay after what is in the pipes has been passed through,
+   or hands it over to a process of its own if the monitoring-target is
+   left running. */
+void close_flight_recorder(int left_running) {
+    if (!relay_running)
+        return;
+
+    char c = 0;
+    if (write(stop_pipe[1], &c, 1) < 0)
+        fixme(errno);
+    pthread_join(relay, NULL);
+    relay_running = 0;
+    if (relay_errno) {
+        /* logging is not thread-safe, so it is done here */
+        errorpf(relay_errno, "poll()");
+        relay_errno = 0;
+    }
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+
+    if (left_running)
+        keep_relaying();
+
+    for (int i = 0; i < 2; i++) {
+        struct stream *s = &streams[i];
+        if (s->pipefd[0] >= 0) {
+            close(s->pipefd[0]);
+            s->pipefd[0] = -1;
+        }
+#ifdef __linux__
+        close_spare(s);
+#endif
+        if (s->outfd >= 0) {
+            close(s->outfd);
+            s->outfd = -1;
+        }
+    }
+}
+
+/* Appends the rings to the file, with why they are written. */
+void dump_flight_recorder(const char *reason) {
+    char stamp[64];
+    time_t t = time(NULL);
+
+    if (flight_recorder_filename == NULL || streams[0].ring == NULL)
+        return;
+
+    FILE *fp = fopen(flight_recorder_filename, "ae");
+    if (fp == NULL) {
+        errorpf(errno, "fopen(%s)", flight_recorder_filename);
+        return;
+    }
+
+    strftime(stamp, sizeof(stamp), "%F %T (%z)", localtime(&t));
+    fprintf(fp, "=== %s %s\n", stamp, reason);
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 2; i++)
+        dump_stream(fp, &streams[i]);
+    pthread_mutex_unlock(&lock);
+
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    noticepf("output of the monitoring-target written to %s", flight_recorder_filename);
+}
+
+static void *relay_main(void *arg) {
+    struct pollfd fds[3];
+    int open_streams = 0;
+
+    UNUSED(arg);
+
+    leave_realtime_thread();
+    for (int i = 0; i < 2; i++)
+        if (streams[i].pipefd[0] >= 0)
+            open_streams++;
+
+    while (open_streams > 0) {
+        for (int i = 0; i < 2; i++) {
+            fds[i].fd = streams[i].pipefd[0];
+            fds[i].events = POLLIN;
+        }
+        fds[2].fd = stop_pipe[0];
+        fds[2].events = POLLIN;
+
+        int ret = poll(fds, 3, -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            /* not logged here, see relay_errno */
+            relay_errno = errno;
+            break;
+        }
+
+        if (fds[2].revents) {
+            /* drain, then stop */
+            for (int i = 0; i < 2; i++)
+                if (streams[i].pipefd[0] >= 0)
+                    while (relay_once(&streams[i], 1) > 0)
+                        ;
+            break;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            if (relay_once(&streams[i], 0) <= 0) {
+                /* the writers have all gone, and poll() ignores fd -1 */
+                fds[i].fd = -1;
+                close(streams[i].pipefd[0]);
+                streams[i].pipefd[0] = -1;
+                open_streams--;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Runs the relay in a grandchild, which has only the fds of the relay, and
+   exits when the writers have all gone. */
+static void keep_relaying() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        errorpf(errno, "fork()");
+        return;
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    /* left to init, so that the watchdog has nothing to reap */
+    if (fork() != 0)
+        _exit(0);
+
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    /* nothing else, such as the control channel, is to be held open */
+    close_other_fds();
+
+    relay_main(NULL);
+    if (relay_errno)
+        errorpf(relay_errno, "poll()");
+    _exit(0);
+}
+
+/* Closes the fds from 3 on, but those of the relay. close_range() skips
+   over the relay fds, otherwise /proc/self/fd is walked, and only where
+   neither is available, every fd up to _SC_OPEN_MAX is tried. */
+static void close_other_fds() {
+#ifdef CLOSE_RANGE_CLOEXEC
+    int keep[8], n = 0;
+
+    for (int i = 0; i < 2; i++) {
+        struct stream *s = &streams[i];
+        int fds[4] = { s->pipefd[0], s->outfd, s->spare[0], s->spare[1] };
+        for (int j = 0; j < 4; j++) {
+            /* in ascending order */
+            int k = n++;
+            for (; k > 0 && keep[k - 1] > fds[j]; k--)
+                keep[k] = keep[k - 1];
+            keep[k] = fds[j];
+        }
+    }
+
+    unsigned int from = 3;
+    for (int i = 0; i < n; i++) {
+        if (keep[i] < (int) from)
+            continue;
+        if (keep[i] > (int) from && close_range(from, keep[i] - 1, 0) != 0)
+            goto fallback;
+        from = keep[i] + 1;
+    }
+    if (close_range(from, ~0U, 0) == 0)
+        return;
+
+fallback:
+#endif
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            int fd = atoi(ent->d_name);
+            if (fd >= 3 && fd != dirfd(dir) && !is_relay_fd(fd))
+                close(fd);
+        }
+        closedir(dir);
+        return;
+    }
+
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 1024 * 1024)
+        max = 1024 * 1024;
+    for (int fd = 3; fd < max; fd++)
+        if (!is_relay_fd(fd))
+            close(fd);
+}
+
+static int is_relay_fd(int fd) {
+    for (int i = 0; i < 2; i++) {
+        struct stream *s = &streams[i];
+        if (fd == s->pipefd[0] || fd == s->outfd || fd == s->spare[0] || fd == s->spare[1])
+            return 1;
+    }
+    return 0;
+}
+
+/* Passes through and records what is in the pipe. Returns the bytes
+   relayed, or 0 on EOF (or nothing left, with nonblock). */
+static int relay_once(struct stream *s, int nonblock) {
+#ifdef __linux__
+    if (s->spare[0] >= 0 && s->outfd >= 0) {
+        /* duplicate the bytes without consuming them */
+        unsigned int flags = nonblock ? SPLICE_F_NONBLOCK : 0;
+        ssize_t n = tee(s->pipefd[0], s->spare[1], RELAY_CHUNK, flags);
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            /* no zero-copy path for this pipe */
+            close_spare(s);
+            goto copy;
+        }
+
+        /* consume them to the original fd */
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t m = splice(s->pipefd[0], NULL, s->outfd, NULL, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && errno == EAGAIN) {
+                wait_writable(s->outfd);
+                continue;
+            }
+            if (m <= 0)
+                break;
+            left -= m;
+        }
+
+        /* the duplicate goes to the ring */
+        record_from(s, s->spare[0], n);
+
+        if (left > 0) {
+            /* EINVAL if the original fd cannot splice(), such as some
+               terminals, or it has gone. Either way, no more splice(). */
+            close_spare(s);
+            while (left > 0) {
+                char buf[RELAY_CHUNK];
+                ssize_t m = read(s->pipefd[0], buf, left);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m <= 0)
+                    break;
+                pass_through(s, buf, m);
+                left -= m;
+            }
+        }
+        return n;
+    }
+
+copy:
+#endif
+    if (nonblock) {
+        struct pollfd pfd = { s->pipefd[0], POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0)
+            return 0;
+    }
+    return relay_copy(s);
+}
+
+static int relay_copy(struct stream *s) {
+    char buf[RELAY_CHUNK];
+
+    ssize_t n = read(s->pipefd[0], buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+        return 1;
+    if (n <= 0)
+        return 0;
+    pass_through(s, buf, n);
+    record(s, buf, n);
+    return n;
+}
+
+static void pass_through(struct stream *s, const char *buf, int len) {
+    while (len > 0 && s->outfd >= 0) {
+        ssize_t n = write(s->outfd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            wait_writable(s->outfd);
+            continue;
+        }
+        if (n < 0) {
+            /* the original fd has gone, and only the ring is kept */
+            close(s->outfd);
+            s->outfd = -1;
+            break;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void record(struct stream *s, const char *buf, int len) {
+    pthread_mutex_lock(&lock);
+    while (len > 0) {
+        int pos = s->total % FLIGHT_RECORDER_SIZE;
+        int n = FLIGHT_RECORDER_SIZE - pos;
+        if (n > len)
+            n = len;
+        memcpy(s->ring + pos, buf, n);
+        s->total += n;
+        buf += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+#ifdef __linux__
+/* Reads len bytes from fd right into the ring. */
+static void record_from(struct stream *s, int fd, long long len) {
+    pthread_mutex_lock(&lock);
+    while (len > 0) {
+        int pos = s->total % FLIGHT_RECORDER_SIZE;
+        int n = FLIGHT_RECORDER_SIZE - pos;
+        if (n > len)
+            n = len;
+        ssize_t m = read(fd, s->ring + pos, n);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            break;
+        s->total += m;
+        len -= m;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void close_spare(struct stream *s) {
+    if (s->spare[0] >= 0) {
+        close(s->spare[0]);
+        close(s->spare[1]);
+        s->spare[0] = s->spare[1] = -1;
+    }
+}
+#endif
+
+/* for an original fd left in non-blocking mode */
+static void wait_writable(int fd) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    poll(&pfd, 1, -1);
+}
+
+static void dump_stream(FILE *fp, struct stream *s) {
+    long long len = (s->total < FLIGHT_RECORDER_SIZE) ? s->total : FLIGHT_RECORDER_SIZE;
+    int pos = s->total % FLIGHT_RECORDER_SIZE;
+
+    fprintf(fp, "--- %s (last %lld of %lld bytes)\n", s->name, len, s->total);
+    if (len == 0)
+        return;
+
+    /* the oldest part first */
+    if (len == FLIGHT_RECORDER_SIZE)
+        fwrite(s->ring + pos, 1, FLIGHT_RECORDER_SIZE - pos, fp);
+    fwrite(s->ring, 1, pos, fp);
+
+    if (s->ring[(s->total - 1) % FLIGHT_RECORDER_SIZE] != '\n')
+        fprintf(fp, "\n");
+}
+
+static int open_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -1,16 +1,42 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include "errorpf.h"
 #include "global.h"
 
+/* With --ctrl-proto binary, the control channel between the cmdline and
+   the watchdog is a SOCK_SEQPACKET socket carrying frames, instead of a
+   pipe. It is only for that first one, and the watchdog talks to the
+   monitoring-target over a pipe. With --restart, that one is a unix domain
+   socket instead, so that file descriptors can be passed on it. It is left
+   both ways, for PROMOTE to a standby (see restart.c). */
 int pipe_and_fork() {
-    int fd[2];
+    int fd[2], ret;
+    int binary = ctrl_binary;
+    int fds = ctrl_fds && !binary;
 
-    int ret = pipe(fd);
-    if (ret != 0) {
-        errorpf(errno, "pipe()");
-        exit(FATAL_EXIT);
+    if (fds) {
+        ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+        if (ret != 0) {
+            errorpf(errno, "socketpair()");
+            exit(FATAL_EXIT);
+        }
+    } else if (binary) {
+        ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd);
+        if (ret != 0) {
+            errorpf(errno, "socketpair()");
+            exit(FATAL_EXIT);
+        }
+        /* one way only, as a pipe */
+        shutdown(fd[0], SHUT_WR);
+        shutdown(fd[1], SHUT_RD);
+    } else {
+        ret = pipe(fd);
+        if (ret != 0) {
+            errorpf(errno, "pipe()");
+            exit(FATAL_EXIT);
+        }
     }
 
     int child_pid = fork();
@@ -24,6 +50,10 @@ int pipe_and_fork() {
         if (ctrl_wfd >= 0)
             close(ctrl_wfd);
         ctrl_wfd = fd[1];
+        disable_ctrlmsg_queue();
+        ctrl_wfd_binary = binary;
+        ctrl_binary = 0;
+        ctrl_fds = 0;
         return 0;
     }
 
@@ -32,6 +62,8 @@ int pipe_and_fork() {
     if (ctrl_rfd >= 0)
         close(ctrl_rfd);
     ctrl_rfd = fd[0];
+    ctrl_rfd_binary = binary;
+    ctrl_rfd_fds = fds;
     return child_pid;
 }
 
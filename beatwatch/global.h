@@ -1,7 +1,7 @@
 #include <stdio.h>
 
 #ifndef CONFIG_UNIT_TIME
-#define CONFIG_UNIT_TIME        250 /* in millisecond; must be a divisor of 1000 */
+#define CONFIG_UNIT_TIME        250 /* in millisecond; polling interval after SIGTERM */
 #endif
 
 #ifndef CONFIG_BASE_TIMEOUT
@@ -20,11 +20,57 @@
 #define CONFIG_HOLDON_DELAY     2   /* in seond */
 #endif
 
+#ifndef CONFIG_CTRL_LOG_GENERATIONS
+#define CONFIG_CTRL_LOG_GENERATIONS 3   /* <F>.1 ... <F>.3 on rotation */
+#endif
+
+#ifndef CONFIG_CTRL_BUFSIZE
+#define CONFIG_CTRL_BUFSIZE     4096    /* initial size of a line buffer */
+#endif
+
+#ifndef CONFIG_CTRL_LINE_MAX
+#define CONFIG_CTRL_LINE_MAX    (64 * 1024) /* longer lines are truncated */
+#endif
+
+#ifndef CONFIG_CTRL_QUEUE_SIZE
+#define CONFIG_CTRL_QUEUE_SIZE  (64 * 1024) /* outbound lines that may be dropped */
+#endif
+
+#ifndef CONFIG_ADAPTIVE_MIN_SAMPLES
+#define CONFIG_ADAPTIVE_MIN_SAMPLES 16  /* gaps needed before adapting */
+#endif
+
+#ifndef CONFIG_ADAPTIVE_WINDOW
+#define CONFIG_ADAPTIVE_WINDOW  1024    /* the histogram is halved at this */
+#endif
+
+#ifndef CONFIG_STARVATION_PROBE
+#define CONFIG_STARVATION_PROBE 500     /* in millisecond; CPU starvation check */
+#endif
+
+#ifndef CONFIG_LIVENESS_INTERVAL
+#define CONFIG_LIVENESS_INTERVAL 1000   /* in millisecond; resource sampling */
+#endif
+
+#ifndef CONFIG_REALTIME_LATE
+#define CONFIG_REALTIME_LATE    10      /* in millisecond; a later wakeup is logged */
+#endif
+
 #define UNIT_TIME               (CONFIG_UNIT_TIME)
 #define BASE_TIMEOUT            (CONFIG_BASE_TIMEOUT)
 #define EXTRA_TIMEOUT           (CONFIG_EXTRA_TIMEOUT)
 #define SIGKILL_DELAY           (CONFIG_SIGKILL_DELAY)
 #define HOLDON_DELAY            (CONFIG_HOLDON_DELAY)
+#define CTRL_LOG_GENERATIONS    (CONFIG_CTRL_LOG_GENERATIONS)
+#define CTRL_BUFSIZE            (CONFIG_CTRL_BUFSIZE)
+#define CTRL_LINE_MAX           (CONFIG_CTRL_LINE_MAX)
+#define CTRL_QUEUE_SIZE         (CONFIG_CTRL_QUEUE_SIZE)
+#define CTRL_QUEUE_IOV          64  /* lines per writev() */
+#define LIVENESS_INTERVAL       (CONFIG_LIVENESS_INTERVAL)
+#define ADAPTIVE_MIN_SAMPLES    (CONFIG_ADAPTIVE_MIN_SAMPLES)
+#define ADAPTIVE_WINDOW         (CONFIG_ADAPTIVE_WINDOW)
+#define STARVATION_PROBE        (CONFIG_STARVATION_PROBE)
+#define REALTIME_LATE           (CONFIG_REALTIME_LATE)
 
 #define NORMAL_EXIT             (0)
 #define OTHER_ERROR_EXIT        (1) /* Errors other than the following */
@@ -39,6 +85,7 @@
 #define UNUSED(var)             (void)(var)
 
 extern int debug;
+extern int verbose;
 extern int last_exit_code;
 extern int ctrl_kfd;
 extern char *const *exec_argv;
@@ -47,21 +94,164 @@ int pipe_and_fork(void);
 int cmdline(void);
 int watchdog(void);
 int execfunc(void);
+int multiwatch(const char *filename);
 
 /* sigmisc.c */
 void set_killpid(int pid);
 void set_timeout(int timeout);
+void set_timeout_ms(long long timeout);
 void init_sighandler(void);
-void set_alarm_timer(void);
+void init_deadline_timer(void);
+int wait_readable(int fd);
+void watch_standby(int pid);
 int continue_sighandler(void);
+void restart_timer(void);
+void update_deadline_timer(void);
+int take_abort_signo(void);
+int wait_exit(int pid, long long timeout);
+void report_kill_latency(int pid);
 int set_onexit_script(const char *str);
 
+/* beatpage.c */
+extern int beat_kfd;
+void create_beatpage(void);
+void pass_beatpage(void);
+long long beatpage_deadline(void);
+void close_beatpage(void);
+
+/* cgroup.c */
+extern const char *cgroup_parent;
+void create_cgroup(void);
+void enter_cgroup(void);
+int kill_cgroup(void);
+int cgroup_usage(long long *rcpu, long long *rmem);
+void keep_cgroup(void);
+void close_cgroup(void);
+
+/* liveness.c */
+extern long long max_rss;
+extern int max_rss_sec;
+extern int max_cpu;
+extern int max_cpu_sec;
+void init_liveness(int pid);
+void close_liveness(void);
+long long liveness_due(void);
+void liveness_beat(long long now);
+int check_liveness(long long now);
+
+/* adaptive.c */
+extern long long adaptive_min;
+extern long long adaptive_max;
+extern double adaptive_quantile;
+extern double adaptive_factor;
+void init_adaptive(void);
+long long adapt_timeout(long long now, long long requested);
+
+/* starve.c */
+extern int starvation_grace;
+void init_starvation(int pid);
+long long start_starvation_probe(void);
+long long check_starvation(void);
+
+/* flightrec.c */
+extern const char *flight_recorder_filename;
+void create_flight_recorder(void);
+void enter_flight_recorder(void);
+void start_flight_recorder(void);
+void close_flight_recorder(int left_running);
+void dump_flight_recorder(const char *reason);
+
+/* restart.c */
+extern int restart_limit;
+extern int restart_standby;
+extern long long restart_min;
+extern long long restart_max;
+long long restart_backoff(long long ran, int standby);
+int recv_ctrl_fds(int fd, char *buf, int len);
+void store_fds(int n);
+void drop_pending_fds(void);
+void pass_stored_fds(void);
+void close_stored_fds(void);
+
+/* realtime.c */
+extern int realtime;
+extern int realtime_policy;
+extern int realtime_priority;
+void init_realtime(void);
+void leave_realtime_thread(void);
+void leave_realtime(void);
+void realtime_wakeup(long long due);
+void report_realtime(void);
+
+/* namedbeat.c */
+int named_beat(const char *line);
+long long named_beat_due(void);
+long long check_named_beats(long long now, const char **rname);
+void close_named_beats(void);
+
+/* hangdump.c */
+extern const char *hang_dump_filename;
+extern int hang_dump_ustack;
+void dump_hang(int killpid, const char *cause);
+
+/* ctrllog.c */
+extern long long ctrl_log_maxsize;
+int open_ctrl_log(const char *filename);
+void write_ctrl_log(const char *str);
+void flush_ctrl_log(void);
+void close_ctrl_log(void);
+
 /* ctrl.c */
+struct linebuf {
+    char *buf;
+    int size;
+    int head;                   /* the next line starts here */
+    int tail;                   /* end of the data */
+    int scan;                   /* no '\n' between head and here */
+    int skip;                   /* discarding the rest of a too long line */
+};
+#define LINEBUF_INITIALIZER     { NULL, 0, 0, 0, 0, 0 }
 extern int ctrl_rfd;
 extern int ctrl_wfd;
-extern FILE *ctrl_logfp;
+extern int ctrl_binary;
+extern int ctrl_rfd_binary;
+extern int ctrl_wfd_binary;
+extern int ctrl_fds;
+extern int ctrl_rfd_fds;
 int recv_ctrlmsg(char *rtype, int *rval, const char **rline);
+void parse_ctrlmsg(const char *line, char *rtype, int *rval);
+int linebuf_fill(struct linebuf *lb, int fd);
+char *linebuf_next(struct linebuf *lb, int *rlen);
+void linebuf_free(struct linebuf *lb);
 void send_ctrlmsgf(const char *fmt, ...);
 void send_ctrlmsgf_without_error_handling(const char *fmt, ...);
+void send_ctrlack(char done, const char *line);
+void enable_ctrlmsg_queue(void);
+void disable_ctrlmsg_queue(void);
+int ctrlmsg_pending(void);
+void send_pending_ctrlmsg(void);
+void forward_ctrlmsg(const char *line);
+void flush_ctrlmsg(void);
+
+/* procfs.c */
+int read_small(const char *path, char *buf, int size);
+int pread_small(int fd, char *buf, int size);
+
+/* timerq.c */
+struct tqnode {
+    long long deadline;         /* in millisecond, see monotonic_ms() */
+    int index;                  /* position in the heap, or -1 */
+};
+struct timerq {
+    struct tqnode **heap;
+    int len;
+    int cap;
+};
+long long monotonic_ms(void);
+long long monotonic_us(void);
+void tq_init(struct tqnode *node);
+int tq_set(struct timerq *tq, struct tqnode *node, long long deadline);
+void tq_cancel(struct timerq *tq, struct tqnode *node);
+struct tqnode *tq_first(struct timerq *tq);
 
 /* vim: set et sw=4 sts=4: */
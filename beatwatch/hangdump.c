@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <elf.h>
+#include <sys/uio.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#endif
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Hang diagnostics, with --hang-dump. Just before SIGTERM is sent on a
+   timeout, the state of every thread of every process in the process
+   group of the monitoring-target is appended to a file: the state, wchan,
+   the current system call and the kernel stack, each where readable.
+
+   With --hang-dump-ustack, each thread is also stopped for a moment with
+   ptrace(), and its user-space stack is sampled by walking the frame
+   pointers. Frames of code built without them are missed. A thread in
+   uninterruptible sleep (state D) does not stop until it wakes up, so it
+   is skipped; its kernel stack tells more anyway. */
+
+#ifndef CONFIG_HANG_DUMP_FRAMES
+#define CONFIG_HANG_DUMP_FRAMES     32
+#endif
+
+#define HANG_DUMP_FRAMES            (CONFIG_HANG_DUMP_FRAMES)
+
+const char *hang_dump_filename = NULL;
+int hang_dump_ustack = 0;
+
+static int in_group(int pid, int pgid);
+static void dump_process(FILE *fp, int pid);
+static void dump_thread(FILE *fp, int pid, int tid);
+static void dump_file(FILE *fp, const char *label, const char *path);
+static void dump_ustack(FILE *fp, int pid, int tid);
+
+/* killpid is the PID, or the process group as -PGID. cause tells why it
+   is about to be terminated, such as "timed out". */
+void dump_hang(int killpid, const char *cause) {
+    char stamp[64];
+    time_t t = time(NULL);
+
+    if (hang_dump_filename == NULL || killpid == -1 || killpid == 0)
+        return;
+
+    FILE *fp = fopen(hang_dump_filename, "ae");
+    if (fp == NULL) {
+        errorpf(errno, "fopen(%s)", hang_dump_filename);
+        return;
+    }
+
+    strftime(stamp, sizeof(stamp), "%F %T (%z)", localtime(&t));
+    fprintf(fp, "=== %s PID=%d %s\n", stamp, killpid, cause);
+
+    if (killpid > 0) {
+        dump_process(fp, killpid);
+    } else {
+        DIR *dir = opendir("/proc");
+        struct dirent *ent;
+
+        if (dir) {
+            while ((ent = readdir(dir)) != NULL) {
+                int pid = atoi(ent->d_name);
+                if (pid > 0 && in_group(pid, -killpid))
+                    dump_process(fp, pid);
+            }
+            closedir(dir);
+        }
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    noticepf("hang diagnostics of PID=%d written to %s", killpid, hang_dump_filename);
+}
+
+static int in_group(int pid, int pgid) {
+    char path[64], buf[1024];
+    int pgrp;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (read_small(path, buf, sizeof(buf)) < 0)
+        return 0;
+
+    /* the 5th field, after "PID (COMM) STATE PPID" */
+    char *cp = strrchr(buf, ')');
+    return cp && sscanf(cp + 2, "%*c %*d %d", &pgrp) == 1 && pgrp == pgid;
+}
+
+static void dump_process(FILE *fp, int pid) {
+    char path[64];
+    struct dirent *ent;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    while ((ent = readdir(dir)) != NULL) {
+        int tid = atoi(ent->d_name);
+        if (tid > 0)
+            dump_thread(fp, pid, tid);
+    }
+    closedir(dir);
+}
+
+static void dump_thread(FILE *fp, int pid, int tid) {
+    char path[96], buf[1024], comm[64] = "?", state = '?';
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    if (read_small(path, buf, sizeof(buf)) > 0) {
+        char *open = strchr(buf, '('), *close = strrchr(buf, ')');
+        if (open && close && close > open) {
+            snprintf(comm, sizeof(comm), "%.*s", (int) (close - open - 1), open + 1);
+            state = close[2];
+        }
+    }
+    fprintf(fp, "--- PID=%d TID=%d (%s) state=%c\n", pid, tid, comm, state);
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/wchan", pid, tid);
+    dump_file(fp, "wchan", path);
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", pid, tid);
+    dump_file(fp, "syscall", path);
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stack", pid, tid);
+    dump_file(fp, "stack", path);
+
+    if (hang_dump_ustack && state == 'D')
+        fprintf(fp, "ustack: skipped in state D\n");
+    else if (hang_dump_ustack)
+        dump_ustack(fp, pid, tid);
+}
+
+/* Writes the content of the file, on the same line if it is one line. */
+static void dump_file(FILE *fp, const char *label, const char *path) {
+    char buf[4096];
+
+    int n = read_small(path, buf, sizeof(buf));
+    if (n <= 0)
+        return;
+    if (buf[n - 1] == '\n')
+        buf[--n] = '\0';
+
+    if (strchr(buf, '\n'))
+        fprintf(fp, "%s:\n%s\n", label, buf);
+    else
+        fprintf(fp, "%s: %s\n", label, buf);
+}
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+/* Writes "FILE+OFFSET" of the mapping that addr is in. */
+static void print_symbol(FILE *fp, int pid, unsigned long addr) {
+    char path[64], line[4096];
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *maps = fopen(path, "re");
+    if (maps == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, end, offset;
+        int pos = 0;
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n", &start, &end, &offset, &pos) < 3)
+            continue;
+        if (addr < start || end <= addr)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        fprintf(fp, " %s+0x%lx", (pos > 0 && line[pos]) ? line + pos : "?",
+                addr - start + offset);
+        break;
+    }
+    fclose(maps);
+}
+
+/* Waits for the tracee to stop, up to limit in millisecond. Only
+   WSTOPPED is waited for, so that the exit status of the monitoring-target
+   is never taken here, and not for long, in case it has exited instead. */
+static int wait_stopped(int tid, int limit) {
+    int interval = 1;   /* millisecond */
+    siginfo_t info;
+
+    for (int count = limit / interval; count > 0; count--) {
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, tid, &info, WSTOPPED | WNOHANG | __WALL) != 0)
+            return -1;
+        if (info.si_pid == tid)
+            return 0;
+        usleep(interval * 1000);
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/* PTRACE_DETACH fails unless the tracee has stopped, and a tracee left
+   attached would hold the SIGTERM to come in a signal-delivery-stop, so
+   the stop is waited for longer if it has not come yet. */
+static void detach(FILE *fp, int tid, int stopped) {
+    if (!stopped)
+        wait_stopped(tid, 1000);
+    if (ptrace(PTRACE_DETACH, tid, NULL, NULL) != 0)
+        fprintf(fp, "ustack: ptrace(PTRACE_DETACH): %s\n", strerror(errno));
+}
+
+static void dump_ustack(FILE *fp, int pid, int tid) {
+    struct user_regs_struct regs;
+    struct iovec iov = { &regs, sizeof(regs) };
+    unsigned long pc, fp_reg;
+
+    if (ptrace(PTRACE_SEIZE, tid, NULL, NULL) != 0) {
+        fprintf(fp, "ustack: ptrace(PTRACE_SEIZE): %s\n", strerror(errno));
+        return;
+    }
+    int stopped = ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == 0 &&
+                  wait_stopped(tid, 100) == 0;
+    if (!stopped || ptrace(PTRACE_GETREGSET, tid, (void *) NT_PRSTATUS, &iov) != 0) {
+        fprintf(fp, "ustack: ptrace(): %s\n", strerror(errno));
+        detach(fp, tid, stopped);
+        return;
+    }
+
+#if defined(__x86_64__)
+    pc = regs.rip;
+    fp_reg = regs.rbp;
+#else
+    pc = regs.pc;
+    fp_reg = regs.regs[29];
+#endif
+
+    fprintf(fp, "ustack:\n");
+    for (int i = 0; i < HANG_DUMP_FRAMES && pc; i++) {
+        fprintf(fp, "#%d 0x%lx", i, pc);
+        print_symbol(fp, pid, pc);
+        fprintf(fp, "\n");
+
+        /* the saved frame pointer, and the return address next to it */
+        if (fp_reg == 0 || (fp_reg & (sizeof(long) - 1)))
+            break;
+        errno = 0;
+        unsigned long next = ptrace(PTRACE_PEEKDATA, tid, (void *) fp_reg, NULL);
+        unsigned long ret = ptrace(PTRACE_PEEKDATA, tid, (void *) (fp_reg + sizeof(long)), NULL);
+        if (errno != 0 || next <= fp_reg)
+            break;
+        fp_reg = next;
+        pc = ret;
+    }
+
+    detach(fp, tid, 1);
+}
+#else
+static void dump_ustack(FILE *fp, int pid, int tid) {
+    UNUSED(pid);
+    UNUSED(tid);
+    fprintf(fp, "ustack: not supported on this platform\n");
+}
+#endif
+
+/* vim: set et sw=4 sts=4: */
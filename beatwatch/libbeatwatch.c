@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "beatwatch.h"
+
+/* libbeatwatch: the client side of the control channel, see beatwatch.h.
+   Only atomic operations, clock_gettime(), write() and sendmsg() are used
+   after bw_init(), which keeps the functions async-signal-safe, except
+   bw_stored_fds() and bw_standby(). */
+
+#ifndef CONFIG_BW_DEFAULT_TIMEOUT
+#define CONFIG_BW_DEFAULT_TIMEOUT   5000    /* in millisecond */
+#endif
+
+#ifndef CONFIG_BW_FDS_MAX
+#define CONFIG_BW_FDS_MAX           32  /* per FDSTORE=N, as the watchdog */
+#endif
+
+#ifndef CONFIG_BW_NAME_MAX
+#define CONFIG_BW_NAME_MAX          64  /* of bw_beat_named(), as the watchdog */
+#endif
+
+#ifndef CONFIG_BW_COALESCE_DIVISOR
+#define CONFIG_BW_COALESCE_DIVISOR  8   /* coalescing window is timeout/8 */
+#endif
+
+enum {
+    BW_UNINIT,
+    BW_INITIALIZING,
+    BW_READY,
+    BW_UNAVAILABLE,         /* not running under beatwatch */
+};
+
+static int state = BW_UNINIT;
+static int ctrl_fd = -1;
+static struct beatwatch_page *page = NULL;
+static unsigned int timeout_ms = CONFIG_BW_DEFAULT_TIMEOUT;
+static long long last_sent = 0;         /* when TIMEOUT_MS=N was sent */
+
+static int ensure_init(void);
+static int envfd(const char *name, int defval);
+static long long now_ms(void);
+static int send_msg(const char *prefix, long long val, int with_val);
+
+int bw_init() {
+    int expected = BW_UNINIT;
+
+    if (!__atomic_compare_exchange_n(&state, &expected, BW_INITIALIZING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return ensure_init();
+
+    int fd = envfd("BEATWATCH_CTRL_FD", 3);
+    int flags = (fd >= 0) ? fcntl(fd, F_GETFL) : -1;
+    if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY) {
+        __atomic_store_n(&state, BW_UNAVAILABLE, __ATOMIC_RELEASE);
+        errno = EBADF;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    ctrl_fd = fd;
+
+    fd = envfd("BEATWATCH_BEAT_FD", -1);
+    if (fd >= 0) {
+        struct beatwatch_page *p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE,
+                                        MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            if (p->magic == BEATWATCH_PAGE_MAGIC && p->version == BEATWATCH_PAGE_VERSION)
+                page = p;
+            else
+                munmap(p, sizeof(*p));
+        }
+    }
+
+    __atomic_store_n(&state, BW_READY, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int bw_beat() {
+    if (ensure_init() < 0)
+        return -1;
+
+    unsigned int timeout = __atomic_load_n(&timeout_ms, __ATOMIC_RELAXED);
+    if (page) {
+        beatwatch_page_beat(page, timeout);
+        return 0;
+    }
+
+    long long now = now_ms();
+    long long prev = __atomic_load_n(&last_sent, __ATOMIC_RELAXED);
+    if (now - prev < timeout / CONFIG_BW_COALESCE_DIVISOR)
+        return 0;
+
+    /* only one of the racing callers sends it */
+    if (!__atomic_compare_exchange_n(&last_sent, &prev, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+
+    if (send_msg("TIMEOUT_MS=", timeout, 1) < 0) {
+        /* let the next beat try again */
+        __atomic_compare_exchange_n(&last_sent, &now, prev, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 1;
+}
+
+int bw_set_timeout(unsigned int msec) {
+    if (ensure_init() < 0)
+        return -1;
+
+    __atomic_store_n(&timeout_ms, msec, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_sent, now_ms(), __ATOMIC_RELAXED);
+    if (page)
+        beatwatch_page_beat(page, msec);
+
+    return send_msg("TIMEOUT_MS=", msec, 1);
+}
+
+int bw_beat_named(const char *name, unsigned int msec) {
+    char prefix[CONFIG_BW_NAME_MAX + 32] = "BEAT ";
+    int len = 5;
+
+    if (ensure_init() < 0)
+        return -1;
+    for (; name && *name; name++) {
+        if (*name <= ' ' || *name == 0x7f || len >= 5 + CONFIG_BW_NAME_MAX)
+            break;
+        prefix[len++] = *name;
+    }
+    if (len == 5 || (name && *name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(prefix + len, " TIMEOUT_MS=", 13);
+
+    return send_msg(prefix, msec, 1);
+}
+
+int bw_detach() {
+    if (ensure_init() < 0)
+        return -1;
+
+    return send_msg("DETACH", 0, 0);
+}
+
+int bw_exit(int status) {
+    if (ensure_init() < 0)
+        return -1;
+
+    return send_msg("EXIT=", status, 1);
+}
+
+int bw_store_fds(const int *fds, int n) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * CONFIG_BW_FDS_MAX)];
+    } cmsg;
+    char buf[32] = "FDSTORE=";
+    struct iovec iov;
+    struct msghdr msg;
+    int len = 8, ret;
+
+    if (ensure_init() < 0)
+        return -1;
+    if (n < 0 || n > CONFIG_BW_FDS_MAX || (n > 0 && fds == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (n >= 10)
+        buf[len++] = '0' + n / 10;
+    buf[len++] = '0' + n % 10;
+    buf[len++] = '\n';
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n > 0) {
+        memset(&cmsg, 0, sizeof(cmsg));
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * n);
+    }
+
+    while ((ret = sendmsg(ctrl_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return (ret < 0) ? -1 : 0;
+}
+
+int bw_standby() {
+    const char *str = getenv("BEATWATCH_STANDBY");
+    static const char promote[] = "PROMOTE\n";
+    char c;
+    int matched = 0;
+
+    if (str == NULL || *str == '\0')
+        return 0;
+    if (ensure_init() < 0 || send_msg("READY", 0, 0) < 0)
+        return -1;
+
+    /* the control fd is non-blocking */
+    while (promote[matched] != '\0') {
+        struct pollfd pfd = { ctrl_fd, POLLIN, 0 };
+        int n = read(ctrl_fd, &c, 1);
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        matched = (c == promote[matched]) ? matched + 1 : (c == promote[0]);
+    }
+
+    unsetenv("BEATWATCH_STANDBY");
+    if (send_msg("PROMOTED", 0, 0) < 0)
+        return -1;
+    return 1;
+}
+
+int bw_stored_fds(int *fds, int max) {
+    const char *str = getenv("BEATWATCH_FDS");
+    int n = 0;
+
+    while (str && *str && n < max) {
+        char *end;
+        long fd = strtol(str, &end, 10);
+        if (end == str || fd < 0)
+            break;
+        fds[n++] = (int) fd;
+        str = end;
+    }
+    return n;
+}
+
+static int ensure_init() {
+    switch (__atomic_load_n(&state, __ATOMIC_ACQUIRE)) {
+        case BW_READY:
+            return 0;
+        case BW_UNINIT:
+            return bw_init();
+        case BW_INITIALIZING:
+            /* do not wait; it may be us interrupted by a signal */
+            errno = EAGAIN;
+            return -1;
+        default:
+            errno = EBADF;
+            return -1;
+    }
+}
+
+static int envfd(const char *name, int defval) {
+    const char *str = getenv(name);
+    int fd = 0;
+
+    if (str == NULL || *str == '\0')
+        return defval;
+    for (; *str; str++) {
+        if (*str < '0' || '9' < *str || fd > 65535)
+            return -1;
+        fd = fd * 10 + (*str - '0');
+    }
+    return fd;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Writes "<prefix><val>\n" at once; snprintf() is not async-signal-safe. */
+static int send_msg(const char *prefix, long long val, int with_val) {
+    char buf[CONFIG_BW_NAME_MAX + 64], digits[24];
+    int len = strlen(prefix), n = 0;
+
+    memcpy(buf, prefix, len);
+    if (with_val) {
+        unsigned long long u = (val < 0) ? -(unsigned long long) val : (unsigned long long) val;
+        do {
+            digits[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u > 0);
+        if (val < 0)
+            buf[len++] = '-';
+        while (n > 0)
+            buf[len++] = digits[--n];
+    }
+    buf[len++] = '\n';
+
+    /* shorter than PIPE_BUF, so it is written entirely or not at all */
+    while ((n = write(ctrl_fd, buf, len)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return -1;
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
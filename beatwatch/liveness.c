@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Resource based liveness policies, with --max-rss and --max-cpu. A target
+   that keeps beating but leaks memory, or spins without making progress,
+   is terminated the same way as on a timeout.
+
+   The resource usage is sampled every LIVENESS_INTERVAL, only while the
+   deadline timer is running, from the cgroup if --cgroup is in effect,
+   otherwise from /proc/<PID>/stat and statm of the monitoring-target. The
+   /proc files are kept open, and each sample costs a pread() of them. */
+
+long long max_rss = 0;              /* in byte, 0 if no limit */
+int max_rss_sec = 0;
+int max_cpu = 0;                    /* in percent, 0 if no limit */
+int max_cpu_sec = 0;
+
+static int stat_fd = -1;
+static int statm_fd = -1;
+static long long next_sample = 0;   /* 0 if disabled */
+static long long last_sample = 0;
+static long long last_cpu = -1;     /* in microsecond */
+static long long last_beat = 0;
+static long long rss_since = 0;     /* since when RSS has been over, or 0 */
+static long long cpu_since = 0;     /* since when CPU has been over, or 0 */
+
+static int sample(long long *rcpu, long long *rrss);
+
+void init_liveness(int pid) {
+    char path[64];
+
+    if (max_rss <= 0 && max_cpu <= 0)
+        return;
+
+    /* nothing is carried over from the last one, with --restart */
+    rss_since = cpu_since = 0;
+    last_cpu = -1;
+    last_beat = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    statm_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    last_sample = monotonic_ms();
+    next_sample = last_sample + LIVENESS_INTERVAL;
+    sample(&last_cpu, NULL);
+}
+
+void close_liveness() {
+    if (stat_fd >= 0) {
+        close(stat_fd);
+        stat_fd = -1;
+    }
+    if (statm_fd >= 0) {
+        close(statm_fd);
+        statm_fd = -1;
+    }
+    next_sample = 0;
+}
+
+/* Returns when the next sample is due, or 0 if none. */
+long long liveness_due() {
+    return next_sample;
+}
+
+/* The monitoring-target has made progress. */
+void liveness_beat(long long now) {
+    last_beat = now;
+}
+
+/* Samples the resource usage if due. Returns 1 if --max-rss is violated,
+   2 if --max-cpu is, after logging it, otherwise 0. */
+int check_liveness(long long now) {
+    long long cpu, rss;
+
+    if (next_sample == 0 || now < next_sample)
+        return 0;
+
+    next_sample = now + LIVENESS_INTERVAL;
+    if (sample(&cpu, &rss) < 0)
+        return 0;
+
+    if (max_rss > 0 && rss >= 0) {
+        if (rss <= max_rss)
+            rss_since = 0;
+        else if (rss_since == 0)
+            rss_since = now;
+
+        if (rss_since && now - rss_since >= max_rss_sec * 1000LL) {
+            errorpf(-1, "RSS %lld bytes has exceeded %lld bytes for %d seconds",
+                    rss, max_rss, max_rss_sec);
+            return 1;
+        }
+    }
+
+    if (max_cpu > 0 && cpu >= 0 && last_cpu >= 0 && now > last_sample) {
+        /* usec / (msec * 10) gives percent */
+        long long pct = (cpu - last_cpu) / ((now - last_sample) * 10);
+        if (pct <= max_cpu)
+            cpu_since = 0;
+        else if (cpu_since == 0 || last_beat > cpu_since)
+            cpu_since = now;
+
+        if (cpu_since && now - cpu_since >= max_cpu_sec * 1000LL) {
+            errorpf(-1, "CPU usage %lld%% has exceeded %d%% for %d seconds without a heartbeat",
+                    pct, max_cpu, max_cpu_sec);
+            return 2;
+        }
+    }
+    last_cpu = cpu;
+    last_sample = now;
+
+    return 0;
+}
+
+/* Gets the CPU time in microsecond and the RSS in byte, or -1 for each
+   not available. Returns -1 if neither is. */
+static int sample(long long *rcpu, long long *rrss) {
+    static long ticks = 0, pagesize = 0;
+    long long cpu = -1, rss = -1;
+    char buf[1024];
+
+    if (cgroup_usage(&cpu, &rss) < 0) {
+        cpu = rss = -1;
+    }
+
+    if (cpu < 0 && pread_small(stat_fd, buf, sizeof(buf)) > 0) {
+        /* utime and stime are the 14th and 15th, after "PID (COMM)" */
+        unsigned long long utime, stime;
+        char *cp = strrchr(buf, ')');
+        if (cp && sscanf(cp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                         &utime, &stime) == 2) {
+            if (ticks == 0)
+                ticks = sysconf(_SC_CLK_TCK);
+            cpu = (long long) (utime + stime) * 1000000 / ticks;
+        }
+    }
+
+    if (rrss && rss < 0 && pread_small(statm_fd, buf, sizeof(buf)) > 0) {
+        long long resident;
+        if (sscanf(buf, "%*d %lld", &resident) == 1) {
+            if (pagesize == 0)
+                pagesize = sysconf(_SC_PAGESIZE);
+            rss = resident * pagesize;
+        }
+    }
+
+    *rcpu = cpu;
+    if (rrss)
+        *rrss = rss;
+    return (cpu < 0 && rss < 0) ? -1 : 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -11,12 +13,15 @@
 #include "global.h"
 
 int debug = 0;
+int verbose = 0;
 int last_exit_code = -1;
 
 #define initial_ctrl_log_filename   NULL
 #define default_ctrl_log_filename   "ctrl.log"
 static const char *ctrl_log_filename = initial_ctrl_log_filename;
 
+#define initial_ctrl_log_maxsize    (0)
+
 #define initial_ctrl_kfd            (-1)
 #define default_ctrl_kfd            (3)
 int ctrl_kfd = initial_ctrl_kfd;
@@ -24,10 +29,31 @@ int ctrl_kfd = initial_ctrl_kfd;
 #define initial_onexit_script      NULL
 static const char *onexit_script = initial_onexit_script;
 
+#define initial_beat_kfd            (-1)
+#define default_beat_kfd            (4)
+
+#define initial_cgroup_parent       NULL
+#define default_cgroup_parent       ""
+
+#define initial_hang_dump_filename  NULL
+#define default_hang_dump_filename  ""      /* see set: --hang-dump */
+
+#define initial_flight_recorder_filename NULL
+#define default_flight_recorder_filename "" /* see set: --flight-recorder */
+
+#define initial_targets_filename    NULL
+static const char *targets_filename = initial_targets_filename;
+
 static int parsearg(int argc, char *argv[]);
 static const char *getnextarg(int *indexp, int argc, char *argv[]);
 static const char *optargmatch(const char *opt, const char *arg);
 static int boolstr2int(const char *str);
+static long long sizestr2ll(const char *str, char **endp);
+static int limitstr2ll(const char *str, int with_size, long long max, long long *rval, int *rsec);
+static int adaptivestr2param(const char *str);
+static int restartstr2param(const char *str);
+static int realtimestr2param(const char *str);
+static const char *dumpname(const char *suffix);
 static void usage(int status);
 
 int main(int argc, char *argv[]) {
@@ -40,7 +66,13 @@ int main(int argc, char *argv[]) {
 
     init_sighandler();
 
-    ret = cmdline();
+    if (targets_filename) {
+        errorpf_prefix = "beatwatch (multi-watchdog)";
+        ret = multiwatch(targets_filename);
+    } else {
+        init_deadline_timer();
+        ret = cmdline();
+    }
 
     last_exit_code = ret;
     return ret;
@@ -56,8 +88,12 @@ static int parsearg(int argc, char *argv[]) {
 
         if (arg1 == NULL) {
             arg1 = getnextarg(&index, argc, argv);
-            if (arg1 == NULL)
+            if (arg1 == NULL) {
+                /* no COMMAND is needed with --targets <F> */
+                if (targets_filename)
+                    break;
                 usage(OTHER_ERROR_EXIT);
+            }
         }
         arg2 = getnextarg(&index, argc, argv);
 
@@ -143,6 +179,68 @@ static int parsearg(int argc, char *argv[]) {
             continue;
         }
 
+        /* parse and set: --ctrl-log-size <N> (or --control-log-size <N>) */
+        str = optargmatch("--ctrl-log-size", arg1);
+        if (!str)
+            str = optargmatch("--control-log-size", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (strlen(str) > 0) {
+                char *end = NULL;
+                long long size = sizestr2ll(str, &end);
+                if (size <= 0 || *end != '\0')
+                    usage(OTHER_ERROR_EXIT);
+                ctrl_log_maxsize = size;
+            } else {
+                /* reset to initial state */
+                ctrl_log_maxsize = initial_ctrl_log_maxsize;
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--ctrl-log-size=\"%lld\"\n", ctrl_log_maxsize);
+#endif
+            continue;
+        }
+
+        /* parse and set: --ctrl-proto <P> */
+        str = optargmatch("--ctrl-proto", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (strcmp(str, "binary") == 0) {
+                ctrl_binary = 1;
+            } else if (strcmp(str, "text") == 0 || strlen(str) == 0) {
+                /* reset to initial state */
+                ctrl_binary = 0;
+            } else {
+                usage(OTHER_ERROR_EXIT);
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--ctrl-proto=\"%s\"\n", ctrl_binary ? "binary" : "text");
+#endif
+            continue;
+        }
+
         /* parse and set: --debug */
         str = optargmatch("--debug", arg1);
         if (str) {
@@ -167,6 +265,30 @@ static int parsearg(int argc, char *argv[]) {
             continue;
         }
 
+        /* parse and set: --verbose */
+        str = optargmatch("--verbose", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                verbose = 1;
+            }
+            else if (*str++ == '=') {
+                if (strlen(str) > 0) {
+                    ret = boolstr2int(str);
+                    if (ret < 0)
+                        usage(OTHER_ERROR_EXIT);
+                    verbose = ret;
+                } else {
+                    /* reset to initial state */
+                    verbose = 0;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--verbose=\"%d\"\n", verbose);
+#endif
+            continue;
+        }
+
         /* parse: --on-exit-script <S> */
         str = optargmatch("--on-exit-script", arg1);
         if (!str)
@@ -199,6 +321,369 @@ static int parsearg(int argc, char *argv[]) {
             continue;
         }
 
+        /* parse: --beat-fd <N> */
+        str = optargmatch("--beat-fd", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    beat_kfd = default_beat_kfd;
+                    str = NULL;
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (str) {
+                if (strlen(str) > 0) {
+                    char *end = NULL;
+                    if ((beat_kfd = strtol(str, &end, 10)) >= 3
+                        && *end == '\0') {
+                    } else {
+                        usage(OTHER_ERROR_EXIT);
+                    }
+                } else {
+                    /* reset to initial state */
+                    beat_kfd = initial_beat_kfd;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--beat-fd=\"%d\"\n", beat_kfd);
+#endif
+            continue;
+        }
+
+        /* parse: --cgroup <D> */
+        str = optargmatch("--cgroup", arg1);
+        if (str) {
+            arg1 = NULL;
+            cgroup_parent = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    cgroup_parent = default_cgroup_parent;
+                    str = NULL;
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (str) {
+                if (strlen(str) > 0) {
+                    cgroup_parent = str;
+                } else {
+                    /* reset to initial state */
+                    cgroup_parent = initial_cgroup_parent;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--cgroup=\"%s\"\n", cgroup_parent);
+#endif
+            continue;
+        }
+
+        /* parse and set: --max-rss <N>:<S> and --max-cpu <P>:<S> */
+        str = optargmatch("--max-rss", arg1);
+        int is_rss = (str != NULL);
+        if (!str)
+            str = optargmatch("--max-cpu", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            long long val = 0;
+            int sec = 0;
+            if (strlen(str) > 0) {
+                /* no more than all the CPUs can use */
+                long long max = is_rss ? LLONG_MAX : 100LL * sysconf(_SC_NPROCESSORS_CONF);
+                if (limitstr2ll(str, is_rss, max, &val, &sec) < 0)
+                    usage(OTHER_ERROR_EXIT);
+            }
+            /* otherwise reset to initial state */
+            if (is_rss) {
+                max_rss = val;
+                max_rss_sec = sec;
+            } else {
+                max_cpu = val;
+                max_cpu_sec = sec;
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--max-rss=\"%lld:%d\" --max-cpu=\"%d:%d\"\n",
+                   max_rss, max_rss_sec, max_cpu, max_cpu_sec);
+#endif
+            continue;
+        }
+
+        /* parse and set: --adaptive <MIN>:<MAX>[:<Q>[:<F>]] */
+        str = optargmatch("--adaptive", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (strlen(str) > 0) {
+                if (adaptivestr2param(str) < 0)
+                    usage(OTHER_ERROR_EXIT);
+            } else {
+                /* reset to initial state */
+                adaptive_min = adaptive_max = 0;
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--adaptive=\"%lld:%lld:%g:%g\"\n", adaptive_min, adaptive_max,
+                   adaptive_quantile, adaptive_factor);
+#endif
+            continue;
+        }
+
+        /* parse and set: --starvation-grace <S> */
+        str = optargmatch("--starvation-grace", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (strlen(str) > 0) {
+                char *end = NULL;
+                if ((starvation_grace = strtol(str, &end, 10)) > 0
+                    && *end == '\0') {
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* reset to initial state */
+                starvation_grace = 0;
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--starvation-grace=\"%d\"\n", starvation_grace);
+#endif
+            continue;
+        }
+
+        /* parse and set: --restart <N>[:<MIN>[:<MAX>]] */
+        str = optargmatch("--restart", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (strlen(str) > 0) {
+                if (restartstr2param(str) < 0)
+                    usage(OTHER_ERROR_EXIT);
+            } else {
+                /* reset to initial state */
+                restart_limit = 0;
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--restart=\"%d:%lld:%lld\"\n", restart_limit, restart_min, restart_max);
+#endif
+            continue;
+        }
+
+        /* parse and set: --standby */
+        str = optargmatch("--standby", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                restart_standby = 1;
+            }
+            else if (*str++ == '=') {
+                if (strlen(str) > 0) {
+                    ret = boolstr2int(str);
+                    if (ret < 0)
+                        usage(OTHER_ERROR_EXIT);
+                    restart_standby = ret;
+                } else {
+                    /* reset to initial state */
+                    restart_standby = 0;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--standby=\"%d\"\n", restart_standby);
+#endif
+            continue;
+        }
+
+        /* parse and set: --realtime [<P>[:<N>]] */
+        str = optargmatch("--realtime", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                realtime = 1;
+                realtime_policy = -1;
+                /* only a policy is taken, not to take COMMAND */
+                if (arg2 && realtimestr2param(arg2) == 0)
+                    arg2 = NULL;
+            } else {
+                /* *str == '=' */
+                str++;
+                if (strlen(str) > 0) {
+                    realtime = 1;
+                    if (realtimestr2param(str) < 0)
+                        usage(OTHER_ERROR_EXIT);
+                } else {
+                    /* reset to initial state */
+                    realtime = 0;
+                    realtime_policy = -1;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--realtime=\"%d:%d:%d\"\n", realtime, realtime_policy, realtime_priority);
+#endif
+            continue;
+        }
+
+        /* parse: --hang-dump <F> */
+        str = optargmatch("--hang-dump", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    hang_dump_filename = default_hang_dump_filename;
+                    str = NULL;
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (str) {
+                if (strlen(str) > 0) {
+                    hang_dump_filename = str;
+                } else {
+                    /* reset to initial state */
+                    hang_dump_filename = initial_hang_dump_filename;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--hang-dump=\"%s\"\n", hang_dump_filename);
+#endif
+            continue;
+        }
+
+        /* parse: --flight-recorder <F> */
+        str = optargmatch("--flight-recorder", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    flight_recorder_filename = default_flight_recorder_filename;
+                    str = NULL;
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (str) {
+                if (strlen(str) > 0) {
+                    flight_recorder_filename = str;
+                } else {
+                    /* reset to initial state */
+                    flight_recorder_filename = initial_flight_recorder_filename;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--flight-recorder=\"%s\"\n", flight_recorder_filename);
+#endif
+            continue;
+        }
+
+        /* parse and set: --hang-dump-ustack */
+        str = optargmatch("--hang-dump-ustack", arg1);
+        if (str) {
+            arg1 = NULL;
+            if (*str == '\0') {
+                hang_dump_ustack = 1;
+            }
+            else if (*str++ == '=') {
+                if (strlen(str) > 0) {
+                    ret = boolstr2int(str);
+                    if (ret < 0)
+                        usage(OTHER_ERROR_EXIT);
+                    hang_dump_ustack = ret;
+                } else {
+                    /* reset to initial state */
+                    hang_dump_ustack = 0;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--hang-dump-ustack=\"%d\"\n", hang_dump_ustack);
+#endif
+            continue;
+        }
+
+        /* parse: --targets <F> */
+        str = optargmatch("--targets", arg1);
+        if (str) {
+            arg1 = NULL;
+            targets_filename = NULL;
+            if (*str == '\0') {
+                if (arg2 && strncmp("--", arg2, 2) != 0) {
+                    str = arg2;
+                    arg2 = NULL;
+                } else {
+                    usage(OTHER_ERROR_EXIT);
+                }
+            } else {
+                /* *str == '=' */
+                str++;
+            }
+            if (str) {
+                if (strlen(str) > 0) {
+                    targets_filename = str;
+                } else {
+                    /* reset to initial state */
+                    targets_filename = initial_targets_filename;
+                }
+            }
+#ifdef DEBUG_ARG_PARSER
+            printf("--targets=\"%s\"\n", targets_filename);
+#endif
+            continue;
+        }
+
         /* parse and show: --help (or --usage) */
         str = optargmatch("--help", arg1);
         if (!str)
@@ -219,13 +704,20 @@ static int parsearg(int argc, char *argv[]) {
 
     /* remaining arguments are passed to exec_argv */
     int next_arg_index = 0;
-    for (int k = 1; k < argc; k++)
-        if (cmdarg == argv[k]) {
-            next_arg_index = k;
-            break;
-        }
-    if (next_arg_index < 1 || argc <= next_arg_index)
-        fixme(0);
+    if (targets_filename) {
+        /* the commands are read from the file instead */
+        if (cmdarg)
+            usage(OTHER_ERROR_EXIT);
+        next_arg_index = argc;
+    } else {
+        for (int k = 1; k < argc; k++)
+            if (cmdarg == argv[k]) {
+                next_arg_index = k;
+                break;
+            }
+        if (next_arg_index < 1 || argc <= next_arg_index)
+            fixme(0);
+    }
 #ifdef DEBUG_ARG_PARSER
     for (int i = next_arg_index; i < argc; i++) {
         printf("argv[%d]=\"%s\"\n", i, argv[i]);
@@ -235,13 +727,13 @@ static int parsearg(int argc, char *argv[]) {
 
     /* set: --ctrl-log <F> (or --control-log <F>) */
     if (ctrl_log_filename) {
-        /* Do fopen() in advance, and save fp for later use. If an error
+        /* Do open() in advance, and keep the fd for later use. If an error
            causes the program to stop, now is preferable because user who
            invoked this program is more likely to see the error message.
-           In this case, doing fopen() later when needed is not good. */
-        ctrl_logfp = fopen(ctrl_log_filename, "a");
-        if (ctrl_logfp == NULL) {
-            errorpf(errno, "fopen(%s)", ctrl_log_filename);
+           In this case, doing open() later when needed is not good. */
+        ret = open_ctrl_log(ctrl_log_filename);
+        if (ret < 0) {
+            errorpf(errno, "open(%s)", ctrl_log_filename);
             exit(OTHER_ERROR_EXIT);
         }
     }
@@ -295,6 +787,69 @@ static int parsearg(int argc, char *argv[]) {
         fixme(0);
     }
 
+    /* set: --beat-fd <N> */
+    if (beat_kfd >= 0) {
+        if (beat_kfd == ctrl_kfd || targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --ctrl-proto <P> */
+    if (ctrl_binary) {
+        /* the multi-watchdog has no cmdline process */
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --cgroup <D> */
+    if (cgroup_parent) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --max-rss, --max-cpu, --adaptive and --starvation-grace */
+    if (max_rss > 0 || max_cpu > 0 || adaptive_min > 0 || starvation_grace > 0) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --restart <N>[:<MIN>[:<MAX>]] */
+    if (restart_limit > 0) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --standby */
+    if (restart_standby) {
+        /* the standby would share them with the active one */
+        if (restart_limit <= 0 || beat_kfd >= 0 || cgroup_parent ||
+            flight_recorder_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --realtime [<P>[:<N>]] */
+    if (realtime) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+    }
+
+    /* set: --hang-dump <F> and --hang-dump-ustack */
+    if (hang_dump_ustack && !hang_dump_filename)
+        hang_dump_filename = default_hang_dump_filename;
+    if (hang_dump_filename) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+        if (*hang_dump_filename == '\0')
+            hang_dump_filename = dumpname(".hang");
+    }
+
+    /* set: --flight-recorder <F> */
+    if (flight_recorder_filename) {
+        if (targets_filename)
+            usage(OTHER_ERROR_EXIT);
+        if (*flight_recorder_filename == '\0')
+            flight_recorder_filename = dumpname(".flight");
+    }
+
     /* set: --on-exit-script <S> */
     if (onexit_script) {
         ret = set_onexit_script(onexit_script);
@@ -372,9 +927,137 @@ static int boolstr2int(const char *str) {
     return -1;
 }
 
+/* Parses a number with an optional K, M or G suffix. */
+static long long sizestr2ll(const char *str, char **endp) {
+    long long size = strtoll(str, endp, 10);
+
+    switch (**endp) {
+        case 'k': case 'K': size *= 1024; (*endp)++; break;
+        case 'm': case 'M': size *= 1024 * 1024; (*endp)++; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; (*endp)++; break;
+    }
+    return size;
+}
+
+/* Parses "<N>:<S>", where <N> may have a size suffix if with_size. */
+static int limitstr2ll(const char *str, int with_size, long long max, long long *rval, int *rsec) {
+    char *end = NULL;
+
+    errno = 0;
+    *rval = with_size ? sizestr2ll(str, &end) : strtoll(str, &end, 10);
+    if (errno != 0 || *rval <= 0 || *rval > max || *end != ':')
+        return -1;
+    str = end + 1;
+    long sec = strtol(str, &end, 10);
+    if (end == str || sec < 0 || sec > 1000000 || *end != '\0')
+        return -1;
+    *rsec = sec;
+    return 0;
+}
+
+/* Parses "<MIN>:<MAX>[:<Q>[:<F>]]" for --adaptive, where MIN and MAX are
+   in second, and Q is in percent. */
+static int adaptivestr2param(const char *str) {
+    double val[4] = { 0, 0, adaptive_quantile * 100, adaptive_factor };
+    char *end = NULL;
+    int n;
+
+    for (n = 0; n < 4; n++) {
+        val[n] = strtod(str, &end);
+        if (end == str || val[n] <= 0)
+            return -1;
+        if (*end == '\0')
+            break;
+        if (*end != ':')
+            return -1;
+        str = end + 1;
+    }
+    if (n < 1 || n >= 4 || val[0] > val[1] || val[2] > 100)
+        return -1;
+
+    adaptive_min = val[0] * 1000;
+    adaptive_max = val[1] * 1000;
+    adaptive_quantile = val[2] / 100;
+    adaptive_factor = val[3];
+    return (adaptive_min > 0) ? 0 : -1;
+}
+
+/* Parses "<N>[:<MIN>[:<MAX>]]" for --restart, where MIN and MAX are in
+   second. */
+static int restartstr2param(const char *str) {
+    double val[2] = { restart_min / 1000.0, restart_max / 1000.0 };
+    char *end = NULL;
+
+    long n = strtol(str, &end, 10);
+    if (end == str || n <= 0 || n > 1000000)
+        return -1;
+    for (int i = 0; i < 2 && *end == ':'; i++) {
+        str = end + 1;
+        val[i] = strtod(str, &end);
+        if (end == str || val[i] < 0)
+            return -1;
+    }
+    if (*end != '\0' || val[0] > val[1])
+        return -1;
+
+    restart_limit = n;
+    restart_min = val[0] * 1000;
+    restart_max = val[1] * 1000;
+    return 0;
+}
+
+/* Parses "<P>[:<N>]" for --realtime, where P is "fifo" or "rr", and N is
+   the priority, 10 by default. */
+static int realtimestr2param(const char *str) {
+    int policy, len;
+
+    if (strncmp(str, "fifo", 4) == 0) {
+        policy = SCHED_FIFO;
+        len = 4;
+    } else if (strncmp(str, "rr", 2) == 0) {
+        policy = SCHED_RR;
+        len = 2;
+    } else {
+        return -1;
+    }
+
+    int priority = 10;
+    str += len;
+    if (*str == ':') {
+        char *end = NULL;
+        priority = strtol(str + 1, &end, 10);
+        if (end == str + 1)
+            return -1;
+        str = end;
+    }
+    if (*str != '\0' || priority < sched_get_priority_min(policy) ||
+        priority > sched_get_priority_max(policy))
+        return -1;
+
+    realtime_policy = policy;
+    realtime_priority = priority;
+    return 0;
+}
+
+/* Returns the default name of a file written on a timeout, next to the
+   control log if any. */
+static const char *dumpname(const char *suffix) {
+    const char *base = ctrl_log_filename ? ctrl_log_filename : "beatwatch";
+
+    char *name = malloc(strlen(base) + strlen(suffix) + 1);
+    if (name == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+    strcpy(name, base);
+    strcat(name, suffix);
+    return name;
+}
+
 static void usage(int status) {
     fprintf(stderr,
     "usage: beatwatch [OPTION]... [--] COMMAND [ARG]...\n"
+    "       beatwatch [OPTION]... --targets <F>\n"
     "options:\n"
     "  --ctrl-fd <N>    If this option is used, <N> is used for control file\n"
     "                   descriptor number. Using this option without <N>, or\n"
@@ -384,15 +1067,118 @@ static void usage(int status) {
     "                   a file named <F>. Using this option without <F>,\n"
     "                   \"%s\" is used as the file name.\n"
     "\n"
+    "  --ctrl-log-size <N>\n"
+    "                   Rotate the control log when it grows beyond <N>\n"
+    "                   bytes (K, M and G suffixes are allowed). Up to %d\n"
+    "                   old logs are kept as <F>.1, <F>.2 and so on.\n"
+    "\n"
+    "  --ctrl-proto <P> Protocol between the command-line process and the\n"
+    "                   watchdog, \"text\" (default) or \"binary\". With\n"
+    "                   \"binary\", control messages are sent as frames\n"
+    "                   over a SOCK_SEQPACKET socket, several per packet.\n"
+    "                   The control file descriptor and the control log are\n"
+    "                   text in either case, with the same lines.\n"
+    "\n"
+    "  --beat-fd <N>    If this option is used, a shared memory page for\n"
+    "                   heartbeats is passed to COMMAND as file descriptor\n"
+    "                   <N> (see beatwatch.h). Using this option without\n"
+    "                   <N>, %d is used for it.\n"
+    "\n"
+    "  --cgroup <D>     If this option is used, COMMAND is run in a cgroup v2\n"
+    "                   leaf created under directory <D>, and SIGKILL is\n"
+    "                   sent to everything in it at once via cgroup.kill.\n"
+    "                   Using this option without <D>, the leaf is created\n"
+    "                   in the cgroup of beatwatch. If it is not allowed,\n"
+    "                   only the process group is used.\n"
+    "\n"
+    "  --max-rss <N>:<S>\n"
+    "                   Terminate COMMAND as on a timeout when its resident\n"
+    "                   set size stays over <N> bytes (K, M and G suffixes\n"
+    "                   are allowed) for <S> seconds.\n"
+    "\n"
+    "  --max-cpu <P>:<S>\n"
+    "                   Terminate COMMAND as on a timeout when it keeps using\n"
+    "                   over <P> percent of a CPU for <S> seconds without a\n"
+    "                   heartbeat (a TIMEOUT=N control message or a beat on\n"
+    "                   the shared memory page). <P> is up to 100 times the\n"
+    "                   number of CPUs.\n"
+    "\n"
+    "  --adaptive <MIN>:<MAX>[:<Q>[:<F>]]\n"
+    "                   Learn the timeout from the gaps between TIMEOUT=N\n"
+    "                   messages instead of using N: the <Q> percentile\n"
+    "                   (99 by default) of the gaps times <F> (3 by default),\n"
+    "                   clamped between <MIN> and <MAX> seconds.\n"
+    "\n"
+    "  --starvation-grace <S>\n"
+    "                   When the timeout has come, see if COMMAND is only\n"
+    "                   waiting for a CPU, and if so, extend the timeout\n"
+    "                   once by <S> seconds before terminating it.\n"
+    "\n"
+    "  --restart <N>[:<MIN>[:<MAX>]]\n"
+    "                   When COMMAND has timed out or exited with a non-zero\n"
+    "                   status, run it again, up to <N> times in a row. The\n"
+    "                   first restart is after <MIN> seconds (1 by default),\n"
+    "                   and each next one waits twice as long, up to <MAX>\n"
+    "                   seconds (30 by default). A run longer than <MAX>\n"
+    "                   resets the count. COMMAND can keep file descriptors\n"
+    "                   for the next run with FDSTORE=N (see beatwatch.h).\n"
+    "\n"
+    "  --standby        With --restart, keep one more instance of COMMAND\n"
+    "                   started with BEATWATCH_STANDBY=1, waiting in\n"
+    "                   bw_standby() (see beatwatch.h). When COMMAND fails,\n"
+    "                   the standby takes over at once, and a new standby\n"
+    "                   is started. Not with --beat-fd, --cgroup or\n"
+    "                   --flight-recorder, and FDSTORE=N is not taken.\n"
+    "\n"
+    "  --realtime [<P>[:<N>]]\n"
+    "                   Keep the deadlines of the watchdog under load: lock\n"
+    "                   its memory, allocated in advance, and lower its\n"
+    "                   oom_score_adj. With <P>, \"fifo\" or \"rr\", also\n"
+    "                   use SCHED_FIFO or SCHED_RR priority <N> (10 by\n"
+    "                   default). How late the timer is handled is logged\n"
+    "                   on exit, and each time it is over %d ms.\n"
+    "\n"
+    "  --hang-dump <F>  When COMMAND is going to be terminated on a timeout,\n"
+    "                   append the state, wchan, system call and kernel\n"
+    "                   stack of each of its threads to a file named <F>.\n"
+    "                   Using this option without <F>, \"<ctrl-log>.hang\"\n"
+    "                   or \"beatwatch.hang\" is used as the file name.\n"
+    "\n"
+    "  --hang-dump-ustack\n"
+    "                   Also sample the user-space stack of each thread with\n"
+    "                   ptrace(), by walking the frame pointers. Implies\n"
+    "                   --hang-dump.\n"
+    "\n"
+    "  --flight-recorder <F>\n"
+    "                   Pass the stdout and stderr of COMMAND through a\n"
+    "                   pipe, keeping the last part of each in memory, and\n"
+    "                   append it to a file named <F> when COMMAND has timed\n"
+    "                   out or exited with a non-zero status. Using this\n"
+    "                   option without <F>, \"<ctrl-log>.flight\" or\n"
+    "                   \"beatwatch.flight\" is used as the file name.\n"
+    "                   If COMMAND is left running on BYE, its output is\n"
+    "                   still passed through, by a process of its own,\n"
+    "                   until COMMAND has closed its stdout and stderr.\n"
+    "\n"
     "  --debug          Enabe debug mode.\n"
     "\n"
+    "  --verbose        Log timing details, such as how long the\n"
+    "                   monitoring-target took to go after SIGTERM.\n"
+    "\n"
     "  --on-exit <S>    If this option is used, script <S> is executed by\n"
     "                   /bin/sh. At the time before the script is executed,\n"
     "                   the exit status of beatwatch (watchdog) is set to the\n"
     "                   $? shell variable.\n"
     "\n"
+    "  --targets <F>    Supervise all the targets listed in a file named <F>\n"
+    "                   from a single watchdog process, instead of COMMAND.\n"
+    "                   Each line of <F> is \"NAME TIMEOUT COMMAND...\", where\n"
+    "                   COMMAND is executed by /bin/sh and TIMEOUT is its\n"
+    "                   initial timeout in second.\n"
+    "\n"
     "  --help, --usage  Display this help and exit.\n",
-    default_ctrl_kfd, default_ctrl_log_filename);
+    default_ctrl_kfd, default_ctrl_log_filename, CTRL_LOG_GENERATIONS,
+    default_beat_kfd, REALTIME_LATE);
 
     exit(status);
 }
@@ -0,0 +1,545 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for ppoll() */
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* multi-watchdog: a single process supervising all the targets listed in
+   a file. Each line of the file is "NAME TIMEOUT COMMAND...", where the
+   COMMAND is run by /bin/sh and TIMEOUT is its initial timeout in second.
+   Empty lines and lines beginning with '#' are ignored.
+
+   Every target has its own control channel, timeout, kill pid and exit
+   code. The deadlines are kept in a timerq, and the process sleeps in
+   ppoll() until either a control message arrives, a child changes state,
+   or the earliest deadline falls due. There is no periodic timer. */
+
+enum phase {
+    RUNNING,
+    TERMSENT,           /* SIGTERM has been sent, SIGKILL is scheduled */
+    KILLSENT,
+    DETACHED,           /* said BYE, no longer supervised */
+};
+
+struct target {
+    struct tqnode timer;        /* must be the first member */
+    char *name;
+    char *command;
+    int timeout;                /* initial timeout in second */
+    int pid;                    /* 0 after reaped */
+    int killpid;                /* -1 if nothing to kill */
+    int rfd;                    /* control channel, -1 after closed */
+    enum phase phase;
+    struct {
+        /* exit code got from below */
+        int waitpid;
+        int ctrlmsg;
+        int sigcause;
+    } exitcode;
+    struct linebuf lb;
+};
+
+static const char done = '+';   /* done mark */
+static struct target **targets = NULL;
+static int ntargets = 0;
+static struct timerq timerq = { NULL, 0, 0 };
+static volatile sig_atomic_t received_sigchld = 0;
+static sigset_t origmask;
+
+static void load_targets(const char *filename);
+static void add_target(const char *name, int timeout, const char *command);
+static void set_sigchld_handler(void);
+static void asyncsafe_sigchld_handler(int signo);
+static void start_target(struct target *t);
+static void set_cloexec(int fd);
+static void expire(struct target *t);
+static void terminate(struct target *t, int expected);
+static int recv_target(struct target *t);
+static void ctrlmsg_handler(struct target *t, const char *line);
+static void reap_targets(void);
+static void close_target(struct target *t);
+static int is_finished(const struct target *t);
+static int exitcode_of(const struct target *t);
+
+int multiwatch(const char *filename) {
+    load_targets(filename);
+
+    /* The control channel of each target is dup2()ed to ctrl_kfd in the
+       child, so the number has to be free from now on. */
+    if (ctrl_kfd >= 0)
+        close(ctrl_kfd);
+    if (ctrl_wfd >= 0)
+        set_cloexec(ctrl_wfd);
+
+    /* Signals are delivered only while waiting in ppoll(), so that none
+       of them can slip in between checking and going to sleep. */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTERM);
+    int ret = sigprocmask(SIG_BLOCK, &mask, &origmask);
+    if (ret != 0) {
+        errorpf(errno, "sigprocmask()");
+        exit(FATAL_EXIT);
+    }
+    set_sigchld_handler();
+
+    for (int i = 0; i < ntargets; i++)
+        start_target(targets[i]);
+
+    struct pollfd *fds = malloc(ntargets * sizeof(*fds));
+    struct target **polled = malloc(ntargets * sizeof(*polled));
+    if (fds == NULL || polled == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+
+    /* multi-watchdog main loop */
+    while (1) {
+        int signo = take_abort_signo();
+        if (signo) {
+            errorpf(-1, "received signal #%d, terminating", signo);
+            for (int i = 0; i < ntargets; i++)
+                if (targets[i]->phase == RUNNING)
+                    terminate(targets[i], SIGNAL_EXIT(signo));
+        }
+
+        if (received_sigchld) {
+            received_sigchld = 0;
+            reap_targets();
+        }
+
+        long long now = monotonic_ms();
+        struct tqnode *first;
+        while ((first = tq_first(&timerq)) && first->deadline <= now)
+            expire((struct target *) first);
+
+        int nfds = 0, nalive = 0;
+        for (int i = 0; i < ntargets; i++) {
+            struct target *t = targets[i];
+            if (!is_finished(t))
+                nalive++;
+            if (t->rfd >= 0) {
+                fds[nfds].fd = t->rfd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                polled[nfds++] = t;
+            }
+        }
+        if (nalive == 0)
+            break;
+
+        struct timespec ts, *tsp = NULL;
+        if ((first = tq_first(&timerq))) {
+            long long wait = first->deadline - now;
+            ts.tv_sec = wait / 1000;
+            ts.tv_nsec = (wait % 1000) * 1000000;
+            tsp = &ts;
+        }
+
+        ret = ppoll(fds, nfds, tsp, &origmask);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fixme(errno);
+            exit(FATAL_EXIT);
+        }
+
+        for (int i = 0; i < nfds && ret > 0; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            ret--;
+            recv_target(polled[i]);
+        }
+    }
+
+    free(fds);
+    free(polled);
+
+    /* The worst exit code of the targets becomes ours */
+    ret = NORMAL_EXIT;
+    for (int i = 0; i < ntargets; i++) {
+        int code = exitcode_of(targets[i]);
+        if (code > ret)
+            ret = code;
+    }
+    return ret;
+}
+
+static void load_targets(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        errorpf(errno, "fopen(%s)", filename);
+        exit(OTHER_ERROR_EXIT);
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    while (getline(&line, &size, fp) >= 0) {
+        char *cp = line, *name, *end;
+        int timeout;
+
+        lineno++;
+        cp[strcspn(cp, "\n")] = '\0';
+        while (isspace((unsigned char) *cp))
+            cp++;
+        if (*cp == '\0' || *cp == '#')
+            continue;
+
+        name = cp;
+        while (*cp && !isspace((unsigned char) *cp))
+            cp++;
+        if (*cp)
+            *cp++ = '\0';
+
+        timeout = strtol(cp, &end, 10);
+        if (end == cp || !isspace((unsigned char) *end) || timeout <= 0)
+            goto syntax_error;
+        cp = end;
+        while (isspace((unsigned char) *cp))
+            cp++;
+        if (*cp == '\0')
+            goto syntax_error;
+
+        add_target(name, timeout, cp);
+        continue;
+
+syntax_error:
+        errorpf(0, "%s:%d: expected \"NAME TIMEOUT COMMAND...\"", filename, lineno);
+        exit(OTHER_ERROR_EXIT);
+    }
+    free(line);
+    fclose(fp);
+
+    if (ntargets == 0) {
+        errorpf(0, "%s: no targets", filename);
+        exit(OTHER_ERROR_EXIT);
+    }
+}
+
+static void add_target(const char *name, int timeout, const char *command) {
+    struct target **tmp = realloc(targets, (ntargets + 1) * sizeof(*tmp));
+    struct target *t = calloc(1, sizeof(*t));
+    if (tmp == NULL || t == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+    targets = tmp;
+
+    t->name = strdup(name);
+    t->command = strdup(command);
+    if (t->name == NULL || t->command == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+    tq_init(&t->timer);
+    t->timeout = timeout;
+    t->killpid = -1;
+    t->rfd = -1;
+    t->phase = RUNNING;
+    t->exitcode.waitpid = -1;
+    t->exitcode.ctrlmsg = -1;
+    t->exitcode.sigcause = -1;
+
+    targets[ntargets++] = t;
+}
+
+static void set_sigchld_handler() {
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = asyncsafe_sigchld_handler;
+    act.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&act.sa_mask);
+    int ret = sigaction(SIGCHLD, &act, NULL);
+    if (ret != 0) {
+        errorpf(errno, "sigaction(SIGCHLD)");
+        exit(FATAL_EXIT);
+    }
+}
+
+static void asyncsafe_sigchld_handler(int signo) {
+    UNUSED(signo);
+    received_sigchld = 1;
+}
+
+static void start_target(struct target *t) {
+    int fd[2];
+
+    int ret = pipe(fd);
+    if (ret != 0) {
+        errorpf(errno, "pipe()");
+        exit(FATAL_EXIT);
+    }
+    set_cloexec(fd[0]);
+
+    int pid = fork();
+    if (pid < 0) {
+        errorpf(errno, "fork()");
+        exit(FATAL_EXIT);
+    }
+
+    if (pid == 0) {
+        /* child side */
+        errorpf_prefix = "beatwatch (monitoring-target)";
+        sigprocmask(SIG_SETMASK, &origmask, NULL);
+        set_onexit_script(NULL);
+        close_ctrl_log();
+        ctrl_wfd = fd[1];
+
+        setpgid(0, 0);
+        if (fd[1] != ctrl_kfd) {
+            ret = dup2(fd[1], ctrl_kfd);
+            if (ret == -1) {
+                errorpf(errno, "dup2()");
+                exit(FATAL_EXIT);
+            }
+            set_cloexec(fd[1]);
+        }
+
+        execl("/bin/sh", "sh", "-c", t->command, (char *) NULL);
+        errorpf(errno, "execl(/bin/sh)");
+        exit(OTHER_ERROR_EXIT);
+    }
+
+    /* parent side; setpgid() on both sides, whichever comes first */
+    close(fd[1]);
+    setpgid(pid, pid);
+    t->pid = pid;
+    t->killpid = -pid;
+    t->rfd = fd[0];
+
+    noticepf("[%s] started, PID=%d", t->name, pid);
+
+    ret = tq_set(&timerq, &t->timer, monotonic_ms() + t->timeout * 1000LL);
+    if (ret != 0) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+}
+
+static void set_cloexec(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+        errorpf(errno, "fcntl(FD_CLOEXEC)");
+        exit(FATAL_EXIT);
+    }
+}
+
+static void expire(struct target *t) {
+    tq_cancel(&timerq, &t->timer);
+
+    switch (t->phase) {
+
+        case RUNNING:
+            errorpf(-1, "[%s] timed out, PID=%d will now be terminated", t->name, t->killpid);
+            terminate(t, TIMEOUT_EXIT);
+            break;
+
+        case TERMSENT:
+            t->phase = KILLSENT;
+            if (t->killpid != -1) {
+                noticepf("[%s] sending SIGKILL to PID=%d", t->name, t->killpid);
+                kill(t->killpid, SIGKILL);
+            }
+            /* There is no timer from now on. Unless the COMMAND itself
+               goes too, it may never be reaped, if KILLPID has been
+               pointed at another process. */
+            if (t->pid != 0 && t->killpid != -t->pid) {
+                noticepf("[%s] sending SIGKILL to PID=%d", t->name, -t->pid);
+                kill(-t->pid, SIGKILL);
+            }
+            break;
+
+        case KILLSENT:
+        case DETACHED:
+            break;
+    }
+}
+
+static void terminate(struct target *t, int expected) {
+    if (t->exitcode.sigcause < 0)
+        t->exitcode.sigcause = expected;
+
+    t->phase = TERMSENT;
+    if (t->killpid != -1 && t->pid != 0 && t->killpid != -t->pid &&
+        kill(t->killpid, 0) == -1 && errno == ESRCH) {
+        /* KILLPID has gone, but the COMMAND is still there */
+        t->killpid = -t->pid;
+    }
+    if (t->killpid == -1 || (kill(t->killpid, 0) == -1 && errno == ESRCH)) {
+        /* already dead */
+        t->killpid = -1;
+        t->phase = KILLSENT;
+        return;
+    }
+
+    noticepf("[%s] sending SIGTERM to PID=%d", t->name, t->killpid);
+    kill(t->killpid, SIGTERM);
+
+    int ret = tq_set(&timerq, &t->timer, monotonic_ms() + SIGKILL_DELAY * 1000LL);
+    if (ret != 0) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+}
+
+/* Returns the number of bytes read, 0 on EOF or -1 if nothing to read. */
+static int recv_target(struct target *t) {
+    int n = linebuf_fill(&t->lb, t->rfd);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return -1;
+        fixme(errno);
+        exit(FATAL_EXIT);
+    }
+    if (n == 0) {
+        /* got an EOF; not reported, since it races with the exit */
+        close_target(t);
+        return 0;
+    }
+
+    char *line;
+    int len;
+    while (t->rfd >= 0 && (line = linebuf_next(&t->lb, &len)))
+        ctrlmsg_handler(t, line);
+    return n;
+}
+
+static void ctrlmsg_handler(struct target *t, const char *line) {
+    char type;
+    int val;
+
+    parse_ctrlmsg(line, &type, &val);
+
+    switch (type) {
+
+        case 'B':   /* BYE          */
+            send_ctrlmsgf("%c [%s] %s", done, t->name, line);
+            tq_cancel(&timerq, &t->timer);
+            t->killpid = -1;
+            t->phase = DETACHED;
+            close_target(t);
+            break;
+
+        case 'E':   /* EXIT=N       */
+            t->exitcode.ctrlmsg = val;
+            send_ctrlmsgf("%c [%s] %s", done, t->name, line);
+            break;
+
+        case 'K':   /* KILLPID=N    */
+            if (t->phase == RUNNING) {
+                t->killpid = val;
+
+                /* do not let the new killpid be killed right away, as
+                   set_killpid() does */
+                long long now = monotonic_ms();
+                if (t->timer.deadline - now < BASE_TIMEOUT * UNIT_TIME) {
+                    int ret = tq_set(&timerq, &t->timer, now + BASE_TIMEOUT * 1000LL);
+                    if (ret != 0) {
+                        errorpf(errno, "malloc()");
+                        exit(FATAL_EXIT);
+                    }
+                }
+            }
+            send_ctrlmsgf("%c [%s] %s", done, t->name, line);
+            break;
+
+        case 'T':   /* TIMEOUT=N    */
+        case 't':   /* TIMEOUT_MS=N */
+            if (t->phase == RUNNING) {
+                long long timeout = (type == 'T') ? val * 1000LL : val;
+                int ret = tq_set(&timerq, &t->timer, monotonic_ms() + timeout);
+                if (ret != 0) {
+                    errorpf(errno, "malloc()");
+                    exit(FATAL_EXIT);
+                }
+            }
+            send_ctrlmsgf("%c [%s] %s", done, t->name, line);
+            break;
+
+        case 'D':   /* DETACH       */
+        default:
+            send_ctrlmsgf("[%s] %s", t->name, line);
+            break;
+    }
+}
+
+static void reap_targets() {
+    while (1) {
+        int status = 0;
+        int pid = waitpid(-1, &status, WNOHANG);
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid <= 0)
+            return;
+        if (!(WIFEXITED(status) || WIFSIGNALED(status)))
+            continue;
+
+        for (int i = 0; i < ntargets; i++) {
+            struct target *t = targets[i];
+            if (t->pid != pid)
+                continue;
+
+            t->pid = 0;
+            if (t->phase == DETACHED)
+                break;
+            tq_cancel(&timerq, &t->timer);
+            t->killpid = -1;
+
+            /* pick up what has been written before the exit */
+            if (t->rfd >= 0) {
+                fcntl(t->rfd, F_SETFL, fcntl(t->rfd, F_GETFL) | O_NONBLOCK);
+                while (t->rfd >= 0 && recv_target(t) > 0)
+                    ;
+            }
+            close_target(t);
+
+            if (WIFEXITED(status)) {
+                t->exitcode.waitpid = WEXITSTATUS(status);
+                noticepf("[%s] monitoring-target returned exit status %d", t->name, t->exitcode.waitpid);
+            } else {
+                t->exitcode.waitpid = SIGNAL_EXIT(WTERMSIG(status));
+                noticepf("[%s] monitoring-target got a signal %d", t->name, WTERMSIG(status));
+            }
+            break;
+        }
+    }
+}
+
+static void close_target(struct target *t) {
+    if (t->rfd >= 0) {
+        close(t->rfd);
+        t->rfd = -1;
+    }
+    linebuf_free(&t->lb);
+}
+
+static int is_finished(const struct target *t) {
+    return t->rfd < 0 && (t->pid == 0 || t->phase == DETACHED);
+}
+
+static int exitcode_of(const struct target *t) {
+    int ret = NORMAL_EXIT;
+    ret = (t->exitcode.waitpid  < 0) ? ret : t->exitcode.waitpid;
+    ret = (t->exitcode.ctrlmsg  < 0) ? ret : t->exitcode.ctrlmsg;
+    ret = (t->exitcode.sigcause < 0) ? ret : t->exitcode.sigcause;
+    return ret;
+}
+
+/* vim: set et sw=4 sts=4: */
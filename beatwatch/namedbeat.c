@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Named heartbeats. A monitoring-target made of many components, such as
+   worker threads, can give each of them a heartbeat of its own:
+
+       BEAT <NAME> TIMEOUT=<N>
+       BEAT <NAME> TIMEOUT_MS=<N>
+       BEAT <NAME>
+
+   Each opens the channel NAME if not yet, and beats it. The last one
+   keeps the timeout set last, BASE_TIMEOUT for a new channel. A timeout
+   of 0 closes the channel. When any of the channels misses its deadline,
+   the monitoring-target is terminated as on a timeout, and the name of
+   the one that has stalled is logged. BEAT lines are neither done with
+   "+" nor forwarded upstream, as there may be many of them.
+
+   A beat on a channel is also a beat of the whole target. So the
+   deadline set by TIMEOUT=N is extended up to the earliest of the
+   channels when the timer falls due, and only then relayed upstream.
+
+   The channels are found by name in a hash table, and their deadlines are
+   kept in a timerq. A beat costs a lookup and O(log n) with neither an
+   allocation nor a system call, unless the timer is to be armed earlier. */
+
+#ifndef CONFIG_NAMED_BEAT_MAX
+#define CONFIG_NAMED_BEAT_MAX       65536   /* channels per target */
+#endif
+
+#ifndef CONFIG_NAMED_BEAT_NAME_MAX
+#define CONFIG_NAMED_BEAT_NAME_MAX  64      /* in byte */
+#endif
+
+#define NAMED_BEAT_MAX          (CONFIG_NAMED_BEAT_MAX)
+#define NAMED_BEAT_NAME_MAX     (CONFIG_NAMED_BEAT_NAME_MAX)
+
+struct channel {
+    struct tqnode timer;        /* must be the first member */
+    struct channel *next;       /* in the same bucket */
+    unsigned int hash;
+    long long timeout;          /* in millisecond */
+    char name[];
+};
+
+static struct channel **buckets = NULL;
+static unsigned int nbuckets = 0;   /* a power of 2 */
+static int nchannels = 0;
+static int overflowed = 0;          /* logged once per target */
+static struct timerq timerq = { NULL, 0, 0 };
+
+static int parse_beat(const char *line, int *rlen, long long *rtimeout);
+static unsigned int hash_name(const char *name, int len);
+static struct channel **lookup(const char *name, int len, unsigned int hash);
+static struct channel *open_channel(const char *name, int len, unsigned int hash);
+static void close_channel(struct channel **pc);
+static void grow(void);
+
+/* BEAT <NAME> ...; returns 0, or -1 if the line is not one. */
+int named_beat(const char *line) {
+    long long timeout;
+    int len;
+
+    if (parse_beat(line, &len, &timeout) < 0)
+        return -1;
+
+    const char *name = line + 5;
+    unsigned int hash = hash_name(name, len);
+    struct channel **pc = lookup(name, len, hash);
+    struct channel *c = *pc;
+
+    if (timeout == 0) {
+        if (c)
+            close_channel(pc);
+        return 0;
+    }
+
+    if (c == NULL) {
+        c = open_channel(name, len, hash);
+        if (c == NULL)
+            return 0;
+    }
+    if (timeout > 0)
+        c->timeout = timeout;
+
+    if (tq_set(&timerq, &c->timer, monotonic_ms() + c->timeout) != 0) {
+        errorpf(errno, "realloc()");
+        exit(FATAL_EXIT);
+    }
+    return 0;
+}
+
+/* Returns the earliest deadline of the channels, or 0 if none. */
+long long named_beat_due() {
+    struct tqnode *first = tq_first(&timerq);
+
+    return first ? first->deadline : 0;
+}
+
+/* Returns the earliest deadline of the channels, 0 if none, or -1 if it
+   has been missed, after logging which one has stalled. Its name is set
+   to *rname then. */
+long long check_named_beats(long long now, const char **rname) {
+    struct tqnode *first = tq_first(&timerq);
+
+    if (first == NULL)
+        return 0;
+    if (first->deadline > now)
+        return first->deadline;
+
+    struct channel *c = (struct channel *) first;
+    errorpf(-1, "heartbeat %s has stalled, none in %lld ms", c->name, c->timeout);
+    *rname = c->name;
+    return -1;
+}
+
+/* Forgets all the channels, when the monitoring-target has gone. */
+void close_named_beats() {
+    for (unsigned int i = 0; i < nbuckets; i++) {
+        while (buckets[i])
+            close_channel(&buckets[i]);
+    }
+    overflowed = 0;
+}
+
+/* Sets *rlen to the length of NAME, and *rtimeout to the one given in
+   millisecond, or to -1 if none. */
+static int parse_beat(const char *line, int *rlen, long long *rtimeout) {
+    if (strncmp(line, "BEAT ", 5) != 0)
+        return -1;
+
+    const char *name = line + 5, *cp = name;
+    while (*cp > ' ' && *cp != 0x7f)
+        cp++;
+    int len = cp - name;
+    if (len == 0 || len > NAMED_BEAT_NAME_MAX)
+        return -1;
+    *rlen = len;
+
+    if (*cp == '\0') {
+        *rtimeout = -1;
+        return 0;
+    }
+    if (*cp != ' ')
+        return -1;
+
+    char type;
+    int val;
+    parse_ctrlmsg(cp + 1, &type, &val);
+    if ((type != 'T' && type != 't') || val < 0)
+        return -1;
+    *rtimeout = (type == 'T') ? val * 1000LL : val;
+    return 0;
+}
+
+/* FNV-1a */
+static unsigned int hash_name(const char *name, int len) {
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns where the channel is linked from, or where to link it if none. */
+static struct channel **lookup(const char *name, int len, unsigned int hash) {
+    static struct channel *none = NULL;
+
+    if (nbuckets == 0)
+        return &none;
+
+    struct channel **pc = &buckets[hash & (nbuckets - 1)];
+    for (; *pc; pc = &(*pc)->next) {
+        struct channel *c = *pc;
+        if (c->hash == hash && strncmp(c->name, name, len) == 0 && c->name[len] == '\0')
+            break;
+    }
+    return pc;
+}
+
+static struct channel *open_channel(const char *name, int len, unsigned int hash) {
+    if (nchannels >= NAMED_BEAT_MAX) {
+        if (!overflowed)
+            noticepf("more than %d named heartbeats, %.*s and later ones are ignored",
+                     NAMED_BEAT_MAX, len, name);
+        overflowed = 1;
+        return NULL;
+    }
+    if ((unsigned int) nchannels >= nbuckets)
+        grow();
+
+    struct channel *c = malloc(sizeof(*c) + len + 1);
+    if (c == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+    tq_init(&c->timer);
+    c->hash = hash;
+    c->timeout = BASE_TIMEOUT * 1000LL;
+    memcpy(c->name, name, len);
+    c->name[len] = '\0';
+
+    struct channel **head = &buckets[hash & (nbuckets - 1)];
+    c->next = *head;
+    *head = c;
+    nchannels++;
+    return c;
+}
+
+static void close_channel(struct channel **pc) {
+    struct channel *c = *pc;
+
+    tq_cancel(&timerq, &c->timer);
+    *pc = c->next;
+    free(c);
+    nchannels--;
+}
+
+/* Doubles the buckets, so that there is one per channel at most. */
+static void grow() {
+    unsigned int size = nbuckets ? nbuckets * 2 : 64;
+    struct channel **table = calloc(size, sizeof(*table));
+    if (table == NULL) {
+        errorpf(errno, "calloc()");
+        exit(FATAL_EXIT);
+    }
+
+    for (unsigned int i = 0; i < nbuckets; i++) {
+        while (buckets[i]) {
+            struct channel *c = buckets[i];
+            buckets[i] = c->next;
+            c->next = table[c->hash & (size - 1)];
+            table[c->hash & (size - 1)] = c;
+        }
+    }
+    free(buckets);
+    buckets = table;
+    nbuckets = size;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,34 @@
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Reading the small files, such as in /proc and in the cgroup, which are
+   read in one go. The content is terminated with '\0', and anything over
+   size - 1 bytes is cut off. */
+
+/* Reads the file at path. Returns the length, or -1. */
+int read_small(const char *path, char *buf, int size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int n = pread_small(fd, buf, size);
+    close(fd);
+    return n;
+}
+
+/* Reads the file kept open as fd, from the top. Returns the length, or
+   -1, also if fd is -1. */
+int pread_small(int fd, char *buf, int size) {
+    if (fd < 0)
+        return -1;
+
+    int n = pread(fd, buf, size - 1, 0);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+/* vim: set et sw=4 sts=4: */
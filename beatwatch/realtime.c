@@ -0,0 +1,217 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for SCHED_RESET_ON_FORK */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Real-time mode of the watchdog, with --realtime. So that its own
+   deadlines are kept while the host is thrashing:
+
+   - the heap and the stack are touched in advance, and freed memory is
+     never given back, so that the timer path finds its memory in place;
+   - all of it is locked with mlockall();
+   - the oom_score_adj is lowered, so that the OOM killer goes for the
+     monitoring-target first;
+   - optionally, SCHED_FIFO or SCHED_RR is used.
+
+   None of them is passed on to the monitoring-target. Each one that is not
+   permitted is logged, and the rest still applies. How late the timer is
+   handled is measured on every wakeup, and summarized on exit. */
+
+#ifndef CONFIG_REALTIME_HEAP
+#define CONFIG_REALTIME_HEAP    (4 * 1024 * 1024)   /* touched in advance */
+#endif
+
+#ifndef CONFIG_REALTIME_STACK
+#define CONFIG_REALTIME_STACK   (256 * 1024)        /* touched in advance */
+#endif
+
+#ifndef CONFIG_REALTIME_OOM_SCORE_ADJ
+#define CONFIG_REALTIME_OOM_SCORE_ADJ   "-1000"
+#endif
+
+#define REALTIME_HEAP           (CONFIG_REALTIME_HEAP)
+#define REALTIME_STACK          (CONFIG_REALTIME_STACK)
+
+int realtime = 0;
+int realtime_policy = -1;           /* SCHED_FIFO or SCHED_RR, or -1 */
+int realtime_priority = 0;
+
+static char saved_oom_score_adj[16] = "";
+static struct {
+    long long count;
+    long long sum;                  /* in microsecond */
+    long long max;                  /* in microsecond */
+    long long late;                 /* over REALTIME_LATE */
+} jitter;
+
+static void touch_heap(void);
+static void touch_stack(void);
+static void lock_memory(void);
+static int read_oom_score_adj(char *buf, int size);
+static int write_oom_score_adj(const char *str);
+
+/* called by the watchdog */
+void init_realtime() {
+    if (!realtime)
+        return;
+
+    touch_heap();
+    touch_stack();
+    lock_memory();
+
+    if (read_oom_score_adj(saved_oom_score_adj, sizeof(saved_oom_score_adj)) < 0 ||
+        write_oom_score_adj(CONFIG_REALTIME_OOM_SCORE_ADJ) < 0)
+        noticepf("cannot set oom_score_adj to %s (%s)",
+                 CONFIG_REALTIME_OOM_SCORE_ADJ, strerror(errno));
+
+    if (realtime_policy >= 0) {
+        struct sched_param param;
+        int policy = realtime_policy;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = realtime_priority;
+#ifdef SCHED_RESET_ON_FORK
+        /* the children start with the normal policy */
+        policy |= SCHED_RESET_ON_FORK;
+#endif
+        if (sched_setscheduler(0, policy, &param) != 0)
+            noticepf("cannot use %s priority %d (%s)",
+                     (realtime_policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR",
+                     realtime_priority, strerror(errno));
+    }
+}
+
+/* Called by each helper thread of the watchdog, such as the relay of the
+   flight recorder and the writer of the control log. Only the main thread,
+   which handles the timer, is to run with SCHED_FIFO or SCHED_RR. On Linux,
+   SCHED_RESET_ON_FORK applies to new threads too, and this is only to be
+   sure; elsewhere a thread inherits the policy of the one creating it. */
+void leave_realtime_thread() {
+    if (!realtime || realtime_policy < 0)
+        return;
+
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    /* lowering it is always permitted, and nothing is to be logged from
+       a thread other than the main one */
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
+/* called by the monitoring-target; memory locks are not inherited */
+void leave_realtime() {
+    if (!realtime)
+        return;
+
+    if (saved_oom_score_adj[0])
+        write_oom_score_adj(saved_oom_score_adj);
+
+#ifndef SCHED_RESET_ON_FORK
+    if (realtime_policy >= 0) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        sched_setscheduler(0, SCHED_OTHER, &param);
+    }
+#endif
+}
+
+/* The timer has been handled, which was due at due (see monotonic_ms()). */
+void realtime_wakeup(long long due) {
+    if (!realtime)
+        return;
+
+    long long late = monotonic_us() - due * 1000;
+    if (late < 0)
+        late = 0;
+
+    jitter.count++;
+    jitter.sum += late;
+    if (late > jitter.max)
+        jitter.max = late;
+    if (late >= REALTIME_LATE * 1000LL) {
+        jitter.late++;
+        noticepf("the timer has been handled %lld.%03lld ms late",
+                 late / 1000, late % 1000);
+    }
+}
+
+/* Logs the summary of how late the timer has been handled. */
+void report_realtime() {
+    if (!realtime || jitter.count == 0)
+        return;
+
+    noticepf("the timer has been handled %lld us late on average, %lld us at most, "
+             "in %lld wakeups, %lld of them over %d ms", jitter.sum / jitter.count,
+             jitter.max, jitter.count, jitter.late, REALTIME_LATE);
+}
+
+/* Freed memory stays in the heap, and no allocation is served by mmap(),
+   so that what is touched here is what is used later. */
+static void touch_heap() {
+#if defined(__linux__) && defined(M_MMAP_MAX)
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_TRIM_THRESHOLD, -1);
+#endif
+    char *p = malloc(REALTIME_HEAP);
+    if (p == NULL) {
+        errorpf(errno, "malloc()");
+        exit(FATAL_EXIT);
+    }
+    memset(p, 0, REALTIME_HEAP);
+    free(p);
+}
+
+static void __attribute__((noinline)) touch_stack() {
+    char buf[REALTIME_STACK];
+
+    memset(buf, 0, sizeof(buf));
+    /* not to be optimized away */
+    __asm__ __volatile__("" : : "r" (buf) : "memory");
+}
+
+/* MCL_FUTURE is only for the unlimited RLIMIT_MEMLOCK, as otherwise a
+   later mapping, such as the stack of a thread, would fail. */
+static void lock_memory() {
+    struct rlimit rl;
+    int flags = MCL_CURRENT;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur == RLIM_INFINITY)
+        flags |= MCL_FUTURE;
+    if (mlockall(flags) != 0)
+        noticepf("cannot lock the memory of the watchdog (%s)", strerror(errno));
+}
+
+static int read_oom_score_adj(char *buf, int size) {
+    int n = read_small("/proc/self/oom_score_adj", buf, size);
+    if (n <= 0)
+        return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return n;
+}
+
+static int write_oom_score_adj(const char *str) {
+    int fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int n = write(fd, str, strlen(str));
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+/* vim: set et sw=4 sts=4: */
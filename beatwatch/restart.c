@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* Restart policy, with --restart. When the monitoring-target has timed out
+   or failed, the watchdog runs the command again, up to restart_limit
+   times in a row. It waits restart_min before the first restart, twice as
+   long before each next one, up to restart_max. A target that has run for
+   longer than restart_max before failing is counted afresh.
+
+   The control channel to the monitoring-target is then a unix domain
+   socket, and the target can deposit file descriptors such as listening
+   sockets with the watchdog, by sending "FDSTORE=N" along with N of them
+   in SCM_RIGHTS (see bw_store_fds() in beatwatch.h). "FDSTORE=0" empties
+   the store. The next monitoring-target inherits all of them, listed in
+   BEATWATCH_FDS, so a listening socket keeps its accept queue. Without
+   --restart, "FDSTORE=N" is forwarded upstream as any other line.
+
+   With --standby, one more instance is started as soon as the active one
+   is running, with BEATWATCH_STANDBY=1. It initializes, says READY, and
+   waits at the barrier of bw_standby(). When the active one has failed,
+   the standby is sent PROMOTE over its control socket, which is both ways
+   for this, and takes over without the backoff. Then a new standby is
+   started in the background. A standby that exits meanwhile is noticed,
+   and the next restart waits for the backoff instead. FDSTORE=N is not
+   taken with --standby, since the standby has been forked with the store
+   as it was then, and would take over with a stale one. */
+
+#ifndef CONFIG_FD_STORE_MAX
+#define CONFIG_FD_STORE_MAX     32  /* also per message */
+#endif
+
+#define FD_STORE_MAX            (CONFIG_FD_STORE_MAX)
+
+int restart_limit = 0;              /* 0 if disabled */
+int restart_standby = 0;            /* keep a standby, with --standby */
+long long restart_min = 1000;       /* in millisecond */
+long long restart_max = 30 * 1000;  /* in millisecond */
+
+static int restarts = 0;            /* in a row */
+static int stored[FD_STORE_MAX];
+static int nstored = 0;
+static int pending[FD_STORE_MAX];   /* received, not yet claimed */
+static int npending = 0;
+
+static int fd_floor(void);
+static int is_stored(int fd);
+
+/* Returns how long to wait before the next restart in millisecond, or -1
+   if no more restart is allowed. ran is how long the last one has run.
+   A standby to be promoted is not kept waiting. */
+long long restart_backoff(long long ran, int standby) {
+    if (restart_limit <= 0)
+        return -1;
+
+    if (ran > restart_max)
+        restarts = 0;
+    if (restarts >= restart_limit) {
+        noticepf("monitoring-target has failed %d times in a row, giving up", restarts + 1);
+        return -1;
+    }
+
+    if (standby) {
+        restarts++;
+        noticepf("promoting the standby, %d of %d", restarts, restart_limit);
+        return 0;
+    }
+
+    long long backoff = restart_min;
+    for (int i = 0; i < restarts && backoff < restart_max; i++)
+        backoff *= 2;
+    if (backoff > restart_max)
+        backoff = restart_max;
+
+    restarts++;
+    noticepf("restarting monitoring-target in %lld ms, %d of %d",
+             backoff, restarts, restart_limit);
+    return backoff;
+}
+
+/* Reads from the control channel like read(), and keeps the file
+   descriptors that come along. */
+int recv_ctrl_fds(int fd, char *buf, int len) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * FD_STORE_MAX)];
+    } cmsg;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    int flags = 0;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    int n = recvmsg(fd, &msg, flags);
+    if (n < 0)
+        return n;
+    if (msg.msg_flags & MSG_CTRUNC)
+        noticepf("too many file descriptors at once, some have been lost");
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *) CMSG_DATA(c);
+        for (int i = 0; i < count; i++) {
+            /* clear of the fds that the monitoring-target gets */
+            int newfd = fcntl(fds[i], F_DUPFD_CLOEXEC, fd_floor());
+            close(fds[i]);
+            if (newfd < 0)
+                continue;
+            if (npending >= FD_STORE_MAX) {
+                close(newfd);
+                continue;
+            }
+            pending[npending++] = newfd;
+        }
+    }
+    return n;
+}
+
+/* FDSTORE=N: keeps N of the file descriptors received, or empties the
+   store if N is 0. The same file is never stored twice. */
+void store_fds(int n) {
+    int i;
+
+    if (n == 0) {
+        close_stored_fds();
+        return;
+    }
+
+    for (i = 0; i < npending && i < n; i++) {
+        if (is_stored(pending[i]) || nstored >= FD_STORE_MAX) {
+            close(pending[i]);
+            continue;
+        }
+        stored[nstored++] = pending[i];
+    }
+    if (i < n)
+        noticepf("FDSTORE=%d, but only %d file descriptors have come", n, i);
+
+    npending -= i;
+    memmove(pending, pending + i, npending * sizeof(int));
+}
+
+/* The file descriptors sent without FDSTORE=N. */
+void drop_pending_fds() {
+    while (npending > 0)
+        close(pending[--npending]);
+}
+
+/* called by the monitoring-target */
+void pass_stored_fds() {
+    char str[FD_STORE_MAX * 12] = "";
+    int len = 0;
+
+    if (restart_limit <= 0)
+        return;
+
+    for (int i = 0; i < nstored; i++) {
+        int flags = fcntl(stored[i], F_GETFD);
+        if (flags == -1 || fcntl(stored[i], F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+            errorpf(errno, "fcntl(%d)", stored[i]);
+            exit(FATAL_EXIT);
+        }
+        len += snprintf(str + len, sizeof(str) - len, "%s%d", i ? " " : "", stored[i]);
+    }
+
+    int ret = nstored ? setenv("BEATWATCH_FDS", str, 1) : unsetenv("BEATWATCH_FDS");
+    if (ret != 0) {
+        errorpf(errno, "setenv()");
+        exit(FATAL_EXIT);
+    }
+}
+
+void close_stored_fds() {
+    while (nstored > 0)
+        close(stored[--nstored]);
+}
+
+/* The lowest number a stored fd may have, above the ones that are dup2()ed
+   to in the monitoring-target. */
+static int fd_floor() {
+    int lowest = 3;
+
+    if (ctrl_kfd >= lowest)
+        lowest = ctrl_kfd + 1;
+    if (beat_kfd >= lowest)
+        lowest = beat_kfd + 1;
+    return lowest;
+}
+
+static int is_stored(int fd) {
+    struct stat st, other;
+
+    if (fstat(fd, &st) != 0)
+        return 0;
+    for (int i = 0; i < nstored; i++) {
+        if (fstat(stored[i], &other) == 0 &&
+            st.st_dev == other.st_dev && st.st_ino == other.st_ino)
+            return 1;
+    }
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -3,18 +3,50 @@
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "errorpf.h"
 #include "global.h"
 
-#define SIGTERM_TIMEOUT     (0)
-#define SIGKILL_TIMEOUT     (0 - (SIGKILL_DELAY * (1000 / UNIT_TIME)))
-#define TIMER_FINISHED      (SIGKILL_TIMEOUT - 1)
-#define TIMER_INITIAL       (SIGKILL_TIMEOUT - 2)
+/* The timer is deadline driven. Nothing wakes the process up until the
+   deadline falls due: the timerfd becomes readable on Linux, otherwise
+   a one-shot ITIMER_REAL raises SIGALRM. After SIGTERM has been sent,
+   the process is checked every UNIT_TIME until SIGKILL is due, and also
+   as soon as it exits where pidfd_open() is available. */
+enum {
+    STARVATION_NONE,
+    STARVATION_PROBING,     /* the deadline has come, looking at the target */
+    STARVATION_EXTENDED,    /* the deadline has been extended once */
+};
+
+enum {
+    TIMER_INITIAL,
+    TIMER_RUNNING,          /* waiting for the deadline */
+    TIMER_TERMSENT,         /* SIGTERM has been sent */
+    TIMER_FINISHED,
+};
 
 static int killpid = -1;
-static int timer = TIMER_INITIAL;
+static int phase = TIMER_INITIAL;
+static long long deadline = 0;          /* see monotonic_ms() */
+static long long kill_deadline = 0;     /* when SIGKILL is due */
+static long long armed_due = 0;         /* what the timer is armed for */
+#ifdef __linux__
+static int timer_fd = -1;
+static int exit_fd = -1;                /* pidfd of killpid after SIGTERM */
+static int standby_fd = -1;             /* pidfd of the standby */
+#endif
+static long long kill_sent = 0;         /* when the first signal was sent */
+static int kill_signo = 0;
+static int received_exit_event = 0;
+static int starvation = 0;              /* STARVATION_* below */
+static int expected = -1;               /* expected exit code */
 static int received_abort_signo = 0;
 static int received_alarm_signo = 0;
 static char *onexit_script_with_prefix = NULL;
@@ -22,43 +54,49 @@ static char *onexit_script_with_prefix = NULL;
 static void set_abort_handler(int signo);
 static void set_alarm_handler(void);
 static void asyncsafe_sighandler(int signo);
+static long long timer_due(void);
+static void arm_deadline_timer(void);
+static void disarm_deadline_timer(void);
 static int killping(void);
 static int killsig(int signo);
+static int open_pidfd(int pid);
+static void open_exit_fd(void);
+static void close_exit_fd(void);
+static int wait_vanished(long long timeout);
 static void onexit(void);
 static void run_finalkiller(void);
 static void run_onexit_script(void);
 static void check_fdleak(void);
 
 void set_killpid(int pid) {
-    if (timer == TIMER_INITIAL) {
-        /* skip the check below */
-    } else {
-        if (timer <= SIGTERM_TIMEOUT) {
-            /* It's too late */
-            return;
-        }
+    if (phase == TIMER_TERMSENT || phase == TIMER_FINISHED) {
+        /* It's too late */
+        return;
     }
     killpid = pid;
 
-    if (timer < BASE_TIMEOUT)
+    /* do not let the new killpid be killed right away */
+    if (phase == TIMER_INITIAL ||
+        deadline - monotonic_ms() < BASE_TIMEOUT * UNIT_TIME)
         set_timeout(BASE_TIMEOUT);
 }
 
 void set_timeout(int timeout) {
-    if (timer == TIMER_INITIAL) {
-        /* skip the check below */
-    } else {
-        if (timer <= SIGTERM_TIMEOUT) {
-            /* no turning back now */
-            return;
-        }
+    set_timeout_ms(timeout * 1000LL);
+}
+
+void set_timeout_ms(long long timeout) {
+    if (phase == TIMER_TERMSENT || phase == TIMER_FINISHED) {
+        /* no turning back now */
+        return;
     }
 
-    /* The timeout is set after the seconds specified by
-       the 'timeout' argument, but the actual timeout may
-       be up to UNIT_TIME millisecond earlier, due to the
-       design of this code. */
-    timer = timeout * (1000 / UNIT_TIME);
+    phase = TIMER_RUNNING;
+    starvation = STARVATION_NONE;
+    long long now = monotonic_ms();
+    deadline = now + timeout;
+    liveness_beat(now);
+    arm_deadline_timer();
 }
 
 void init_sighandler() {
@@ -108,26 +146,196 @@ static void set_alarm_handler() {
         errorpf(errno, "sigaction(SIGALRM)");
         exit(FATAL_EXIT);
     }
+}
+
+/* A child created via fork() shares the timerfd with its parent, and does
+   not inherit the interval timer. So the child calls this again to get
+   one of its own. */
+void init_deadline_timer() {
+#ifdef __linux__
+    if (timer_fd >= 0)
+        close(timer_fd);
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        errorpf(errno, "timerfd_create()");
+        exit(FATAL_EXIT);
+    }
+#endif
+    if (phase == TIMER_RUNNING || phase == TIMER_TERMSENT)
+        arm_deadline_timer();
+}
 
-    set_alarm_timer();
+/* The deadline, or the next resource sample or named heartbeat if
+   earlier. */
+static long long timer_due() {
+    long long due = deadline;
+
+    if (phase == TIMER_RUNNING) {
+        long long sample = liveness_due();
+        long long named = named_beat_due();
+        if (sample > 0 && sample < due)
+            due = sample;
+        if (named > 0 && named < due)
+            due = named;
+    }
+    return due;
 }
 
-/* child created via fork() inherits a copy of its parent's signal
-   dispositions, but not inherit its parent's interval timer. */
-void set_alarm_timer() {
+static void arm_deadline_timer() {
+    long long due = timer_due();
+
+    armed_due = due;
+#ifdef __linux__
+    struct itimerspec its;
+
+    if (timer_fd < 0)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000;
+    its.it_value.tv_nsec = (due % 1000) * 1000000;
+    int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    if (ret != 0) {
+        errorpf(errno, "timerfd_settime()");
+        exit(FATAL_EXIT);
+    }
+#else
     struct itimerval it;
+    long long left = due - monotonic_ms();
+
+    if (left < 1)
+        left = 1;   /* zero would disarm it */
 
-    /* set UNIT_TIME millisecond interval timer */
     memset(&it, 0, sizeof(it));
-    it.it_interval.tv_sec = UNIT_TIME / 1000;
-    it.it_interval.tv_usec = (UNIT_TIME % 1000) * 1000;
-    it.it_value.tv_sec = UNIT_TIME / 1000;
-    it.it_value.tv_usec = (UNIT_TIME % 1000) * 1000;
+    it.it_value.tv_sec = left / 1000;
+    it.it_value.tv_usec = (left % 1000) * 1000;
     int ret = setitimer(ITIMER_REAL, &it, NULL);
     if (ret != 0) {
         errorpf(errno, "setitimer()");
         exit(FATAL_EXIT);
     }
+#endif
+}
+
+static void disarm_deadline_timer() {
+#ifdef __linux__
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+#else
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+#endif
+}
+
+/* Waits until the fd becomes readable. Returns -1 when interrupted by a
+   signal or woken up by the deadline timer, and continue_sighandler()
+   should be called then. Otherwise returns 0. */
+int wait_readable(int fd) {
+#ifdef __linux__
+    int nfds, out, standby;
+    struct pollfd fds[5];
+
+    /* what has been queued while handling the last messages */
+    send_pending_ctrlmsg();
+
+again:
+    nfds = 1;
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    out = -1;
+    if (ctrlmsg_pending()) {
+        /* the rest of the outbound queue */
+        out = nfds;
+        fds[nfds].fd = ctrl_wfd;
+        fds[nfds].events = POLLOUT;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+    if (timer_fd >= 0) {
+        fds[nfds].fd = timer_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+    standby = -1;
+    if (standby_fd >= 0) {
+        standby = nfds;
+        fds[nfds].fd = standby_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+    if (exit_fd >= 0) {
+        fds[nfds].fd = exit_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+
+    int ret = poll(fds, nfds, -1);
+    if (ret < 0) {
+        if (errno == EINTR)
+            return -1;
+        fixme(errno);
+        exit(FATAL_EXIT);
+    }
+    if (out >= 0 && fds[out].revents) {
+        send_pending_ctrlmsg();
+        if (--ret == 0)
+            goto again;
+    }
+    if (fds[0].revents)
+        return 0;
+
+    if (standby >= 0 && fds[standby].revents) {
+        /* the standby has exited, and is reaped by the caller */
+        watch_standby(0);
+        return -1;
+    }
+
+    if (exit_fd >= 0 && fds[nfds - 1].revents) {
+        /* killpid has exited; the pidfd stays readable, so it is used
+           only once, and the rest is left to the timer */
+        close_exit_fd();
+        received_exit_event = 1;
+        return -1;
+    }
+
+    /* the deadline has come */
+    uint64_t expirations;
+    ret = read(timer_fd, &expirations, sizeof(expirations));
+    UNUSED(ret);
+    received_alarm_signo = SIGALRM;
+    return -1;
+#else
+    /* read() will be interrupted by SIGALRM, and so is poll() */
+    send_pending_ctrlmsg();
+    while (ctrlmsg_pending()) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { ctrl_wfd, POLLOUT, 0 } };
+        if (poll(fds, 2, -1) < 0)
+            return (errno == EINTR) ? -1 : 0;
+        if (fds[1].revents)
+            send_pending_ctrlmsg();
+        if (fds[0].revents)
+            break;
+    }
+    return 0;
+#endif
+}
+
+/* Returns the abort signal received since the last call, or 0. This is
+   for the multi-watchdog, which does its own timing without the timer. */
+int take_abort_signo() {
+    int signo = received_abort_signo;
+
+    received_abort_signo = 0;
+    return signo;
 }
 
 static void asyncsafe_sighandler(int signo) {
@@ -144,6 +352,15 @@ static int killping() {
 static int killsig(int signo) {
     int ret;
 
+    if (signo != 0 && kill_sent == 0 && killpid != -1) {
+        kill_sent = monotonic_ms();
+        kill_signo = signo;
+    }
+
+    /* the whole tree at once, if it is in a cgroup of our own */
+    if (signo == SIGKILL && killpid != -1)
+        kill_cgroup();
+
     if (killpid == -1 ||
        ((ret = kill(killpid, signo)) == -1 && errno == ESRCH)) {
 
@@ -156,12 +373,123 @@ static int killsig(int signo) {
     return ret;
 }
 
+/* Logs how long it took the process to go since the first SIGTERM or
+   SIGKILL, with --verbose. */
+void report_kill_latency(int pid) {
+    if (kill_sent == 0)
+        return;
+    if (verbose)
+        noticepf("PID=%d has gone %lld ms after signal %d",
+                 pid, monotonic_ms() - kill_sent, kill_signo);
+    kill_sent = 0;
+}
+
+/* Waits at most timeout milliseconds for the process pid, or the leader
+   of the process group -pid, to exit. Returns 1 if it has exited, or 0 if
+   timed out or interrupted by a signal. Without pidfd_open(), it just
+   sleeps for a short while and returns 0. */
+int wait_exit(int pid, long long timeout) {
+    int interval = 10;  /* millisecond */
+
+    if (timeout <= 0)
+        return 0;
+
+    int fd = open_pidfd(pid);
+    if (fd >= 0) {
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, (timeout > 60 * 1000) ? 60 * 1000 : (int) timeout);
+        close(fd);
+        return ret > 0;
+    }
+
+    if (timeout > interval)
+        timeout = interval;
+    usleep(timeout * 1000);
+    return 0;
+}
+
+/* Returns a pidfd of the process pid, or of the leader of the process
+   group -pid, or -1 if not available. */
+static int open_pidfd(int pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    if (pid == -1 || pid == 0)
+        return -1;
+    return syscall(SYS_pidfd_open, (pid < 0) ? -pid : pid, 0);
+#else
+    UNUSED(pid);
+    return -1;
+#endif
+}
+
+/* With --standby, makes wait_readable() return once the standby has
+   exited. 0 to stop watching. Only on Linux, with pidfd_open(). */
+void watch_standby(int pid) {
+#ifdef __linux__
+    if (standby_fd >= 0) {
+        close(standby_fd);
+        standby_fd = -1;
+    }
+    if (pid > 0) {
+        standby_fd = open_pidfd(pid);
+        if (standby_fd >= 0)
+            fcntl(standby_fd, F_SETFD, FD_CLOEXEC);
+    }
+#else
+    UNUSED(pid);
+#endif
+}
+
+static void open_exit_fd() {
+#ifdef __linux__
+    close_exit_fd();
+    exit_fd = open_pidfd(killpid);
+    if (exit_fd >= 0)
+        fcntl(exit_fd, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+static void close_exit_fd() {
+#ifdef __linux__
+    if (exit_fd >= 0) {
+        close(exit_fd);
+        exit_fd = -1;
+    }
+#endif
+}
+
+/* Waits at most timeout milliseconds for killpid to vanish. */
+static int wait_vanished(long long timeout) {
+    long long until = monotonic_ms() + timeout, left;
+    int interval = 10;  /* millisecond */
+    int exited = 0;
+
+    while ((left = until - monotonic_ms()) > 0) {
+        if (!exited) {
+            exited = wait_exit(killpid, left);
+        } else {
+            /* The leader has exited, but the process is a zombie not
+               reaped yet, or the rest of the group is still there. */
+            usleep(((left > interval) ? interval : left) * 1000);
+        }
+        if (killping() > 0)
+            return 1;
+    }
+    return 0;
+}
+
 int continue_sighandler() {
-    static int expected = -1;   /* expected exit code */
+    int pid = killpid;          /* killpid becomes -1 once it has gone */
+    const char *cause = "timed out";    /* for the hang dump */
+    char buf[CTRL_LINE_MAX];
+    long long now;
 
     if (received_abort_signo) {
 
-        if (timer <= SIGTERM_TIMEOUT) {
+        if (phase != TIMER_RUNNING) {
             /* It's too late */
             received_abort_signo = 0;
         } else {
@@ -171,35 +499,117 @@ int continue_sighandler() {
             errorpf(-1, "received signal #%d, terminating", received_abort_signo);
             received_abort_signo = 0;
 
-            timer = SIGTERM_TIMEOUT;
+            now = monotonic_ms();
             goto breakin;
         }
     }
 
+    if (received_exit_event) {
+        received_exit_event = 0;
+
+        if (phase == TIMER_TERMSENT && killping() > 0)
+            goto vanished;
+    }
+
     if (received_alarm_signo) {
         received_alarm_signo = 0;
+        realtime_wakeup(armed_due);
 
-        if (timer <= TIMER_FINISHED)
+        if (phase != TIMER_RUNNING && phase != TIMER_TERMSENT)
             goto normal_return;
 
-        timer--;
-        if (timer < SIGKILL_TIMEOUT || SIGTERM_TIMEOUT < timer)
+        now = monotonic_ms();
+        if (phase == TIMER_RUNNING) {
+            /* a beat on the shared-memory page extends the deadline */
+            long long beat = beatpage_deadline();
+            if (beat > deadline && beat > now) {
+                deadline = beat;
+                liveness_beat(now);
+                send_ctrlmsgf("TIMEOUT_MS=%lld", beat - now + EXTRA_TIMEOUT * 1000LL);
+            }
+
+            /* a resource policy is violated, see liveness.c */
+            int violated = check_liveness(now);
+            if (violated > 0) {
+                cause = (violated == 1) ? "exceeded --max-rss" : "exceeded --max-cpu";
+                if (expected < 0) {
+                    expected = TIMEOUT_EXIT;
+                    errorpf(-1, "PID=%d will now be terminated", killpid);
+                }
+                goto breakin;
+            }
+
+            /* a named heartbeat has stalled, or extends the deadline,
+               see namedbeat.c */
+            const char *stalled = NULL;
+            long long named = check_named_beats(now, &stalled);
+            if (named < 0) {
+                snprintf(buf, sizeof(buf), "heartbeat %s has stalled", stalled);
+                cause = buf;
+                if (expected < 0) {
+                    expected = TIMEOUT_EXIT;
+                    errorpf(-1, "PID=%d will now be terminated", killpid);
+                }
+                goto breakin;
+            }
+            if (named > deadline) {
+                deadline = named;
+                liveness_beat(now);
+                send_ctrlmsgf("TIMEOUT_MS=%lld", named - now + EXTRA_TIMEOUT * 1000LL);
+            }
+        }
+        if (now < deadline) {
+            /* woken up too early, or the deadline has been extended */
+            arm_deadline_timer();
             goto normal_return;
+        }
+
+        /* the target may be only starved of CPU, see starve.c */
+        if (phase == TIMER_RUNNING && starvation == STARVATION_NONE) {
+            long long probe = start_starvation_probe();
+            if (probe > 0) {
+                starvation = STARVATION_PROBING;
+                deadline = now + probe;
+                arm_deadline_timer();
+                goto normal_return;
+            }
+        }
+        else if (phase == TIMER_RUNNING && starvation == STARVATION_PROBING) {
+            starvation = STARVATION_EXTENDED;
+            long long grace = check_starvation();
+            if (grace > 0) {
+                deadline = now + grace;
+                send_ctrlmsgf("TIMEOUT_MS=%lld", grace + EXTRA_TIMEOUT * 1000LL);
+                arm_deadline_timer();
+                goto normal_return;
+            }
+            cause = "timed out, not starved of CPU";
+        }
+        else if (phase == TIMER_RUNNING && starvation == STARVATION_EXTENDED) {
+            /* only left running on the grace */
+            cause = "timed out, even after the grace for CPU starvation";
+        }
 
 breakin:
         if (killping() > 0)
             goto vanished;
 
-        if (timer == SIGTERM_TIMEOUT) {
+        if (phase == TIMER_RUNNING) {
             if (expected < 0) {
                 expected = TIMEOUT_EXIT;
                 errorpf(-1, "timed out, PID=%d will now be terminated", killpid);
             }
+            if (expected == TIMEOUT_EXIT)
+                dump_hang(killpid, cause);
             noticepf("sending SIGTERM to PID=%d", killpid);
             if (killsig(SIGTERM) > 0)
                 goto vanished;
+
+            phase = TIMER_TERMSENT;
+            kill_deadline = now + SIGKILL_DELAY * 1000LL;
+            open_exit_fd();
         }
-        if (timer == SIGKILL_TIMEOUT) {
+        else if (now >= kill_deadline) {
             noticepf("sending SIGKILL to PID=%d", killpid);
             if (killsig(SIGKILL) > 0)
                 goto vanished;
@@ -208,18 +618,50 @@ breakin:
             killpid = -1;
             goto vanished;
         }
+
+        /* see if the process is gone, until SIGKILL is due */
+        deadline = now + UNIT_TIME;
+        if (deadline > kill_deadline)
+            deadline = kill_deadline;
+        arm_deadline_timer();
     }
 
 normal_return:
     return -1;
 
 vanished:
-    timer = TIMER_FINISHED;
+    phase = TIMER_FINISHED;
+    disarm_deadline_timer();
+    close_exit_fd();
+    report_kill_latency(pid);
     return expected;
 }
 
+/* Makes the timer ready for the next monitoring-target, after the last one
+   has gone, with --restart. */
+void restart_timer() {
+    killpid = -1;
+    phase = TIMER_INITIAL;
+    starvation = STARVATION_NONE;
+    expected = -1;
+    received_exit_event = 0;
+    received_alarm_signo = 0;
+    kill_sent = 0;
+    close_exit_fd();
+    init_deadline_timer();
+}
+
+/* Arms the timer again if it is due earlier than armed, after a named
+   heartbeat. A later one is left to the next wakeup. */
+void update_deadline_timer() {
+    if (phase == TIMER_RUNNING && timer_due() < armed_due)
+        arm_deadline_timer();
+}
+
 static void onexit() {
-    timer = TIMER_FINISHED;
+    phase = TIMER_FINISHED;
+    disarm_deadline_timer();
+    close_exit_fd();
 
     if (last_exit_code < 0) {
         /* last_exit_code is not set. The exit(3) is called directly
@@ -229,25 +671,28 @@ static void onexit() {
 
     run_finalkiller();
 
+    /* also reports the resource usage, so before ctrl_wfd is closed */
+    close_cgroup();
+
     if (ctrl_wfd >= 0) {
         send_ctrlmsgf_without_error_handling("EXIT=%d", last_exit_code);
+        flush_ctrlmsg();
+        /* the log should be complete when the upstream sees the EOF */
+        flush_ctrl_log();
         close(ctrl_wfd);
         ctrl_wfd = -1;
     }
 
     run_onexit_script();
 
-    if (ctrl_logfp) {
-        fclose(ctrl_logfp);
-        ctrl_logfp = NULL;
-    }
+    close_ctrl_log();
 
     if (debug)
         check_fdleak();
 }
 
 static void run_finalkiller() {
-    int ret, count, interval = 100;  /* millisecond */
+    int pid = killpid;
 
     /* Here, it is assumed that program execution will
        go here from situations where it is difficult to
@@ -255,31 +700,19 @@ static void run_finalkiller() {
     if (killpid == -1)
         return;
 
-    ret = killping();
-    if (ret > 0)
+    if (killping() > 0)
         return;
 
-    count = HOLDON_DELAY * (1000 / interval);
-    while (count-- > 0) {
-        usleep(interval * 1000);
-
-        ret = killping();
-        if (ret > 0)
-            return;
-    }
+    if (wait_vanished(HOLDON_DELAY * 1000LL))
+        return;
 
     noticepf("sending SIGTERM to PID=%d", killpid);
-    ret = killsig(SIGTERM);
-    if (ret > 0)
+    if (killsig(SIGTERM) > 0)
         return;
 
-    count = SIGKILL_DELAY * (1000 / interval);
-    while (count-- > 0) {
-        usleep(interval * 1000);
-
-        ret = killping();
-        if (ret > 0)
-            return;
+    if (wait_vanished(SIGKILL_DELAY * 1000LL)) {
+        report_kill_latency(pid);
+        return;
     }
 
     noticepf("sending SIGKILL to PID=%d", killpid);
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* CPU starvation check, with --starvation-grace. When the deadline has
+   come, the threads of the monitoring-target are looked at twice, a
+   STARVATION_PROBE apart, in /proc/<PID>/task/<TID>/schedstat and stat.
+   If some thread is runnable and the threads have waited on the run queue
+   longer than they have run in between, the target is starved of CPU
+   rather than hung, and the deadline is extended once by the grace. */
+
+int starvation_grace = 0;           /* in second, 0 if disabled */
+
+static int target_pid = 0;
+static struct snapshot {
+    long long when;                 /* see monotonic_ms() */
+    long long run;                  /* sum of the time on CPU, in ns */
+    long long wait;                 /* sum of the time on run queue, in ns */
+    int threads;
+    int runnable;
+} before;
+
+static int take_snapshot(struct snapshot *snap);
+
+void init_starvation(int pid) {
+    target_pid = pid;
+}
+
+/* Takes the first look. Returns how long to wait for the second one in
+   millisecond, or 0 if the check is not available. */
+long long start_starvation_probe() {
+    if (starvation_grace <= 0 || target_pid <= 0)
+        return 0;
+    if (take_snapshot(&before) < 0)
+        return 0;
+    return STARVATION_PROBE;
+}
+
+/* Takes the second look, and logs the decision with the evidence. Returns
+   the grace in millisecond if starved, otherwise 0. */
+long long check_starvation() {
+    struct snapshot after;
+
+    if (take_snapshot(&after) < 0)
+        return 0;
+
+    long long run = (after.run - before.run) / 1000000;
+    long long wait = (after.wait - before.wait) / 1000000;
+    int starved = ((before.runnable > 0 || after.runnable > 0) && wait > run);
+
+    noticepf("PID=%d has %d of %d threads runnable, ran %lld ms and waited %lld ms "
+             "for CPU in %lld ms, %s", target_pid, after.runnable, after.threads,
+             run, wait, after.when - before.when,
+             starved ? "starved of CPU, extending the deadline" : "not starved");
+
+    return starved ? starvation_grace * 1000LL : 0;
+}
+
+static int take_snapshot(struct snapshot *snap) {
+    char path[64], buf[1024];
+    struct dirent *ent;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->when = monotonic_ms();
+
+    snprintf(path, sizeof(path), "/proc/%d/task", target_pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        long long run, wait;
+        snprintf(path, sizeof(path), "/proc/%d/task/%.16s/schedstat", target_pid, ent->d_name);
+        if (read_small(path, buf, sizeof(buf)) < 0 ||
+            sscanf(buf, "%lld %lld", &run, &wait) != 2)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%.16s/stat", target_pid, ent->d_name);
+        if (read_small(path, buf, sizeof(buf)) < 0)
+            continue;
+
+        /* the state follows "TID (COMM) " */
+        char *cp = strrchr(buf, ')');
+        if (cp && cp[1] == ' ' && cp[2] == 'R')
+            snap->runnable++;
+
+        snap->run += run;
+        snap->wait += wait;
+        snap->threads++;
+    }
+    closedir(dir);
+
+    return (snap->threads > 0) ? 0 : -1;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,4 @@
+echo TIMEOUT_MS=500 1>&3
+sleep 7
+
+exit 0
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    int i, sent = 0;
+
+    if (bw_init() != 0) {
+        perror("bw_init()");
+        return 1;
+    }
+    if (bw_set_timeout(3000) != 0) {
+        perror("bw_set_timeout()");
+        return 1;
+    }
+
+    /* all of them fall in the coalescing window of 3000/8 ms */
+    for (i = 0; i < 100000; i++)
+        sent += bw_beat();
+    printf("beats=%d sent=%d\n", i, sent);
+
+    /* and this one does not */
+    usleep(400 * 1000);
+    printf("sent=%d\n", bw_beat());
+    fflush(stdout);
+
+    bw_exit(7);
+    bw_detach();
+    usleep(500 * 1000);
+    return 7;
+}
+
+/* vim: set et sw=4 sts=4: */
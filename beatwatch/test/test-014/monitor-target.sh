@@ -0,0 +1,5 @@
+echo TIMEOUT=5 1>&3
+echo "last words"
+echo "famous last words" 1>&2
+
+exit 3
@@ -0,0 +1,33 @@
+#!/bin/sh
+set -e
+
+# unset env
+PATH=/usr/bin:/bin
+for x in $(env | sed 's/=.*$//'); do
+    case "$x" in
+    HOME|LOGNAME|PATH|PWD|SHELL|SHLVL|TERM|USER) ;;
+    beatwatch_*) ;;
+    (*) unset $x ;;
+    esac
+done
+
+rundir=${1:-.}
+while [ "$1" != '--' ]; do shift; done; shift
+
+cd $rundir
+
+(eval "$@" 3>&1 2>stderr 1>stdout </dev/null; echo $? > exitcode) \
+> fd3out.log || :
+
+# the time of the dump is not in the form that compcat.sh knows
+sed -e 's/^=== .* PID=/=== (time) PID=/' flight.log > flight.txt
+
+../../compcat.sh	\
+	exitcode	\
+	stdout		\
+	stderr		\
+	ctrl.log	\
+	fd3out.log	\
+	flight.txt	\
+	> run-test-results.txt
+exit 0
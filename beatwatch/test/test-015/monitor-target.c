@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    char buf[64];
+    int fds[2], n;
+
+    if (bw_stored_fds(fds, 2) == 1) {
+        /* the second run reads what the first one has left in the pipe */
+        n = read(fds[0], buf, sizeof(buf) - 1);
+        buf[n > 0 ? n : 0] = '\0';
+        printf("inherited: %s", buf);
+        return 0;
+    }
+
+    if (pipe(fds) != 0) {
+        perror("pipe()");
+        return 1;
+    }
+    n = write(fds[1], "hello from the first run\n", 25);
+    if (n != 25) {
+        perror("write()");
+        return 1;
+    }
+    if (bw_store_fds(fds, 1) != 0) {
+        perror("bw_store_fds()");
+        return 1;
+    }
+    printf("stored: the read end of a pipe\n");
+    return 3;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    /* initialized here, and the standby waits for the promotion */
+    int ret = bw_standby();
+    if (ret < 0) {
+        perror("bw_standby()");
+        return 1;
+    }
+    if (ret == 0) {
+        printf("active\n");
+        fflush(stdout);
+        usleep(200 * 1000);
+        return 3;
+    }
+
+    printf("promoted\n");
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    bw_beat_named("main", 5000);
+    bw_beat_named("worker-1", 1000);
+    bw_beat_named("worker-2", 2000);
+    bw_beat_named("worker-3", 500);
+    bw_beat_named("worker-3", 0);
+
+    /* worker-1 beats well before worker-2 stalls, and then stops too */
+    for (int i = 0; i < 4; i++) {
+        usleep(300 * 1000);
+        bw_beat_named("worker-1", 1000);
+    }
+    pause();
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
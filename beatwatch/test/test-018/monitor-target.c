@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "beatwatch.h"
+
+int main() {
+    const char *str = getenv("BEATWATCH_BEAT_FD");
+
+    printf("beat fd: %s\n", str ? str : "(none)");
+    if (bw_init() != 0) {
+        perror("bw_init()");
+        return 1;
+    }
+    /* no message is sent for a beat on the page */
+    printf("beat: %s\n", bw_beat() == 0 ? "on the page" : "sent");
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,7 @@
+i=1
+while [ $i -le 60 ]; do
+    printf 'line %02d\n' $i 1>&3
+    sleep 0.01
+    i=$(($i + 1))
+done
+exit 0
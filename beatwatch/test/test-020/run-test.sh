@@ -0,0 +1,47 @@
+#!/bin/sh
+set -e
+
+# unset env
+PATH=/usr/bin:/bin
+for x in $(env | sed 's/=.*$//'); do
+    case "$x" in
+    HOME|LOGNAME|PATH|PWD|SHELL|SHLVL|TERM|USER) ;;
+    beatwatch_*) ;;
+    (*) unset $x ;;
+    esac
+done
+
+rundir=${1:-.}
+while [ "$1" != '--' ]; do shift; done; shift
+
+cd $rundir
+
+(eval "$@" 3>&1 2>stderr 1>stdout </dev/null; echo $? > exitcode) \
+> fd3out.log || :
+
+# Which line goes to which generation depends on the timing. So instead,
+# see that there are CTRL_LOG_GENERATIONS of them, none over the size, and
+# that the lines in them are in a row up to the last one.
+generations=0
+for g in 1 2 3 4; do
+    test -e ctrl.log.$g || continue
+    generations=$(($generations + 1))
+    test $(wc -c < ctrl.log.$g) -le 512 || echo "ctrl.log.$g: over 512 bytes"
+done > rotation
+echo "generations: $generations" >> rotation
+cat ctrl.log.3 ctrl.log.2 ctrl.log.1 ctrl.log 2> /dev/null \
+| sed -n 's/.*	line \([0-9]*\)$/\1/p' > lines
+if [ "$(seq -f %02g $(head -n 1 lines) 60)" = "$(cat lines)" ]; then
+    echo "lines: in a row up to $(tail -n 1 lines)" >> rotation
+else
+    echo "lines: not in a row" >> rotation
+fi
+
+../../compcat.sh	\
+	exitcode	\
+	stdout		\
+	stderr		\
+	rotation	\
+	fd3out.log	\
+	> run-test-results.txt
+exit 0
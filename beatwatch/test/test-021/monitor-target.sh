@@ -0,0 +1,9 @@
+i=1
+while [ $i -le 20 ]; do
+    echo 'TIMEOUT=1' 1>&3
+    sleep 0.05
+    i=$(($i + 1))
+done
+echo 'TIMEOUT=0' 1>&3
+exec sleep 3
+exit 0
@@ -0,0 +1,31 @@
+#define _GNU_SOURCE     /* for pthread_setname_np() */
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Hangs with a worker thread asleep, and the main thread in vfork(),
+   which is an uninterruptible sleep (state D) until the child exits. */
+
+static void *worker(void *arg) {
+    (void) arg;
+    for (;;)
+        pause();
+    return NULL;
+}
+
+int main() {
+    pthread_t th;
+
+    if (pthread_create(&th, NULL, worker, NULL) != 0)
+        return 1;
+    pthread_setname_np(th, "worker");
+
+    dprintf(3, "TIMEOUT=1\n");
+    if (vfork() == 0) {
+        for (;;)
+            pause();
+    }
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,36 @@
+#!/bin/sh
+set -e
+
+# unset env
+PATH=/usr/bin:/bin
+for x in $(env | sed 's/=.*$//'); do
+    case "$x" in
+    HOME|LOGNAME|PATH|PWD|SHELL|SHLVL|TERM|USER) ;;
+    beatwatch_*) ;;
+    (*) unset $x ;;
+    esac
+done
+
+rundir=${1:-.}
+while [ "$1" != '--' ]; do shift; done; shift
+
+cd $rundir
+
+(eval "$@" 3>&1 2>stderr 1>stdout </dev/null; echo $? > exitcode) \
+> fd3out.log || :
+
+# the stacks differ from run to run, only how each thread is dumped
+awk '/^--- / { thread = $4 " " $5 }
+     /^ustack:$/ { print thread ": sampled" }
+     /^ustack: / { print thread ": " ($0 ~ /\(/ ? "error" : substr($0, 9)) }' \
+	ctrl.log.hang | sort > hang
+
+../../compcat.sh	\
+	exitcode	\
+	stdout		\
+	stderr		\
+	ctrl.log	\
+	hang		\
+	fd3out.log	\
+	> run-test-results.txt
+exit 0
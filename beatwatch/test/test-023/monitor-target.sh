@@ -0,0 +1,11 @@
+echo TIMEOUT=5 1>&3
+echo "before bye"
+echo BYE 1>&3
+
+# the watchdog has gone by now
+sleep 3
+echo "after bye" || echo "stdout failed" > failed
+echo "after bye" 1>&2 || echo "stderr failed" >> failed
+touch done
+
+exit 0
@@ -0,0 +1,12 @@
+echo TIMEOUT=5 1>&3
+
+# more than the pipes and the queue take while the reader sleeps
+i=1
+while [ $i -le 4000 ]; do
+    echo "line $i ................................................................" 1>&3
+    echo TIMEOUT=5 1>&3
+    i=$(($i + 1))
+done
+echo TIMEOUT=7 1>&3
+
+exit 0
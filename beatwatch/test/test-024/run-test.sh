@@ -0,0 +1,54 @@
+#!/bin/sh
+set -e
+
+# unset env
+PATH=/usr/bin:/bin
+for x in $(env | sed 's/=.*$//'); do
+    case "$x" in
+    HOME|LOGNAME|PATH|PWD|SHELL|SHLVL|TERM|USER) ;;
+    beatwatch_*) ;;
+    (*) unset $x ;;
+    esac
+done
+
+rundir=${1:-.}
+while [ "$1" != '--' ]; do shift; done; shift
+
+cd $rundir
+
+# the reader of --ctrl-fd is slow to start
+(eval "$@" 3>&1 2>stderr 1>stdout </dev/null; echo $? > exitcode) \
+| (sleep 2; cat) > fd3out.log || :
+
+# which lines have come, and in what order
+awk '
+/^NOTICE: .* control messages dropped$/ {
+    if (exited) print "notice after EXIT"
+    notices++
+    next
+}
+/^line / {
+    if ($2 + 0 <= last) print "line " $2 " out of order"
+    if (exited) print "line after EXIT"
+    last = $2 + 0
+    lines++
+    next
+}
+/^\+ TIMEOUT=[57]$/ { next }
+/^% TIMEOUT=10$/ { if (latest) print "TIMEOUT=10 after TIMEOUT=12"; relays++; next }
+/^% TIMEOUT=12$/ { latest++; next }
+/^% EXIT=/ { exited = 1 }
+{ print }
+END {
+    print "dropped: " (notices > 0 && lines < 4000 ? "some, with a notice" : "none")
+    print "coalesced: " (relays < 4001 ? "yes" : "no")
+    print "latest kept: " latest
+}' fd3out.log > queue
+
+../../compcat.sh	\
+	exitcode	\
+	stdout		\
+	stderr		\
+	queue		\
+	> run-test-results.txt
+exit 0
@@ -0,0 +1,5 @@
+echo TIMEOUT=5 1>&3
+echo FDSTORE=1 1>&3
+echo FDSTORE=0 1>&3
+
+exit 0
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    int fds[2];
+
+    /* the standby fails before it is ready */
+    if (getenv("BEATWATCH_STANDBY"))
+        return 4;
+
+    usleep(300 * 1000);
+    if (pipe(fds) != 0 || bw_store_fds(fds, 1) != 0) {
+        perror("bw_store_fds()");
+        return 1;
+    }
+    printf("stored fds: %d\n", bw_stored_fds(fds, 2));
+    fflush(stdout);
+    usleep(200 * 1000);
+
+    /* the first run fails, and the second one does not */
+    if (access("ran", F_OK) != 0) {
+        fclose(fopen("ran", "w"));
+        return 3;
+    }
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
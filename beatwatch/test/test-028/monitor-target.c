@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+#define SIZE    (64 * 1024 * 1024)
+
+int main() {
+    int run = (access("ran", F_OK) == 0) ? 2 : 1;
+    char *p = malloc(SIZE);
+
+    if (p == NULL)
+        return 1;
+    memset(p, 1, SIZE);
+    if (run == 1)
+        fclose(fopen("ran", "w"));
+
+    /* keeps beating, but stays over --max-rss */
+    bw_set_timeout(10 * 1000);
+    for (int i = 1; ; i++) {
+        bw_beat();
+        usleep(100 * 1000);
+        if (i == 20) {
+            /* touches the buffer, not to let it be optimized out */
+            printf("run %d: alive after 2 seconds, %d\n", run, p[i]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    /* the heartbeat "db" beats once, while the main one keeps beating */
+    bw_set_timeout(10 * 1000);
+    bw_beat_named("db", 1000);
+    for (int i = 0; i < 50; i++) {
+        bw_beat();
+        usleep(100 * 1000);
+    }
+    printf("not terminated\n");
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,7 @@
+#!/bin/sh
+
+# the policy of each thread of the watchdog, the 41st field of stat
+sleep 1
+for task in /proc/$PPID/task/*; do
+    sed -e 's/^.*) //' $task/stat | cut -d' ' -f39
+done | sort | uniq -c | sed -e 's/^ */policy /'
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "beatwatch.h"
+
+static volatile sig_atomic_t terminated = 0;
+
+static void handler(int signo) {
+    (void) signo;
+    terminated = 1;
+}
+
+int main() {
+    /* no heartbeat after this, and SIGTERM takes 50 ms to exit */
+    signal(SIGTERM, handler);
+    bw_set_timeout(1000);
+
+    /* a grandchild out of the process group keeps the control channel
+       open for a while, so only the exit tells that the target has gone */
+    if (fork() == 0) {
+        setsid();
+        sleep(3);
+        _exit(0);
+    }
+    while (!terminated)
+        pause();
+    usleep(50 * 1000);
+    printf("exiting on SIGTERM\n");
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,4 @@
+grep -q beatwatch /proc/self/cgroup && echo 'in a cgroup of beatwatch'
+echo 'TIMEOUT=1' 1>&3
+exec sleep 5
+exit 0
@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "beatwatch.h"
+
+int main() {
+    /* hangs without waiting for a CPU */
+    bw_set_timeout(1000);
+    sleep(10);
+    printf("not terminated\n");
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,37 @@
+#define _GNU_SOURCE     /* for CPU_SET() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "beatwatch.h"
+
+int main() {
+    cpu_set_t set;
+    int cpu = 0;
+
+    /* on a single CPU, shared with a busy child of the default nice */
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        while (cpu < CPU_SETSIZE - 1 && !CPU_ISSET(cpu, &set))
+            cpu++;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    bw_set_timeout(1000);
+    if (fork() == 0) {
+        for (;;)
+            ;
+    }
+
+    /* keeps running without a heartbeat, but mostly waits for the CPU */
+    setpriority(PRIO_PROCESS, 0, 19);
+    for (;;)
+        ;
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,34 @@
+#!/bin/sh
+set -e
+
+# unset env
+PATH=/usr/bin:/bin
+for x in $(env | sed 's/=.*$//'); do
+    case "$x" in
+    HOME|LOGNAME|PATH|PWD|SHELL|SHLVL|TERM|USER) ;;
+    beatwatch_*) ;;
+    (*) unset $x ;;
+    esac
+done
+
+rundir=${1:-.}
+while [ "$1" != '--' ]; do shift; done; shift
+
+cd $rundir
+
+(eval "$@" 3>&1 2>stderr 1>stdout </dev/null; echo $? > exitcode) \
+> fd3out.log || :
+
+# only the header of the dump, the threads differ from run to run
+sed -n 's/^=== .* (.....) /=== (time) /p' hang.txt > hang
+
+../../compcat.sh	\
+	exitcode	\
+	stdout		\
+	stderr		\
+	ctrl.log	\
+	hang		\
+	fd3out.log	\
+	| sed -e 's/ran [0-9]* ms and waited [0-9]* ms for CPU in [0-9]* ms/ran (n) ms and waited (n) ms for CPU in (n) ms/' \
+	> run-test-results.txt
+exit 0
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "errorpf.h"
+#include "global.h"
+
+/* A binary min-heap of deadlines. The nodes are embedded in the objects
+   that own them, and each node remembers its own position in the heap,
+   so that both rescheduling and cancelling are O(log n) and no memory
+   is allocated per deadline. */
+
+static void sift_up(struct timerq *tq, int i);
+static void sift_down(struct timerq *tq, int i);
+static void place(struct timerq *tq, int i, struct tqnode *node);
+
+long long monotonic_ms() {
+    struct timespec ts;
+
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (ret != 0) {
+        errorpf(errno, "clock_gettime()");
+        exit(FATAL_EXIT);
+    }
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_us() {
+    struct timespec ts;
+
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (ret != 0) {
+        errorpf(errno, "clock_gettime()");
+        exit(FATAL_EXIT);
+    }
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void tq_init(struct tqnode *node) {
+    node->deadline = 0;
+    node->index = -1;
+}
+
+int tq_set(struct timerq *tq, struct tqnode *node, long long deadline) {
+    if (node->index < 0) {
+        if (tq->len >= tq->cap) {
+            int cap = tq->cap ? tq->cap * 2 : 16;
+            struct tqnode **heap = realloc(tq->heap, cap * sizeof(*heap));
+            if (heap == NULL)
+                return -1;
+            tq->heap = heap;
+            tq->cap = cap;
+        }
+        node->deadline = deadline;
+        place(tq, tq->len++, node);
+        sift_up(tq, node->index);
+        return 0;
+    }
+
+    long long prev = node->deadline;
+    node->deadline = deadline;
+    if (deadline < prev)
+        sift_up(tq, node->index);
+    else
+        sift_down(tq, node->index);
+    return 0;
+}
+
+void tq_cancel(struct timerq *tq, struct tqnode *node) {
+    int i = node->index;
+
+    if (i < 0)
+        return;
+    node->index = -1;
+
+    if (--tq->len == i)
+        return;
+
+    /* fill the hole with the last node */
+    place(tq, i, tq->heap[tq->len]);
+    sift_up(tq, i);
+    sift_down(tq, tq->heap[i]->index);
+}
+
+struct tqnode *tq_first(struct timerq *tq) {
+    return (tq->len > 0) ? tq->heap[0] : NULL;
+}
+
+static void sift_up(struct timerq *tq, int i) {
+    struct tqnode *node = tq->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (tq->heap[parent]->deadline <= node->deadline)
+            break;
+        place(tq, i, tq->heap[parent]);
+        i = parent;
+    }
+    place(tq, i, node);
+}
+
+static void sift_down(struct timerq *tq, int i) {
+    struct tqnode *node = tq->heap[i];
+
+    while (1) {
+        int child = i * 2 + 1;
+        if (child >= tq->len)
+            break;
+        if (child + 1 < tq->len &&
+            tq->heap[child + 1]->deadline < tq->heap[child]->deadline)
+            child++;
+        if (node->deadline <= tq->heap[child]->deadline)
+            break;
+        place(tq, i, tq->heap[child]);
+        i = child;
+    }
+    place(tq, i, node);
+}
+
+static void place(struct timerq *tq, int i, struct tqnode *node) {
+    tq->heap[i] = node;
+    node->index = i;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -1,36 +1,139 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include "errorpf.h"
 #include "global.h"
 
+struct exitcode {
+    /* exit code got from below */
+    int waitpid;
+    int ctrlmsg;
+    int sigcause;
+    int bye;                    /* the monitoring-target has said BYE */
+};
+
 static const char done = '+';   /* done mark */
-static int child_posttask(void);
+static long long last_gone = 0; /* when the last one has gone, see --restart */
+static long long last_backoff = 0;
+static int standby_pid = 0;     /* see --standby */
+static int standby_rfd = -1;
+static long long promoted = 0;  /* when the standby has been promoted */
+static int run_target(struct exitcode *exitcode, int child_pid);
+static int restartable(int ret, const struct exitcode *exitcode);
+static int wait_backoff(long long backoff);
+static void start_standby(void);
+static int promote_standby(void);
+static void stop_standby(void);
+static void check_standby(void);
+static int child_posttask(int standby);
 static int parent_posttask(int child_pid);
 static int ctrlmsg_handler(char, int, const char *, int *);
+static void relay_timeout(char type, int val, const char *line);
 static int waitpid_for_a_while(int child);
 static int waitpid_nohang(int child);
 
 int watchdog() {
     int ret;
-    struct {
-        /* exit code got from below */
-        int waitpid;
-        int ctrlmsg;
-        int sigcause;
-    } exitcode = { -1, -1, -1 };
+    struct exitcode exitcode;
+
+    init_realtime();
+    create_cgroup();
+
+    /* with --restart, fds can be passed to the watchdog on ctrl_rfd */
+    ctrl_fds = (restart_limit > 0);
+
+    int child_pid = 0;  /* to be forked */
+    while (1) {
+        long long started = monotonic_ms();
+
+        ret = run_target(&exitcode, child_pid);
+        if (!restartable(ret, &exitcode))
+            break;
+
+        last_gone = monotonic_ms();
+        check_standby();
+        last_backoff = restart_backoff(last_gone - started, standby_pid > 0);
+        if (last_backoff < 0)
+            break;
+
+        if (standby_pid > 0) {
+            restart_timer();
+            child_pid = promote_standby();
+            continue;
+        }
+        child_pid = 0;
+
+        /* keep the upstream waiting until the next one sends TIMEOUT=N */
+        send_ctrlmsgf("TIMEOUT_MS=%lld",
+                      last_backoff + (BASE_TIMEOUT + EXTRA_TIMEOUT) * 1000LL);
+
+        /* what the last one has left in its cgroup, if any */
+        kill_cgroup();
 
-    int child_pid = pipe_and_fork();
+        int signo = wait_backoff(last_backoff);
+        if (signo) {
+            errorpf(-1, "received signal #%d, terminating", signo);
+            ret = exitcode.sigcause = SIGNAL_EXIT(signo);
+            break;
+        }
+        restart_timer();
+    }
+
+    stop_standby();
+    report_realtime();
+
+    /* kept open for the next one, see parent_posttask() */
+    if (ctrl_kfd >= 0) {
+        close(ctrl_kfd);
+        ctrl_kfd = -1;
+    }
+    close_stored_fds();
+
+    if (exitcode.ctrlmsg >= 0 && exitcode.sigcause < 0) {
+        /* Do not send EXIT=N control message again. It has alread been sent. */
+        if (ctrl_wfd >= 0) {
+            flush_ctrlmsg();
+            flush_ctrl_log();
+            close(ctrl_wfd);
+            ctrl_wfd = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Runs the monitoring-target once, until it has gone. It is forked here
+   unless child_pid is a standby promoted. */
+static int run_target(struct exitcode *exitcode, int child_pid) {
+    int ret;
+
+    exitcode->waitpid = exitcode->ctrlmsg = exitcode->sigcause = -1;
+    exitcode->bye = 0;
 
     if (child_pid == 0) {
-        /* child side */
-        ret = child_posttask();
-        exit(ret);
+        create_beatpage();
+        create_flight_recorder();
+
+        child_pid = pipe_and_fork();
+
+        if (child_pid == 0) {
+            /* child side */
+            ret = child_posttask(0);
+            exit(ret);
+        }
+
+        /* parent side */
+        start_flight_recorder();
     }
 
-    /* parent side */
+    /* a slow reader upstream must not hold up the watchdog */
+    enable_ctrlmsg_queue();
     ret = parent_posttask(child_pid);
 
     if (ret == 0) {
@@ -39,6 +142,9 @@ int watchdog() {
         goto wayout;
     }
 
+    /* with --standby, the next one gets ready meanwhile */
+    start_standby();
+
     /* watchdog main loop */
     char type;
     int val;
@@ -57,13 +163,14 @@ int watchdog() {
 
             ret = waitpid_nohang(child_pid);
             if (ret >= 0) {
-                exitcode.waitpid = ret;
+                exitcode->waitpid = ret;
                 break;
             }
+            check_standby();
 
             ret = continue_sighandler();
             if (ret >= 0) {
-                exitcode.sigcause = ret;
+                exitcode->sigcause = ret;
                 break;
             }
             continue;
@@ -71,17 +178,38 @@ int watchdog() {
         else if (ret > 0) {
             /* got a control message */
 
-            ret = ctrlmsg_handler(type, val, line, &exitcode.ctrlmsg);
-            if (ret > 0)
+            ret = ctrlmsg_handler(type, val, line, &exitcode->ctrlmsg);
+            if (ret > 0) {
+                exitcode->bye = 1;
                 break;
+            }
         }
     }
 
 wayout:
-    if (exitcode.waitpid < 0) {
+    if (exitcode->waitpid < 0) {
         ret = waitpid_for_a_while(child_pid);
         if (ret >= 0)
-            exitcode.waitpid = ret;
+            exitcode->waitpid = ret;
+    }
+    drop_pending_fds();
+
+    close_beatpage();
+    close_liveness();
+    close_named_beats();
+
+    /* what the monitoring-target has written last, if it has failed */
+    close_flight_recorder(exitcode->bye && exitcode->waitpid < 0);
+    if (exitcode->sigcause >= 0 || exitcode->waitpid > 0) {
+        char reason[64];
+        if (exitcode->sigcause == TIMEOUT_EXIT)
+            snprintf(reason, sizeof(reason), "PID=%d timed out", child_pid);
+        else if (exitcode->sigcause >= 0)
+            snprintf(reason, sizeof(reason), "PID=%d aborted", child_pid);
+        else
+            snprintf(reason, sizeof(reason), "PID=%d exited with status %d",
+                     child_pid, exitcode->waitpid);
+        dump_flight_recorder(reason);
     }
 
     /* close ctrl_rfd, but ctrl_wfd is still needed in onexit() */
@@ -91,30 +219,132 @@ wayout:
     }
 
     ret = NORMAL_EXIT;
-    ret = (exitcode.waitpid  < 0) ? ret : exitcode.waitpid;
-    ret = (exitcode.ctrlmsg  < 0) ? ret : exitcode.ctrlmsg;
-    ret = (exitcode.sigcause < 0) ? ret : exitcode.sigcause;
+    ret = (exitcode->waitpid  < 0) ? ret : exitcode->waitpid;
+    ret = (exitcode->ctrlmsg  < 0) ? ret : exitcode->ctrlmsg;
+    ret = (exitcode->sigcause < 0) ? ret : exitcode->sigcause;
+    return ret;
+}
 
-    if (exitcode.ctrlmsg >= 0 && exitcode.sigcause < 0) {
-        /* Do not send EXIT=N control message again. It has alread been sent. */
-        if (ctrl_wfd >= 0) {
-            close(ctrl_wfd);
-            ctrl_wfd = -1;
-        }
+/* With --restart, the monitoring-target is run again if it has gone on a
+   timeout, or with a non-zero exit status. Not on BYE, nor when the
+   watchdog itself has been told to terminate. */
+static int restartable(int ret, const struct exitcode *exitcode) {
+    if (restart_limit <= 0 || exitcode->bye)
+        return 0;
+    if (exitcode->sigcause == TIMEOUT_EXIT)
+        return 1;
+    return exitcode->sigcause < 0 && exitcode->waitpid >= 0 && ret != NORMAL_EXIT;
+}
+
+/* Forks a standby with --standby, if there is none. Its control channel
+   is kept aside, and not read until it is promoted. */
+static void start_standby() {
+    if (!restart_standby || standby_pid > 0)
+        return;
+
+    int active_rfd = ctrl_rfd;
+    ctrl_rfd = -1;
+    int pid = pipe_and_fork();
+
+    if (pid == 0) {
+        /* child side */
+        close(active_rfd);
+        exit(child_posttask(1));
     }
 
-    return ret;
+    /* parent side */
+    standby_pid = pid;
+    standby_rfd = ctrl_rfd;
+    ctrl_rfd = active_rfd;
+    fcntl(standby_rfd, F_SETFD, FD_CLOEXEC);
+    watch_standby(pid);
 }
 
-static int child_posttask() {
+/* Lets the standby past the barrier, and makes it the active one. Returns
+   its PID. */
+static int promote_standby() {
+    int pid = standby_pid;
+
+    ctrl_rfd = standby_rfd;
+    ctrl_rfd_fds = 1;
+    standby_rfd = -1;
+    standby_pid = 0;
+    watch_standby(0);
+
+    promoted = monotonic_ms();
+    if (write(ctrl_rfd, "PROMOTE\n", 8) != 8)
+        noticepf("PID=%d cannot be promoted (%s)", pid, strerror(errno));
+    return pid;
+}
+
+/* The standby is not left behind. */
+static void stop_standby() {
+    if (standby_pid <= 0)
+        return;
+
+    /* it may not be a process group leader yet */
+    if (kill(-standby_pid, SIGTERM) != 0)
+        kill(standby_pid, SIGTERM);
+    if (!wait_exit(standby_pid, SIGKILL_DELAY * 1000LL)) {
+        if (kill(-standby_pid, SIGKILL) != 0)
+            kill(standby_pid, SIGKILL);
+    }
+    waitpid(standby_pid, NULL, 0);
+    standby_pid = 0;
+    watch_standby(0);
+
+    close(standby_rfd);
+    standby_rfd = -1;
+}
+
+/* Notices the standby that has gone before being promoted. The active one
+   is then restarted after the backoff, and the next standby is started
+   along with it. */
+static void check_standby() {
+    int status = 0;
+
+    if (standby_pid <= 0)
+        return;
+    int ret = waitpid(standby_pid, &status, WNOHANG);
+    if (ret == 0)
+        return;
+
+    if (ret < 0)
+        noticepf("the standby PID=%d has gone (%s)", standby_pid, strerror(errno));
+    else if (WIFEXITED(status))
+        noticepf("the standby PID=%d returned exit status %d", standby_pid,
+                 WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        noticepf("the standby PID=%d got a signal %d", standby_pid, WTERMSIG(status));
+    standby_pid = 0;
+    watch_standby(0);
+
+    close(standby_rfd);
+    standby_rfd = -1;
+}
+
+/* Sleeps for the backoff. Returns the abort signal received meanwhile,
+   or 0. */
+static int wait_backoff(long long backoff) {
+    long long until = monotonic_ms() + backoff, left;
+
+    send_pending_ctrlmsg();
+    while ((left = until - monotonic_ms()) > 0) {
+        poll(NULL, 0, (int) left);
+
+        int signo = take_abort_signo();
+        if (signo)
+            return signo;
+    }
+    return 0;
+}
+
+static int child_posttask(int standby) {
     /* only watchdog can run run_onexit_script() */
     set_onexit_script(NULL);
 
-    /* only watchdog can write to ctrl_logfp */
-    if (ctrl_logfp != NULL) {
-        fclose(ctrl_logfp);
-        ctrl_logfp = NULL;
-    }
+    /* only watchdog can write to the control log */
+    close_ctrl_log();
 
     /* disable run_finalkiller() in onexit() */
     set_killpid(-1);
@@ -129,11 +359,33 @@ static int child_posttask() {
         ctrl_wfd = -1;
 
         /* Due to ctrl_wfd has closed just before, the following error
-           message is sent only to stderr and ctrl_logfp (if not NULL). */
+           message is sent only to stderr. */
         errorpf(errno, "setpgid()");
         exit(FATAL_EXIT);
     }
 
+    /* the monitoring-target is an ordinary process */
+    leave_realtime();
+
+    /* with --cgroup, catch also the descendants that call setsid() */
+    enter_cgroup();
+
+    /* with --flight-recorder, stdout and stderr go through the watchdog */
+    enter_flight_recorder();
+
+    /* with --restart, what the last one has deposited */
+    pass_stored_fds();
+
+    /* with --standby, see bw_standby() */
+    if (restart_standby) {
+        int ret = standby ? setenv("BEATWATCH_STANDBY", "1", 1)
+                          : unsetenv("BEATWATCH_STANDBY");
+        if (ret != 0) {
+            errorpf(errno, "setenv()");
+            exit(FATAL_EXIT);
+        }
+    }
+
     send_ctrlmsgf("KILLPID=%d", getpid());
 
     return execfunc();
@@ -145,8 +397,9 @@ static int parent_posttask(int child_pid) {
     set_killpid(child_pid);
 
     /* The ctrl_kfd must be kept until dup2() just before execvp(),
-       but is not needed from this point. So, close it here. */
-    if (ctrl_kfd >= 0) {
+       but is not needed from this point. So, close it here, unless
+       the next one may be run with --restart. */
+    if (ctrl_kfd >= 0 && restart_limit <= 0) {
         close(ctrl_kfd);
         ctrl_kfd = -1;
     }
@@ -178,7 +431,16 @@ static int parent_posttask(int child_pid) {
         exit(FATAL_EXIT);
     }
 
-    send_ctrlmsgf("%c %s", done, line);
+    send_ctrlack(done, line);
+
+    if (last_gone > 0 && verbose)
+        noticepf("PID=%d has been restarted %lld ms after the last one had gone, "
+                 "of which %lld ms was the backoff", pid, monotonic_ms() - last_gone,
+                 last_backoff);
+
+    init_liveness(pid);
+    init_starvation(pid);
+    init_adaptive();
 
     return pid;
 }
@@ -190,7 +452,8 @@ static int ctrlmsg_handler(char type, int val, const char *line, int *rexit) {
 
         case 'B':   /* BYE          */
             set_killpid(-1);
-            send_ctrlmsgf("%c %s", done, line);
+            keep_cgroup();
+            send_ctrlack(done, line);
             ret = 1;
             break;
 
@@ -198,6 +461,8 @@ static int ctrlmsg_handler(char type, int val, const char *line, int *rexit) {
             /* repeat the message to cmdline as it is, then close the fd */
             send_ctrlmsgf("%s", line);
             if (ctrl_wfd >= 0) {
+                flush_ctrlmsg();
+                flush_ctrl_log();
                 close(ctrl_wfd);
                 ctrl_wfd = -1;
             }
@@ -206,26 +471,63 @@ static int ctrlmsg_handler(char type, int val, const char *line, int *rexit) {
 
         case 'E':   /* EXIT=N       */
             *rexit = val;
-            send_ctrlmsgf("%c %s", done, line);
+            send_ctrlack(done, line);
             send_ctrlmsgf("EXIT=%d", val);
             ret = 0;
             break;
 
+        case 'F':   /* FDSTORE=N    */
+            /* nothing is stored, nor comes, without --restart */
+            if (restart_limit <= 0) {
+                forward_ctrlmsg(line);
+            } else if (restart_standby) {
+                /* a standby forked earlier would take over a stale store */
+                drop_pending_fds();
+                noticepf("FDSTORE=%d is not taken with --standby", val);
+            } else {
+                store_fds(val);
+                send_ctrlack(done, line);
+            }
+            ret = 0;
+            break;
+
+        case 'P':   /* PROMOTED     */
+            if (promoted > 0 && verbose)
+                noticepf("the standby has taken over %lld ms after the last one had gone, "
+                         "%lld ms after PROMOTE", monotonic_ms() - last_gone,
+                         monotonic_ms() - promoted);
+            promoted = 0;
+            send_ctrlack(done, line);
+            ret = 0;
+            break;
+
+        case 'R':   /* READY        */
+            send_ctrlack(done, line);
+            ret = 0;
+            break;
+
         case 'K':   /* KILLPID=N    */
             set_killpid(val);
-            send_ctrlmsgf("%c %s", done, line);
+            send_ctrlack(done, line);
             ret = 0;
             break;
 
         case 'T':   /* TIMEOUT=N    */
-            set_timeout(val);
-            send_ctrlmsgf("%c %s", done, line);
-            send_ctrlmsgf("TIMEOUT=%d", val + EXTRA_TIMEOUT);
+        case 't':   /* TIMEOUT_MS=N */
+            relay_timeout(type, val, line);
             ret = 0;
             break;
 
         default:
-            send_ctrlmsgf("%s", line);
+            /* BEAT <NAME> ..., see namedbeat.c, neither done nor forwarded,
+               as there may be many */
+            if (named_beat(line) == 0) {
+                update_deadline_timer();
+                ret = 0;
+                break;
+            }
+            /* may be dropped if the upstream is slow */
+            forward_ctrlmsg(line);
             ret = 0;
             break;
     }
@@ -233,22 +535,42 @@ static int ctrlmsg_handler(char type, int val, const char *line, int *rexit) {
     return ret;
 }
 
+/* Sets the timeout, and sends it upstream with EXTRA_TIMEOUT added. With
+   --adaptive, the one learned from the heartbeat cadence is used instead,
+   and sent always in millisecond. */
+static void relay_timeout(char type, int val, const char *line) {
+    long long requested = (type == 'T') ? val * 1000LL : val;
+    long long timeout = adapt_timeout(monotonic_ms(), requested);
+
+    if (timeout != requested) {
+        set_timeout_ms(timeout);
+        send_ctrlack(done, line);
+        send_ctrlmsgf("TIMEOUT_MS=%lld", timeout + EXTRA_TIMEOUT * 1000LL);
+    } else if (type == 'T') {
+        set_timeout(val);
+        send_ctrlack(done, line);
+        send_ctrlmsgf("TIMEOUT=%d", val + EXTRA_TIMEOUT);
+    } else {
+        set_timeout_ms(val);
+        send_ctrlack(done, line);
+        send_ctrlmsgf("TIMEOUT_MS=%d", val + EXTRA_TIMEOUT * 1000);
+    }
+}
+
 static int waitpid_for_a_while(int child) {
-    int interval = 100; /* millisecond  */
-    int count = HOLDON_DELAY * (1000 / interval);
+    long long until = monotonic_ms() + HOLDON_DELAY * 1000LL, left;
 
     while (1) {
-
-        errorpf(-1, 0, "XXX TODO last %d ms", count * interval); // XXX TODO 動作確認が終わったら削除すること
-
         int ret = waitpid_nohang(child);
         if (ret >= 0)
             return ret;
 
-        if (--count <= 0)
+        left = until - monotonic_ms();
+        if (left <= 0)
             break;
 
-        usleep(interval * 1000);
+        /* returns as soon as the child exits */
+        wait_exit(child, left);
     }
     return -1;
 }
@@ -264,6 +586,7 @@ static int waitpid_nohang(int child) {
         /* child have not yet changed state */
     }
     else if (ret > 0) {
+        report_kill_latency(child);
         if (WIFEXITED(status)) {
             ret = WEXITSTATUS(status);
             noticepf("monitoring-target returned exit status %d", ret);
@@ -0,0 +1,351 @@
+/* Throughput benchmark of iorelay(), emitted as CSV.
+
+   usage: bench [-H] [-r] [-s MiB]
+        -H      print the CSV header line first
+        -r      also run the reference implementations, cat(1) and tee(1)
+        -s MiB  amount of data relayed by each case (default 256)
+
+   IOBUFSIZE is a compile time constant, so the Makefile builds one binary
+   per buffer size and runs them in turn. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iorelay.h"
+
+#ifndef IOBUFSIZE
+#define IOBUFSIZE	(1 * 4096)
+#endif
+
+#define MAXSINKS	8
+#define CHUNK		(64 * 1024)
+#define SLOWDELAY	1000	/* in microsecond; per read() of a slow sink */
+#define SLOWLIMIT	(16LL * 1024 * 1024)
+
+enum { PIPE, FILE_, SOCKET };
+enum { IORELAY, REFERENCE };
+
+static long long nbytes = 256LL * 1024 * 1024;
+static char srcfile[] = "/tmp/iorelay-bench-XXXXXX";
+
+/* fds opened by run(); a child closes all of them but its own, so that
+   no sink is kept from seeing its EOF */
+static int openfds[2 * MAXSINKS + 2];
+static int nopenfds = 0;
+
+static void closeexcept(int keep)
+{
+    int i;
+
+    for (i = 0; i < nopenfds; i++)
+        if (openfds[i] != keep)
+            close(openfds[i]);
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+    unlink(srcfile);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes nbytes to the fd from a child process. */
+static pid_t producer(int fd)
+{
+    static char buf[CHUNK];
+    long long rest = nbytes;
+    pid_t pid;
+    int n;
+
+    pid = fork();
+    if (pid < 0)
+        die("fork()");
+    if (pid > 0)
+        return pid;
+
+    closeexcept(fd);
+    memset(buf, 'x', sizeof(buf));
+    while (rest > 0) {
+        n = write(fd, buf, rest < CHUNK ? rest : CHUNK);
+        if (n <= 0)
+            _exit(1);
+        rest -= n;
+    }
+    _exit(0);
+}
+
+/* Reads the fd until EOF from a child process, which exits with 0 if
+   exactly nbytes have been read. */
+static pid_t consumer(int fd, int slow)
+{
+    static char buf[CHUNK];
+    long long total = 0;
+    pid_t pid;
+    int n;
+
+    pid = fork();
+    if (pid < 0)
+        die("fork()");
+    if (pid > 0)
+        return pid;
+
+    closeexcept(fd);
+
+    while ((n = read(fd, buf, slow ? 4096 : sizeof(buf))) > 0) {
+        total += n;
+        if (slow)
+            usleep(SLOWDELAY);
+    }
+    _exit(total == nbytes ? 0 : 1);
+}
+
+/* Returns a connected pair of loopback TCP sockets: sv[0] for writing,
+   sv[1] for reading. */
+static void tcppair(int sv[2])
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int ls;
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls < 0)
+        die("socket()");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(ls, (struct sockaddr *) &sin, sizeof(sin)) != 0)
+        die("bind()");
+    if (listen(ls, 1) != 0)
+        die("listen()");
+    if (getsockname(ls, (struct sockaddr *) &sin, &len) != 0)
+        die("getsockname()");
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (sv[0] < 0)
+        die("socket()");
+    if (connect(sv[0], (struct sockaddr *) &sin, sizeof(sin)) != 0)
+        die("connect()");
+    sv[1] = accept(ls, NULL, NULL);
+    if (sv[1] < 0)
+        die("accept()");
+    close(ls);
+}
+
+/* Runs cat(1) for one sink, or tee(1) for more, as the relay. */
+static pid_t reference(int rfd, int nsinks, int wfd[])
+{
+    char *argv[MAXSINKS + 2], path[MAXSINKS][32];
+    int high[MAXSINKS + 1];
+    pid_t pid;
+    int i;
+
+    pid = fork();
+    if (pid < 0)
+        die("fork()");
+    if (pid > 0)
+        return pid;
+
+    /* move them out of the way first, then dup2() into place */
+    high[0] = fcntl(rfd, F_DUPFD, 100);
+    for (i = 0; i < nsinks; i++)
+        high[i + 1] = fcntl(wfd[i], F_DUPFD, 100);
+    closeexcept(-1);
+
+    dup2(high[0], 0);
+    dup2(high[1], 1);
+    argv[0] = (nsinks == 1) ? "cat" : "tee";
+    for (i = 1; i < nsinks; i++) {
+        dup2(high[i + 1], 2 + i);
+        snprintf(path[i], sizeof(path[i]), "/dev/fd/%d", 2 + i);
+        argv[i] = path[i];
+    }
+    argv[nsinks] = NULL;
+    for (i = 0; i <= nsinks; i++)
+        close(high[i]);
+
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+static void run(const char *name, int impl, int src, int sink, int nsinks, int slow)
+{
+    int rfd, srcpipe[2], sv[MAXSINKS][2], wfd[MAXSINKS];
+    pid_t pids[MAXSINKS + 2];
+    int i, status, npids = 0, failed = 0, err;
+    unsigned long nsys = 0;
+    long long saved = nbytes;
+    double t0, t1, mib;
+    char bufsize[16] = "", syscalls[32] = "";
+
+    if (slow && nbytes > SLOWLIMIT)
+        nbytes = SLOWLIMIT;	/* keep the slow case short */
+
+    if (src == PIPE) {
+        if (pipe(srcpipe) != 0)
+            die("pipe()");
+        rfd = srcpipe[0];
+        openfds[nopenfds++] = srcpipe[1];
+    } else {
+        rfd = open(srcfile, O_RDONLY);
+        if (rfd < 0)
+            die("open()");
+    }
+
+    for (i = 0; i < nsinks; i++) {
+        if (sink == SOCKET)
+            tcppair(sv[i]);
+        else if (pipe(sv[i]) != 0)
+            die("pipe()");
+        else {
+            int tmp = sv[i][0];	/* sv[i][0] for writing */
+            sv[i][0] = sv[i][1];
+            sv[i][1] = tmp;
+        }
+        wfd[i] = sv[i][0];
+        openfds[nopenfds++] = sv[i][0];
+        openfds[nopenfds++] = sv[i][1];
+    }
+    openfds[nopenfds++] = rfd;
+
+    t0 = now();
+
+    for (i = 0; i < nsinks; i++) {
+        pids[npids++] = consumer(sv[i][1], slow && i == 0);
+        close(sv[i][1]);
+    }
+    if (src == PIPE) {
+        producer(srcpipe[1]);	/* reaped with wait() below */
+        close(srcpipe[1]);
+    }
+
+#ifdef IORELAY_STATS
+    __atomic_store_n(&iorelay_nsyscalls, 0, __ATOMIC_RELAXED);
+#endif
+    if (impl == IORELAY) {
+        err = niorelay(rfd, nsinks, wfd);	/* closes all of them */
+        if (err != 0) {
+            errno = err;
+            die("niorelay()");
+        }
+    } else {
+        pids[npids++] = reference(rfd, nsinks, wfd);
+        close(rfd);
+        for (i = 0; i < nsinks; i++)
+            close(wfd[i]);
+    }
+
+    /* the sinks finish last */
+    for (i = 0; i < npids; i++) {
+        if (waitpid(pids[i], &status, 0) < 0)
+            die("waitpid()");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    t1 = now();
+    while (wait(&status) > 0)
+        ;	/* the producer */
+    nopenfds = 0;
+
+#ifdef IORELAY_STATS
+    nsys = __atomic_load_n(&iorelay_nsyscalls, __ATOMIC_RELAXED);
+#endif
+    mib = nbytes / (1024.0 * 1024.0);
+
+    /* the same columns for all rows, left empty where not known */
+    if (impl == IORELAY) {
+        snprintf(bufsize, sizeof(bufsize), "%d", IOBUFSIZE);
+        snprintf(syscalls, sizeof(syscalls), "%.1f", nsys / mib);
+    }
+    printf("%s,%s,%s,%d,%lld,%.6f,%.3f,%s,%s\n", name,
+           impl == IORELAY ? "iorelay" : nsinks == 1 ? "cat" : "tee",
+           bufsize, nsinks, nbytes, t1 - t0, nbytes / (t1 - t0) / 1e9,
+           syscalls, failed ? "FAILED" : "ok");
+    fflush(stdout);
+
+    nbytes = saved;
+}
+
+static void makesrcfile(void)
+{
+    static char buf[CHUNK];
+    long long rest = nbytes;
+    int fd, n;
+
+    fd = mkstemp(srcfile);
+    if (fd < 0)
+        die("mkstemp()");
+    memset(buf, 'x', sizeof(buf));
+    while (rest > 0) {
+        n = write(fd, buf, rest < CHUNK ? rest : CHUNK);
+        if (n <= 0)
+            die("write()");
+        rest -= n;
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, header = 0, ref = 0, impl, n;
+
+    while ((opt = getopt(argc, argv, "Hrs:")) != -1) {
+        switch (opt) {
+        case 'H':
+            header = 1;
+            break;
+        case 'r':
+            ref = 1;
+            break;
+        case 's':
+            nbytes = atoll(optarg) * 1024 * 1024;
+            if (nbytes <= 0) {
+                fprintf(stderr, "bench: invalid size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-H] [-r] [-s MiB]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    makesrcfile();
+
+    if (header)
+        printf("case,impl,bufsize,nsinks,bytes,seconds,GB/s,syscalls/MiB,status\n");
+
+    for (impl = IORELAY; impl <= (ref ? REFERENCE : IORELAY); impl++) {
+        for (n = 1; n <= MAXSINKS; n++)
+            run("pipe-to-pipes", impl, PIPE, PIPE, n, 0);
+        run("file-to-socket", impl, FILE_, SOCKET, 1, 0);
+        run("slow-sink", impl, PIPE, PIPE, 2, 1);
+    }
+
+    unlink(srcfile);
+    return 0;
+}
+
+/* vim: set et sw=4 sts=4: */
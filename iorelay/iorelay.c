@@ -1,24 +1,121 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* for splice() */
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/param.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 #include <pthread.h>
 
+#ifdef IORELAY_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#endif
+
 #include "iorelay.h"
 
 #ifndef IOBUFSIZE
 #define IOBUFSIZE	(1 * 4096)	/* 4 KiB */
 #endif
 
+#ifndef ZCBUFSIZE
+#define ZCBUFSIZE	(16 * 4096)	/* 64 KiB; used instead of IOBUFSIZE
+					   when any writer sends zero-copy */
+#endif
+
+#ifndef ZEROCOPY_THRESHOLD
+#define ZEROCOPY_THRESHOLD	(16 * 1024)	/* smaller writes are copied */
+#endif
+
+#ifndef FLUSH_IDLE
+#define FLUSH_IDLE	100	/* in millisecond; compressed output is flushed
+				   when no input arrives for this period */
+#endif
+
 #define NWFDS		8
+#define NBUFS		8	/* buffers pinned by zero-copy sends or
+				   queued for compressors */
+#define ZOUTSIZE	(16 * 4096)	/* compressor output buffer */
+#define BIDICHUNK	(16 * 4096)	/* max bytes moved by one splice() */
+
+#ifndef POOLMAX
+#define POOLMAX		64	/* idle contexts, buffers (per size) and
+				   threads kept for the next relays */
+#endif
+#define SLABSIZE	(2 * 1024 * 1024)	/* hugepage backed buffers */
+#ifndef MAXSLABS
+#define MAXSLABS	8	/* hugepage slabs mapped at most */
+#endif
+#define BIDIEVENTS	256
+#define ZCQLEN		256	/* outstanding zero-copy sends per writer */
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+#ifdef IORELAY_STATS
+unsigned long iorelay_nsyscalls = 0;
+#define COUNT_SYSCALL()	__atomic_add_fetch(&iorelay_nsyscalls, 1, __ATOMIC_RELAXED)
+#else
+#define COUNT_SYSCALL()	do { } while (0)
+#endif
 
 static int quit = 0;	/* not implemented */
-static void *mainloop(void *arg);
 static void selectwait(int rfd, int wfd, int efd);
 
+struct iobuf {
+    char *ptr;
+    int zrefs;	/* number of zero-copy sends not yet completed */
+    int crefs;	/* number of compressors not yet done with; io->lock */
+};
+
+struct zc {
+    int on;
+    unsigned int head;	/* id of the oldest uncompleted send */
+    unsigned int next;	/* id the kernel assigns to the next send */
+    int bufidx[ZCQLEN];	/* buffer used by the send, indexed by id */
+};
+
+/* compressing writer; runs in its own thread so that the reader
+   never waits on the compressor unless all buffers are queued. */
+struct cw {
+    struct io *io;
+    pthread_t th;
+    pthread_cond_t cond;	/* signaled when queued or eof; io->lock */
+    int fd;
+    int eof;
+    int dead;			/* the writer has got EPIPE */
+    int head, tail;		/* queue of chunks; io->lock */
+    struct {
+        int bufidx;
+        int size;
+    } q[NBUFS];
+#ifdef IORELAY_ZLIB
+    z_stream zs;
+#endif
+    char out[ZOUTSIZE];
+};
+
 struct io {
     struct {
         int fd;
@@ -28,13 +125,97 @@ struct io {
         int nfds;
         int fd[NWFDS];
         int can_close[NWFDS];
+        int ncw;		/* number of compressors */
+        struct zc zc[NWFDS];
+        struct cw *cw[NWFDS];
     } w;
     struct {
         char *ptr;
         int size;
+        int cur;	/* index of ptr in bufs[] */
+        int nbufs;
+        struct iobuf bufs[NBUFS];
     } buf;
+    struct {
+        int on;
+        int recsep;		/* -1 unless per record sums are reported */
+        unsigned int crc;	/* whole stream */
+        unsigned int rcrc;	/* current record */
+        unsigned long long length;
+        unsigned long long roffset;
+        long long index;
+        void (*func)(const struct iorelay_sum *sum, void *arg);
+        void *arg;
+    } sum;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;	/* signaled when crefs of a buffer drops */
+    struct io *next;		/* pool.jobs or pool.ios */
 };
 
+/* Contexts, buffers and threads are recycled across relays, so that
+   starting a short-lived relay costs neither malloc() nor clone(). */
+struct freebuf {
+    struct freebuf *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;	/* signaled when a job is queued */
+    struct io *jobs, **jobtail;
+    int njobs;
+    int nidle;			/* threads waiting for a job */
+    struct io *ios;		/* free contexts */
+    int nios;
+    struct io *deferred;	/* waiting for zero-copy completions */
+    struct {
+        int size;
+        int count;
+        struct freebuf *head;
+    } bufs[2];			/* free buffers of IOBUFSIZE and ZCBUFSIZE */
+    char *slab;			/* rest of the current hugepage slab */
+    size_t slabrest;
+    char *slabs[MAXSLABS];	/* all the slabs, never unmapped */
+    int nslabs;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, &pool.jobs, 0, 0, NULL, 0, NULL,
+    { { IOBUFSIZE, 0, NULL }, { ZCBUFSIZE, 0, NULL } },
+    NULL, 0, { NULL, }, 0
+};
+
+static void mainloop(struct io *io);
+static struct io *ioalloc(void);
+static void iofree(struct io *io);
+static void iodone(struct io *io);
+static char *bufalloc(int size);
+static void buffree(char *ptr, int size);
+static int inslab(const char *ptr);
+static int iostart(struct io *io);
+static void *poolworker(void *arg);
+
+static int zcsetup(int fd);
+static int zcsend(struct io *io, int i, const char *ptr, int size);
+static int zcreap(struct io *io, int i);
+static void zcdrop(struct io *io, int i);
+static int zcwait(struct io *io, int timeout);
+static int zcpending(struct io *io);
+static void zcdefer(struct io *io);
+static void zcretry(struct io *list);
+static void nextbuf(struct io *io);
+static void freebufs(struct io *io);
+static int busybuf(struct io *io, int b);
+static int cwstart(struct io *io, int i);
+static int cwqueue(struct io *io, int i, int size);
+static void cwstop(struct io *io);
+static void cwabort(struct io *io);
+#ifdef IORELAY_ZLIB
+static void *deflateloop(void *arg);
+#endif
+static void sumchunk(struct io *io, const char *ptr, int size);
+static void sumreport(struct io *io, long long index, unsigned long long offset,
+                      unsigned long long length, unsigned int crc);
+static unsigned int crc32c(unsigned int crc, const char *ptr, size_t size);
+
 int _vniorelay(int rfd, int nwfds, ...)
 {
     va_list ap;
@@ -55,18 +236,20 @@ int _vniorelay(int rfd, int nwfds, ...)
 
 int niorelay(int rfd, int nwfds, int wfd[])
 {
-    int i, err;
+    return niorelayx(rfd, nwfds, wfd, NULL);
+}
+
+int niorelayx(int rfd, int nwfds, int wfd[], const struct iorelay_opts *opts)
+{
+    int i, err, zc = 0;
     struct io *io;
-    pthread_t th;
-    pthread_attr_t attr;
 
     if (nwfds < 1 || nwfds > NWFDS)
         return EINVAL;
 
-    io = malloc(sizeof(struct io));
+    io = ioalloc();
     if (io == NULL)
         return ENOMEM;
-    memset(io, 0, sizeof(struct io));
 
     if (rfd < 0) {
         io->r.fd = ~rfd;
@@ -78,6 +261,11 @@ int niorelay(int rfd, int nwfds, int wfd[])
 
     io->w.nfds = nwfds;
     for (i = 0; i < nwfds; i++) {
+        /* only the writers in use are initialized, see ioalloc() */
+        io->w.cw[i] = NULL;
+        io->w.zc[i].on = 0;
+        io->w.zc[i].head = io->w.zc[i].next = 0;
+
         if (wfd[i] < 0) {
             io->w.fd[i] = ~wfd[i];
             io->w.can_close[i] = 0;
@@ -85,39 +273,71 @@ int niorelay(int rfd, int nwfds, int wfd[])
             io->w.fd[i] = wfd[i];
             io->w.can_close[i] = 1;
         }
+
+        if (opts && opts->wflags && (opts->wflags[i] & IORELAY_ZEROCOPY)) {
+            /* silently falls back to write() on anything other than
+               a stream socket that accepts SO_ZEROCOPY */
+            io->w.zc[i].on = zcsetup(io->w.fd[i]);
+            zc |= io->w.zc[i].on;
+        }
     }
 
-    io->buf.ptr = malloc(IOBUFSIZE);
+    io->buf.size = zc ? ZCBUFSIZE : IOBUFSIZE;
+    io->buf.ptr = bufalloc(io->buf.size);
     if (io->buf.ptr == NULL) {
-        free(io);
+        iofree(io);
         return ENOMEM;
     }
-    io->buf.size = IOBUFSIZE;
-    memset(io->buf.ptr, 0, IOBUFSIZE);
+    io->buf.bufs[0].ptr = io->buf.ptr;
+    io->buf.bufs[0].zrefs = 0;
+    io->buf.bufs[0].crefs = 0;
+    io->buf.nbufs = 1;
 
-    err = pthread_attr_init(&attr);
-    if (err != 0)
-        return err;
+    for (i = 0; i < nwfds; i++) {
+        if (opts && opts->wflags && (opts->wflags[i] & IORELAY_DEFLATE)) {
+            err = cwstart(io, i);
+            if (err != 0) {
+                cwabort(io);
+                freebufs(io);
+                iofree(io);
+                return err;
+            }
+        }
+    }
 
-    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (err != 0)
-        return err;
+    io->sum.recsep = -1;
+    if (opts && (opts->flags & IORELAY_CRC32C)) {
+        io->sum.on = 1;
+        if (opts->flags & IORELAY_RECORDSUM)
+            io->sum.recsep = (unsigned char) opts->recsep;
+        io->sum.func = opts->sumfunc;
+        io->sum.arg = opts->sumarg;
+    }
 
-    err = pthread_create(&th, &attr, mainloop, (void *) io);
-    if (err != 0)
+    err = iostart(io);
+    if (err != 0) {
+        cwabort(io);
+        freebufs(io);
+        iofree(io);
         return err;
+    }
 
     return 0;
 }
 
-static void *mainloop(void *arg)
+static void mainloop(struct io *io)
 {
-    struct io *io = (struct io *) arg;
     int i, n, rsize, wsize, nwactive = io->w.nfds;;
     char *ptr;
 
     while (1) {
+        if (busybuf(io, io->buf.cur)) {
+            /* the kernel or a compressor still reads the last buffer */
+            nextbuf(io);
+        }
+
         do {
+            COUNT_SYSCALL();
             n = read(io->r.fd, io->buf.ptr, io->buf.size);
             if (n < 0) {
                 if (errno == EINTR) {
@@ -145,14 +365,34 @@ static void *mainloop(void *arg)
         } while (n <= 0);
         rsize = n;
 
+        if (io->sum.on)
+            sumchunk(io, io->buf.ptr, rsize);
+
         for (i = 0; i < io->w.nfds; i++) {
             if (io->w.fd[i] < 0)
                  continue;
 
+            if (io->w.cw[i]) {
+                if (cwqueue(io, i, rsize) == 0)
+                    continue;
+
+                /* the compressor has got EPIPE; it may still be using
+                   the fd, which is closed by cwstop() after the join */
+                io->w.fd[i] = -1;
+
+                if (--nwactive <= 0)
+                    goto done;
+                continue;
+            }
+
             ptr = io->buf.ptr;
             wsize = rsize;
             do {
-                n = write(io->w.fd[i], ptr, wsize);
+                COUNT_SYSCALL();
+                if (io->w.zc[i].on && wsize >= ZEROCOPY_THRESHOLD)
+                    n = zcsend(io, i, ptr, wsize);
+                else
+                    n = write(io->w.fd[i], ptr, wsize);
                 if (n < 0) {
                     if (errno == EINTR) {
                         if (quit)
@@ -163,6 +403,7 @@ static void *mainloop(void *arg)
                     else if (errno == EPIPE) {
                         /* reading end has closed */
 
+                        zcdrop(io, i);
                         if (io->w.can_close[i])
                             close(io->w.fd[i]);
                         io->w.fd[i] = -1;
@@ -196,18 +437,1186 @@ static void *mainloop(void *arg)
 quit:	/* not implemented */
 
 done:
+    if (io->sum.on) {
+        if (io->sum.recsep >= 0 && io->sum.length > io->sum.roffset) {
+            /* last record without a trailing separator */
+            sumreport(io, io->sum.index, io->sum.roffset,
+                      io->sum.length - io->sum.roffset, io->sum.rcrc);
+        }
+        sumreport(io, -1, 0, io->sum.length, io->sum.crc);
+    }
+
     if (io->r.can_close)
          close(io->r.fd);
 
+    /* let compressors finish their streams */
+    cwstop(io);
+
+    /* buffers must not be reused until the kernel has released them */
+    while (zcwait(io, 1000) > 0)
+        ;
+    if (zcpending(io) > 0) {
+        /* nor after a second; the next ioalloc() will see */
+        zcdefer(io);
+        return;
+    }
+
+    iodone(io);
+}
+
+/* Closes the writers and returns the context and the buffers to the pool. */
+static void iodone(struct io *io)
+{
+    int i;
+
     for (i = 0; i < io->w.nfds; i++)
         if (io->w.can_close[i] && io->w.fd[i] >= 0)
              close(io->w.fd[i]);
 
-    free(io->buf.ptr);
+    freebufs(io);
+    iofree(io);
+}
+
+/* Runs the relay on an idle pooled thread, or on a new one. */
+static int iostart(struct io *io)
+{
+    pthread_attr_t attr;
+    pthread_t th;
+    int err, spawn;
+
+    pthread_mutex_lock(&pool.lock);
+    io->next = NULL;
+    *pool.jobtail = io;
+    pool.jobtail = &io->next;
+    pool.njobs++;
+    spawn = (pool.njobs > pool.nidle);
+    if (!spawn)
+        pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!spawn)
+        return 0;
+
+    err = pthread_attr_init(&attr);
+    if (err == 0)
+        err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (err == 0)
+        err = pthread_create(&th, &attr, poolworker, NULL);
+    if (err == 0)
+        return 0;
+
+    /* take the job back, unless an idle thread has already picked it */
+    pthread_mutex_lock(&pool.lock);
+    for (struct io **pp = &pool.jobs; *pp; pp = &(*pp)->next) {
+        if (*pp == io) {
+            *pp = io->next;
+            if (pool.jobtail == &io->next)
+                pool.jobtail = pp;
+            pool.njobs--;
+            pthread_mutex_unlock(&pool.lock);
+            return err;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+static void *poolworker(void *arg)
+{
+    struct io *io;
+
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.jobs == NULL) {
+            if (pool.nidle >= POOLMAX)
+                goto exit;	/* enough threads are waiting */
+            pool.nidle++;
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            pool.nidle--;
+        }
+        io = pool.jobs;
+        pool.jobs = io->next;
+        if (pool.jobs == NULL)
+            pool.jobtail = &pool.jobs;
+        pool.njobs--;
+        pthread_mutex_unlock(&pool.lock);
+
+        mainloop(io);
+
+        pthread_mutex_lock(&pool.lock);
+    }
+exit:
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static struct io *ioalloc(void)
+{
+    struct io *io, *deferred;
+
+    pthread_mutex_lock(&pool.lock);
+    deferred = pool.deferred;
+    pool.deferred = NULL;
+    io = pool.ios;
+    if (io) {
+        pool.ios = io->next;
+        pool.nios--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (deferred)
+        zcretry(deferred);
+
+    if (io == NULL) {
+        io = malloc(sizeof(struct io));
+        if (io == NULL)
+            return NULL;
+    }
+    /* The per writer and per buffer arrays, zc[].bufidx[] above all, make
+       up most of the context. They are initialized by niorelayx() and
+       nextbuf() as they come into use, so only the rest is cleared. */
+    memset(&io->r, 0, sizeof(io->r));
+    io->w.nfds = 0;
+    io->w.ncw = 0;
+    io->buf.ptr = NULL;
+    io->buf.size = 0;
+    io->buf.cur = 0;
+    io->buf.nbufs = 0;
+    memset(&io->sum, 0, sizeof(io->sum));
+    io->next = NULL;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->freed, NULL);
+    return io;
+}
+
+static void iofree(struct io *io)
+{
+    pthread_cond_destroy(&io->freed);
+    pthread_mutex_destroy(&io->lock);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nios < POOLMAX) {
+        io->next = pool.ios;
+        pool.ios = io;
+        pool.nios++;
+        io = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
     free(io);
+}
+
+/* Returns a page aligned buffer. With -DIORELAY_HUGEPAGES, buffers are
+   carved out of 2 MiB hugepage slabs (MAP_HUGETLB) where available. */
+static char *bufalloc(int size)
+{
+    struct freebuf *fb = NULL;
+    char *ptr = NULL;
+    void *mem;
+    int c;
+
+    for (c = 0; c < 2; c++)
+        if (pool.bufs[c].size == size)
+            break;
+
+    pthread_mutex_lock(&pool.lock);
+    if (c < 2 && pool.bufs[c].head) {
+        fb = pool.bufs[c].head;
+        pool.bufs[c].head = fb->next;
+        pool.bufs[c].count--;
+    }
+#if defined(IORELAY_HUGEPAGES) && defined(MAP_HUGETLB)
+    else if (c < 2) {
+        if (pool.slabrest < (size_t) size && pool.nslabs < MAXSLABS) {
+            mem = mmap(NULL, SLABSIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED) {
+                /* the rest of the old slab is lost; it is small */
+                pool.slab = mem;
+                pool.slabrest = SLABSIZE;
+                pool.slabs[pool.nslabs++] = mem;
+            }
+        }
+        if (pool.slabrest >= (size_t) size) {
+            ptr = pool.slab;
+            pool.slab += size;
+            pool.slabrest -= size;
+        }
+    }
+#endif
+    pthread_mutex_unlock(&pool.lock);
+
+    if (fb)
+        return (char *) fb;
+    if (ptr)
+        return ptr;
+
+    if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), size) != 0)
+        return NULL;
+    return mem;
+}
+
+static void buffree(char *ptr, int size)
+{
+    struct freebuf *fb = (struct freebuf *) ptr;
+    int c;
+
+    for (c = 0; c < 2; c++)
+        if (pool.bufs[c].size == size)
+            break;
+
+    pthread_mutex_lock(&pool.lock);
+    /* A part of a slab can not be free()d, and is always kept. There are
+       no more of them than MAXSLABS can hold, so the pool is still capped. */
+    if (c < 2 && (pool.bufs[c].count < POOLMAX || inslab(ptr))) {
+        fb->next = pool.bufs[c].head;
+        pool.bufs[c].head = fb;
+        pool.bufs[c].count++;
+        fb = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    free(fb);
+}
+
+/* Returns 1 if the buffer has been carved out of a slab; pool.lock */
+static int inslab(const char *ptr)
+{
+    int i;
+
+    for (i = 0; i < pool.nslabs; i++)
+        if (ptr >= pool.slabs[i] && ptr < pool.slabs[i] + SLABSIZE)
+            return 1;
+    return 0;
+}
+
+/* Returns 1 if zero-copy transmission has been enabled on the fd. */
+static int zcsetup(int fd)
+{
+#ifdef HAVE_ZEROCOPY
+    int one = 1, type = 0;
+    socklen_t len = sizeof(type);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+        return 0;
+    if (type != SOCK_STREAM)
+        return 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+        return 0;
+    return 1;
+#else
+    (void) fd;
+    return 0;
+#endif
+}
+
+/* Same as write(), but pins the current buffer until the kernel reports
+   the completion of the send on the error queue of the socket. */
+static int zcsend(struct io *io, int i, const char *ptr, int size)
+{
+#ifdef HAVE_ZEROCOPY
+    struct zc *zc = &io->w.zc[i];
+    int n;
+
+    while (zc->next - zc->head >= ZCQLEN) {
+        /* too many sends in flight, let the kernel catch up */
+        if (zcreap(io, i) == 0)
+            zcwait(io, 1000);
+        if (io->w.fd[i] < 0 || !zc->on)
+            return write(io->w.fd[i], ptr, size);
+    }
+
+    n = send(io->w.fd[i], ptr, size, MSG_ZEROCOPY);
+    if (n < 0 && errno == ENOBUFS) {
+        /* exceeded optmem_max with pinned pages, take the copy path */
+        zcreap(io, i);
+        return write(io->w.fd[i], ptr, size);
+    }
+    if (n >= 0) {
+        zc->bufidx[zc->next % ZCQLEN] = io->buf.cur;
+        zc->next++;
+        io->buf.bufs[io->buf.cur].zrefs++;
+    }
+    return n;
+#else
+    return write(io->w.fd[i], ptr, size);
+#endif
+}
+
+/* Collects completion notifications of the writer i without blocking.
+   Returns the number of sends completed. */
+static int zcreap(struct io *io, int i)
+{
+#ifdef HAVE_ZEROCOPY
+    struct zc *zc = &io->w.zc[i];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    char control[128];
+    unsigned int id, lo, hi;
+    int n, count = 0;
+
+    while (zc->head != zc->next && io->w.fd[i] >= 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(io->w.fd[i], &msg, MSG_ERRQUEUE);
+        if (n < 0)
+            break;	/* EAGAIN: nothing has completed yet */
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* the kernel copied the data anyway (e.g. loopback), so
+               pinning pages only adds notification overhead */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->on = 0;
+
+            lo = serr->ee_info;
+            hi = serr->ee_data;
+            for (id = lo; id - lo <= hi - lo; id++) {
+                if (id - zc->head >= zc->next - zc->head ||
+                    zc->bufidx[id % ZCQLEN] < 0)
+                    continue;	/* not ours, or reported twice */
+                io->buf.bufs[zc->bufidx[id % ZCQLEN]].zrefs--;
+                zc->bufidx[id % ZCQLEN] = -1;
+                count++;
+            }
+            while (zc->head != zc->next && zc->bufidx[zc->head % ZCQLEN] < 0)
+                zc->head++;
+        }
+    }
+    return count;
+#else
+    (void) io;
+    (void) i;
+    return 0;
+#endif
+}
+
+/* The peer of the writer i is gone; nobody will see the data anymore. */
+static void zcdrop(struct io *io, int i)
+{
+    struct zc *zc = &io->w.zc[i];
+
+    for (; zc->head != zc->next; zc->head++) {
+        int b = zc->bufidx[zc->head % ZCQLEN];
+        if (b >= 0)
+            io->buf.bufs[b].zrefs--;
+    }
+    zc->on = 0;
+}
+
+/* Waits for completion notifications of all zero-copy writers. Returns
+   the number of sends still in flight, or 0 if no progress was made. */
+static int zcwait(struct io *io, int timeout)
+{
+    struct pollfd fds[NWFDS];
+    int i, nfds = 0, done = 0, pending = 0;
+
+    for (i = 0; i < io->w.nfds; i++) {
+        if (io->w.fd[i] < 0 || io->w.zc[i].head == io->w.zc[i].next)
+            continue;
+        fds[nfds].fd = io->w.fd[i];
+        fds[nfds].events = 0;	/* POLLERR is always reported */
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+    if (nfds == 0)
+        return 0;
+
+    poll(fds, nfds, timeout);
+
+    for (i = 0; i < io->w.nfds; i++) {
+        if (io->w.fd[i] < 0)
+            continue;
+        done += zcreap(io, i);
+        pending += io->w.zc[i].next - io->w.zc[i].head;
+    }
+    return done ? pending : 0;
+}
+
+/* Returns the number of sends still in flight. */
+static int zcpending(struct io *io)
+{
+    int i, pending = 0;
+
+    for (i = 0; i < io->w.nfds; i++)
+        if (io->w.fd[i] >= 0)
+            pending += io->w.zc[i].next - io->w.zc[i].head;
+    return pending;
+}
+
+/* Keeps the relay, with its pinned buffers and the sockets to get the
+   completions from, on pool.deferred until the kernel has released them. */
+static void zcdefer(struct io *io)
+{
+    int i, fd;
+
+    for (i = 0; i < io->w.nfds; i++) {
+        if (io->w.fd[i] < 0)
+            continue;
+        if (io->w.zc[i].head == io->w.zc[i].next) {
+            if (io->w.can_close[i])
+                close(io->w.fd[i]);
+            io->w.fd[i] = -1;
+            continue;
+        }
+        if (!io->w.can_close[i]) {
+            /* the caller may close its fd at any time from now on */
+            fd = dup(io->w.fd[i]);
+            if (fd < 0) {
+                /* the buffers are leaked by freebufs() */
+                io->w.fd[i] = -1;
+                continue;
+            }
+            io->w.fd[i] = fd;
+            io->w.can_close[i] = 1;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    io->next = pool.deferred;
+    pool.deferred = io;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Releases the deferred relays whose sends have all completed, and puts
+   the others back. */
+static void zcretry(struct io *list)
+{
+    struct io *io, *next;
+    int i;
+
+    for (io = list; io; io = next) {
+        next = io->next;
+        for (i = 0; i < io->w.nfds; i++)
+            if (io->w.fd[i] >= 0)
+                zcreap(io, i);
+        if (zcpending(io) == 0) {
+            iodone(io);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        io->next = pool.deferred;
+        pool.deferred = io;
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Switches io->buf.ptr to a buffer which is not pinned by the kernel. */
+static void nextbuf(struct io *io)
+{
+    int i, b;
+
+    while (1) {
+        for (i = 1; i <= io->buf.nbufs; i++) {
+            b = (io->buf.cur + i) % io->buf.nbufs;
+            if (!busybuf(io, b))
+                goto found;
+        }
+        if (io->buf.nbufs < NBUFS) {
+            b = io->buf.nbufs;
+            io->buf.bufs[b].ptr = bufalloc(io->buf.size);
+            if (io->buf.bufs[b].ptr != NULL) {
+                io->buf.bufs[b].zrefs = 0;
+                io->buf.bufs[b].crefs = 0;
+                io->buf.nbufs++;
+                goto found;
+            }
+        }
+        for (i = 0; i < io->w.nfds; i++)
+            if (io->w.fd[i] >= 0)
+                zcreap(io, i);
+        if (!busybuf(io, io->buf.cur)) {
+            b = io->buf.cur;
+            goto found;
+        }
+        if (zcwait(io, 10) > 0)
+            continue;
+
+        /* wait for a compressor to release the oldest buffer */
+        b = (io->buf.cur + 1) % io->buf.nbufs;
+        pthread_mutex_lock(&io->lock);
+        if (io->buf.bufs[b].crefs > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            pthread_cond_timedwait(&io->freed, &io->lock, &ts);
+        }
+        pthread_mutex_unlock(&io->lock);
+    }
+
+found:
+    io->buf.cur = b;
+    io->buf.ptr = io->buf.bufs[b].ptr;
+}
+
+static void freebufs(struct io *io)
+{
+    int b;
+
+    for (b = 0; b < io->buf.nbufs; b++) {
+        /* If the kernel never reported the completion, the pages may
+           still be transmitted. Leaking the buffer is the safe choice. */
+        if (io->buf.bufs[b].zrefs == 0)
+            buffree(io->buf.bufs[b].ptr, io->buf.size);
+    }
+}
+
+static int busybuf(struct io *io, int b)
+{
+    int crefs;
+
+    if (io->buf.bufs[b].zrefs > 0)
+        return 1;
+    if (io->w.ncw == 0)
+        return 0;	/* crefs is never raised without a compressor */
+
+    pthread_mutex_lock(&io->lock);
+    crefs = io->buf.bufs[b].crefs;
+    pthread_mutex_unlock(&io->lock);
+    return crefs > 0;
+}
+
+/* Starts the compressor thread of the writer i. */
+static int cwstart(struct io *io, int i)
+{
+#ifdef IORELAY_ZLIB
+    struct cw *cw;
+    int err;
+
+    cw = malloc(sizeof(struct cw));
+    if (cw == NULL)
+        return ENOMEM;
+    memset(cw, 0, sizeof(struct cw));
+
+    cw->io = io;
+    cw->fd = io->w.fd[i];
+
+    /* windowBits 15 + 16 writes a gzip stream, so that the receiving
+       side can simply pipe it into gunzip(1) */
+    if (deflateInit2(&cw->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(cw);
+        return ENOMEM;
+    }
+
+    pthread_cond_init(&cw->cond, NULL);
+    err = pthread_create(&cw->th, NULL, deflateloop, (void *) cw);
+    if (err != 0) {
+        pthread_cond_destroy(&cw->cond);
+        deflateEnd(&cw->zs);
+        free(cw);
+        return err;
+    }
+
+    io->w.cw[i] = cw;
+    io->w.ncw++;
+    return 0;
+#else
+    (void) io;
+    (void) i;
+    return ENOTSUP;
+#endif
+}
+
+/* Hands the current buffer to the compressor of the writer i. Returns
+   -1 if the compressor can no longer write. */
+static int cwqueue(struct io *io, int i, int size)
+{
+    struct cw *cw = io->w.cw[i];
+
+    pthread_mutex_lock(&io->lock);
+    if (cw->dead) {
+        pthread_mutex_unlock(&io->lock);
+        return -1;
+    }
+    /* never overflows: a chunk in q[] holds one of NBUFS buffers,
+       and the current buffer is not queued twice */
+    cw->q[cw->tail % NBUFS].bufidx = io->buf.cur;
+    cw->q[cw->tail % NBUFS].size = size;
+    cw->tail++;
+    io->buf.bufs[io->buf.cur].crefs++;
+    pthread_cond_signal(&cw->cond);
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+/* Tells all compressors the end of the stream, and waits for them. */
+static void cwstop(struct io *io)
+{
+    struct cw *cw;
+    int i;
+
+    for (i = 0; i < io->w.nfds; i++) {
+        cw = io->w.cw[i];
+        if (cw == NULL)
+            continue;
+
+        pthread_mutex_lock(&io->lock);
+        cw->eof = 1;
+        pthread_cond_signal(&cw->cond);
+        pthread_mutex_unlock(&io->lock);
+
+        pthread_join(cw->th, NULL);
+        pthread_cond_destroy(&cw->cond);
+
+        /* left open by mainloop() when the compressor has failed */
+        if (io->w.fd[i] < 0 && io->w.can_close[i])
+            close(cw->fd);
+#ifdef IORELAY_ZLIB
+        deflateEnd(&cw->zs);
+#endif
+        free(cw);
+        io->w.cw[i] = NULL;
+        io->w.ncw--;
+    }
+}
+
+/* Stops the compressors without finishing their streams, when the relay
+   fails to start. The fds are left to the caller. */
+static void cwabort(struct io *io)
+{
+    int i;
+
+    for (i = 0; i < io->w.nfds; i++) {
+        if (io->w.cw[i] == NULL)
+            continue;
+        pthread_mutex_lock(&io->lock);
+        io->w.cw[i]->dead = 1;
+        pthread_mutex_unlock(&io->lock);
+    }
+    cwstop(io);
+}
+
+#ifdef IORELAY_ZLIB
+/* Compresses the input and writes out whatever deflate() produced. */
+static int cwdeflate(struct cw *cw, const char *ptr, int size, int flush)
+{
+    int ret, n, wsize;
+    char *wptr;
+
+    cw->zs.next_in = (Bytef *) ptr;
+    cw->zs.avail_in = size;
+    do {
+        cw->zs.next_out = (Bytef *) cw->out;
+        cw->zs.avail_out = sizeof(cw->out);
+        ret = deflate(&cw->zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+
+        wptr = cw->out;
+        wsize = sizeof(cw->out) - cw->zs.avail_out;
+        while (wsize > 0) {
+            n = write(cw->fd, wptr, wsize);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    selectwait(-1, cw->fd, -1);
+                    continue;
+                }
+                return -1;	/* EPIPE or the like */
+            }
+            wptr += n;
+            wsize -= n;
+        }
+    } while (cw->zs.avail_out == 0);
+    return 0;
+}
+
+static void *deflateloop(void *arg)
+{
+    struct cw *cw = (struct cw *) arg;
+    struct io *io = cw->io;
+    struct timespec ts;
+    int b, size, ret, dead, pending = 0;
+
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (cw->head == cw->tail && !cw->eof) {
+            if (!pending || cw->dead) {
+                pthread_cond_wait(&cw->cond, &io->lock);
+                continue;
+            }
+
+            /* flush on idle */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += FLUSH_IDLE / 1000;
+            ts.tv_nsec += (FLUSH_IDLE % 1000) * 1000 * 1000;
+            if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            ret = pthread_cond_timedwait(&cw->cond, &io->lock, &ts);
+            if (ret == ETIMEDOUT && cw->head == cw->tail && !cw->eof && !cw->dead) {
+                pthread_mutex_unlock(&io->lock);
+                ret = cwdeflate(cw, NULL, 0, Z_SYNC_FLUSH);
+                pthread_mutex_lock(&io->lock);
+                if (ret < 0)
+                    cw->dead = 1;
+                pending = 0;
+            }
+        }
+        if (cw->head == cw->tail)
+            break;	/* eof */
+
+        b = cw->q[cw->head % NBUFS].bufidx;
+        size = cw->q[cw->head % NBUFS].size;
+        cw->head++;
+        if (cw->dead)
+            goto release;	/* just drain the queue */
+        pthread_mutex_unlock(&io->lock);
+
+        ret = cwdeflate(cw, io->buf.bufs[b].ptr, size, Z_NO_FLUSH);
+        pending = (ret == 0);
+
+        pthread_mutex_lock(&io->lock);
+        if (ret < 0)
+            cw->dead = 1;
+release:
+        io->buf.bufs[b].crefs--;
+        pthread_cond_signal(&io->freed);
+    }
+    dead = cw->dead;
+    pthread_mutex_unlock(&io->lock);
+
+    if (!dead)
+        cwdeflate(cw, NULL, 0, Z_FINISH);
+    return NULL;
+}
+#endif
+
+static void sumchunk(struct io *io, const char *ptr, int size)
+{
+    const char *end = ptr + size, *sep;
+    unsigned long long offset = io->sum.length;
+
+    io->sum.crc = crc32c(io->sum.crc, ptr, size);
+    io->sum.length += size;
+
+    if (io->sum.recsep < 0)
+        return;
+
+    while (ptr < end) {
+        sep = memchr(ptr, io->sum.recsep, end - ptr);
+        if (sep == NULL) {
+            io->sum.rcrc = crc32c(io->sum.rcrc, ptr, end - ptr);
+            break;
+        }
+        sep++;	/* the separator belongs to the record */
+        offset += sep - ptr;
+        io->sum.rcrc = crc32c(io->sum.rcrc, ptr, sep - ptr);
+        sumreport(io, io->sum.index, io->sum.roffset,
+                  offset - io->sum.roffset, io->sum.rcrc);
+        io->sum.index++;
+        io->sum.roffset = offset;
+        io->sum.rcrc = 0;
+        ptr = sep;
+    }
+}
+
+static void sumreport(struct io *io, long long index, unsigned long long offset,
+                      unsigned long long length, unsigned int crc)
+{
+    struct iorelay_sum sum;
+
+    sum.fd = io->r.fd;
+    sum.index = index;
+    sum.offset = offset;
+    sum.length = length;
+    sum.crc32c = crc;
+
+    if (io->sum.func) {
+        io->sum.func(&sum, io->sum.arg);
+    } else if (index < 0) {
+        fprintf(stderr, "iorelay: fd=%d length=%llu crc32c=%08x\n",
+                sum.fd, sum.length, sum.crc32c);
+    }
+}
+
+/* CRC-32C (Castagnoli), as used by iSCSI, ext4 and friends. The SSE4.2
+   crc32 instruction handles 8 bytes per instruction; other machines use
+   a table driven implementation. */
+static unsigned int crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+    unsigned int i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        crc32c_table[i] = crc;
+    }
+}
+
+static unsigned int crc32c_sw(unsigned int crc, const char *ptr, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) ptr;
+
+    while (size--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__ ((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const char *ptr, size_t size)
+{
+    unsigned long long crc64 = crc;
+    unsigned long long word;
+
+    for (; size > 0 && ((unsigned long) ptr & 7) != 0; size--)
+        crc64 = _mm_crc32_u8(crc64, *ptr++);
+    for (; size >= 8; size -= 8, ptr += 8) {
+        memcpy(&word, ptr, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    for (; size > 0; size--)
+        crc64 = _mm_crc32_u8(crc64, *ptr++);
+    return (unsigned int) crc64;
+}
+#endif
+
+static unsigned int (*crc32c_impl)(unsigned int, const char *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_select(void)
+{
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+        return;
+    }
+#endif
+    crc32c_init_table();
+}
+
+static unsigned int crc32c(unsigned int crc, const char *ptr, size_t size)
+{
+    pthread_once(&crc32c_once, crc32c_select);
+    return ~crc32c_impl(~crc, ptr, size);
+}
+
+#ifdef __linux__
+/* Bidirectional relay. All pairs share one event loop thread, and data
+   is moved with splice() through a pipe for each direction, so it never
+   passes through user space. */
+struct half {
+    int rfd;
+    int wfd;
+    int pipe[2];
+    int inpipe;		/* bytes in the pipe */
+    int eof;		/* got an EOF from rfd */
+    int shut;		/* shutdown(wfd, SHUT_WR) has been done */
+};
+
+struct bidi {
+    struct bidi *next;	/* pending or dead list */
+    int fd[2];
+    int can_close[2];
+    int dead;
+    struct half h[2];	/* h[0]: fd[0] -> fd[1], h[1]: fd[1] -> fd[0] */
+};
+
+static struct {
+    int epfd;
+    int evfd;		/* wakes the loop to register pending pairs */
+    pthread_mutex_t lock;
+    struct bidi *pending;
+} bidiloop = { -1, -1, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static pthread_once_t bidi_once = PTHREAD_ONCE_INIT;
+static int bidi_err = 0;
+
+static void bidistart(void);
+static void *bidimain(void *arg);
+static void bidievent(struct bidi *b, struct bidi **dead);
+static int bidipump(struct half *h);
+static void bidifree(struct bidi *b);
+
+int iorelay_bidi(int fd_a, int fd_b)
+{
+    struct bidi *b;
+    struct stat st;
+    uint64_t one = 1;
+    int i, k, err;
+
+    pthread_once(&bidi_once, bidistart);
+    if (bidi_err != 0)
+        return bidi_err;
+
+    b = malloc(sizeof(struct bidi));
+    if (b == NULL)
+        return ENOMEM;
+    memset(b, 0, sizeof(struct bidi));
+    b->h[0].pipe[0] = b->h[0].pipe[1] = -1;
+    b->h[1].pipe[0] = b->h[1].pipe[1] = -1;
+
+    for (i = 0; i < 2; i++) {
+        int fd = (i == 0) ? fd_a : fd_b;
+        if (fd < 0) {
+            b->fd[i] = ~fd;
+            b->can_close[i] = 0;
+        } else {
+            b->fd[i] = fd;
+            b->can_close[i] = 1;
+        }
+
+        /* epoll(7) does not work with regular files and directories */
+        if (fstat(b->fd[i], &st) != 0) {
+            err = errno;
+            goto fail;
+        }
+        if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+            err = EINVAL;
+            goto fail;
+        }
+    }
+    if (b->fd[0] == b->fd[1]) {
+        err = EINVAL;
+        goto fail;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (pipe2(b->h[i].pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+            err = errno;
+            goto fail;
+        }
+        b->h[i].rfd = b->fd[i];
+        b->h[i].wfd = b->fd[1 - i];
+
+        k = fcntl(b->fd[i], F_GETFL);
+        if (k < 0 || fcntl(b->fd[i], F_SETFL, k | O_NONBLOCK) != 0) {
+            err = errno;
+            goto fail;
+        }
+    }
+
+    /* the loop thread owns the pair from here on */
+    pthread_mutex_lock(&bidiloop.lock);
+    b->next = bidiloop.pending;
+    bidiloop.pending = b;
+    pthread_mutex_unlock(&bidiloop.lock);
+
+    if (write(bidiloop.evfd, &one, sizeof(one)) < 0) {
+        /* the counter is saturated, so the loop is going to wake up */
+    }
+    return 0;
+
+fail:
+    for (i = 0; i < 2; i++) {
+        if (b->h[i].pipe[0] >= 0)
+            close(b->h[i].pipe[0]);
+        if (b->h[i].pipe[1] >= 0)
+            close(b->h[i].pipe[1]);
+    }
+    free(b);
+    return err;
+}
+
+static void bidistart(void)
+{
+    struct epoll_event ev;
+    pthread_attr_t attr;
+    pthread_t th;
+
+    bidiloop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    bidiloop.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bidiloop.epfd < 0 || bidiloop.evfd < 0) {
+        bidi_err = errno;
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;		/* marks the eventfd */
+    if (epoll_ctl(bidiloop.epfd, EPOLL_CTL_ADD, bidiloop.evfd, &ev) != 0) {
+        bidi_err = errno;
+        return;
+    }
+
+    bidi_err = pthread_attr_init(&attr);
+    if (bidi_err == 0)
+        bidi_err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (bidi_err == 0)
+        bidi_err = pthread_create(&th, &attr, bidimain, NULL);
+}
+
+static void *bidimain(void *arg)
+{
+    struct epoll_event evs[BIDIEVENTS], ev;
+    struct bidi *b, *next, *dead;
+    uint64_t count;
+    int i, n, k;
+
+    (void) arg;
+
+    while (1) {
+        n = epoll_wait(bidiloop.epfd, evs, BIDIEVENTS, -1);
+        if (n < 0)
+            continue;	/* EINTR */
+
+        dead = NULL;
+        for (i = 0; i < n; i++) {
+            b = evs[i].data.ptr;
+            if (b) {
+                if (!b->dead)
+                    bidievent(b, &dead);
+                continue;
+            }
+
+            /* new pairs have been queued */
+            if (read(bidiloop.evfd, &count, sizeof(count)) < 0) {
+                /* EAGAIN: already drained */
+            }
+            pthread_mutex_lock(&bidiloop.lock);
+            next = bidiloop.pending;
+            bidiloop.pending = NULL;
+            pthread_mutex_unlock(&bidiloop.lock);
+
+            while ((b = next) != NULL) {
+                next = b->next;
+                b->next = NULL;
+
+                /* Edge triggered; bidipump() always runs until it would
+                   block, so a new edge is sure to come. */
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.ptr = b;
+                for (k = 0; k < 2; k++)
+                    if (epoll_ctl(bidiloop.epfd, EPOLL_CTL_ADD, b->fd[k], &ev) != 0)
+                        b->dead = 1;
+
+                /* data may have arrived before the registration */
+                bidievent(b, &dead);
+            }
+        }
+
+        /* Free them after the loop above, since another event for the
+           same pair may follow in evs[]. */
+        while (dead) {
+            b = dead->next;
+            bidifree(dead);
+            dead = b;
+        }
+    }
     return NULL;
 }
 
+static void bidievent(struct bidi *b, struct bidi **dead)
+{
+    int k, r, finished = 0;
+
+    for (k = 0; k < 2 && !b->dead; k++) {
+        r = bidipump(&b->h[k]);
+        if (r < 0)
+            b->dead = 1;	/* the connection is broken */
+        else
+            finished += r;
+    }
+    if (finished == 2)
+        b->dead = 1;		/* both directions have finished */
+
+    if (b->dead) {
+        b->next = *dead;
+        *dead = b;
+    }
+}
+
+/* Moves data of one direction until it would block. Returns 1 if the
+   direction has finished, 0 if not yet, or -1 on error. */
+static int bidipump(struct half *h)
+{
+    ssize_t n;
+    int progress;
+
+    do {
+        progress = 0;
+
+        if (!h->eof) {
+            n = splice(h->rfd, NULL, h->pipe[1], NULL, BIDICHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                h->inpipe += n;
+                progress = 1;
+            }
+            else if (n == 0) {
+                h->eof = 1;
+            }
+            else if (errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+            /* EAGAIN: rfd is empty, or the pipe is full */
+        }
+
+        if (h->inpipe > 0) {
+            n = splice(h->pipe[0], NULL, h->wfd, NULL, h->inpipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                h->inpipe -= n;
+                progress = 1;
+            }
+            else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+    } while (progress);
+
+    if (h->eof && h->inpipe == 0) {
+        if (!h->shut) {
+            /* propagate the half-close; ENOTSOCK is fine */
+            shutdown(h->wfd, SHUT_WR);
+            h->shut = 1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void bidifree(struct bidi *b)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        /* closing an fd removes it from the epoll set, but only if no
+           other fd refers to the same file; the ~fd may be kept open */
+        epoll_ctl(bidiloop.epfd, EPOLL_CTL_DEL, b->fd[i], NULL);
+        close(b->h[i].pipe[0]);
+        close(b->h[i].pipe[1]);
+    }
+    for (i = 0; i < 2; i++)
+        if (b->can_close[i])
+            close(b->fd[i]);
+    free(b);
+}
+#else
+int iorelay_bidi(int fd_a, int fd_b)
+{
+    (void) fd_a;
+    (void) fd_b;
+    return ENOTSUP;
+}
+#endif
+
 static void selectwait(int rfd, int wfd, int efd)
 {
     int nfds;
@@ -21,9 +21,102 @@
         wfd2 will not be closed by the iorelay().
 
 */
+
+/* SYNOPSIS
+        int niorelayx(int rfd, int nwfds, int wfd[],
+                      const struct iorelay_opts *opts);
+
+   DESCRIPTION
+        The niorelayx() function is the same as niorelay(), but takes
+        options for the relay. If the opts is NULL, it behaves exactly
+        like niorelay(). The opts->wflags, if not NULL, points to an
+        array of nwfds flags, one for each element of the wfd[].
+
+   FLAGS (opts->wflags)
+        IORELAY_ZEROCOPY
+                If the file descriptor is a TCP socket, writes larger than
+                ZEROCOPY_THRESHOLD are sent with MSG_ZEROCOPY. Buffers are
+                reused only after the kernel reports their completion on
+                the error queue of the socket. For other file descriptors,
+                or if the kernel refuses SO_ZEROCOPY, this flag is ignored.
+
+        IORELAY_DEFLATE
+                The data written to the file descriptor is compressed into
+                a gzip stream by its own thread, so that reading and the
+                other writers are not held up by the compressor. When no
+                input arrives for FLUSH_IDLE milliseconds, the compressed
+                data produced so far is flushed. Requires iorelay.c to be
+                compiled with -DIORELAY_ZLIB and linked with -lz; without
+                it, niorelayx() returns ENOTSUP.
+
+   FLAGS (opts->flags)
+        IORELAY_CRC32C
+                CRC-32C of the relayed stream is computed while relaying,
+                and is reported by opts->sumfunc(sum, opts->sumarg) with
+                sum->index set to -1 when the relay finishes. If the
+                opts->sumfunc is NULL, it is printed to stderr instead.
+
+        IORELAY_RECORDSUM
+                In addition to IORELAY_CRC32C, each record terminated by
+                the opts->recsep byte (e.g. '\n') is reported with its
+                record number in sum->index. The separator is a part of
+                the record.
+
+*/
+#define IORELAY_ZEROCOPY    0x0001
+#define IORELAY_DEFLATE     0x0002
+
+#define IORELAY_CRC32C      0x0001
+#define IORELAY_RECORDSUM   0x0002
+
+struct iorelay_sum {
+    int fd;                         /* rfd without the tilde */
+    long long index;                /* record number, or -1 for stream */
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned int crc32c;
+};
+
+struct iorelay_opts {
+    const int *wflags;
+    int flags;
+    int recsep;
+    void (*sumfunc)(const struct iorelay_sum *sum, void *arg);
+    void *sumarg;
+};
+
 #define  iorelay(rfd, ...)   viorelay(rfd, __VA_ARGS__)
 #define viorelay(rfd, ...) _vniorelay(rfd, NARGS(__VA_ARGS__), __VA_ARGS__)
 int   _vniorelay(int rfd, int nwfds, ...);
 int     niorelay(int rfd, int nwfds, int wfd[]);
+int     niorelayx(int rfd, int nwfds, int wfd[], const struct iorelay_opts *opts);
+
+/* SYNOPSIS
+        int iorelay_bidi(int fd_a, int fd_b);
+
+   DESCRIPTION
+        The iorelay_bidi() function relays data in both directions between
+        the fd_a and the fd_b (e.g. two connected sockets of a proxy). Data
+        is moved by splice(2) through an intermediate pipe for each
+        direction. When one side reaches EOF, shutdown(SHUT_WR) is done on
+        the other side, and the opposite direction keeps going. When both
+        directions have finished, or an error occurs on either of them,
+        the fd_a and the fd_b are closed together, unless prefixed with a
+        tilde (~) operator.
+
+        All pairs are served by one internal event loop thread, so that
+        tens of thousands of connections can be relayed at the same time.
+        Each pair uses four file descriptors for the pipes, in addition to
+        the fd_a and the fd_b. Both file descriptors are set to O_NONBLOCK.
+
+        Returns 0 on success, or an error number. This is only available
+        on Linux; elsewhere ENOTSUP is returned.
+*/
+int     iorelay_bidi(int fd_a, int fd_b);
+
+#ifdef IORELAY_STATS
+/* number of read/write calls made by relay threads (for bench.c) */
+extern unsigned long iorelay_nsyscalls;
+#endif
 
 /* vim: set et sw=4 sts=4: */
@@ -0,0 +1,215 @@
+/* Test of the compressing writer, IORELAY_DEFLATE. Built with
+   -DIORELAY_ZLIB and -lz by "make test".
+
+   usage: test-deflate
+
+   Each case relays a stream to a compressed sink and a plain one:
+        flush   the compressed data is readable before the stream ends,
+                after FLUSH_IDLE, and inflates back to the whole stream
+        epipe   the compressed sink is closed by its reader, and the
+                plain sink still gets the whole stream
+
+   Exits with 0 if all cases have passed. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "iorelay.h"
+
+#define PART1		(16 * 1024)
+#define TOTAL		(4 * 1024 * 1024)
+#define CHUNK		(64 * 1024)
+#define WAITLIMIT	(10 * 1000)	/* in millisecond */
+
+static int failures = 0;
+
+static void die(const char *what)
+{
+    fprintf(stderr, "test-deflate: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void fail(const char *name, const char *why)
+{
+    printf("FAIL: %s: %s\n", name, why);
+    failures++;
+}
+
+static unsigned char pattern(long long offset)
+{
+    return (unsigned char) (offset * 7 % 251);
+}
+
+/* Writes PART1 bytes, waits for a byte on gofd, then writes the rest. */
+static pid_t producer(int fd, int gofd, int closefd1, int closefd2)
+{
+    static char buf[CHUNK];
+    long long offset = 0;
+    pid_t pid;
+    char c;
+    int n, i, size;
+
+    pid = fork();
+    if (pid < 0)
+        die("fork()");
+    if (pid > 0)
+        return pid;
+
+    close(closefd1);
+    close(closefd2);
+    while (offset < TOTAL) {
+        if (offset == PART1 && gofd >= 0 && read(gofd, &c, 1) != 1)
+            _exit(1);
+        size = (offset < PART1) ? PART1 : CHUNK;
+        if (size > TOTAL - offset)
+            size = TOTAL - offset;
+        for (i = 0; i < size; i++)
+            buf[i] = pattern(offset + i);
+        n = write(fd, buf, size);
+        if (n != size)
+            _exit(1);
+        offset += n;
+    }
+    _exit(0);
+}
+
+/* Checks the bytes read at offset, and returns how many. */
+static int check(const char *name, const char *buf, int size, long long offset)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if ((unsigned char) buf[i] != pattern(offset + i)) {
+            fail(name, "corrupted data");
+            break;
+        }
+    }
+    return size;
+}
+
+static void run(const char *name, int closez)
+{
+    static char in[CHUNK], out[CHUNK];
+    int src[2], z[2], p[2], go[2], wfd[2], wflags[2], status, n, err;
+    long long ztotal = 0, ptotal = 0;
+    int before = failures;
+    struct iorelay_opts opts;
+    struct pollfd fds[2];
+    z_stream zs;
+    pid_t pid;
+
+    if (pipe(src) != 0 || pipe(go) != 0)
+        die("pipe()");
+
+    /* before the sinks, so that it does not keep them open */
+    pid = producer(src[1], closez ? -1 : go[0], src[0], go[1]);
+    close(src[1]);
+    close(go[0]);
+
+    if (pipe(z) != 0 || pipe(p) != 0)
+        die("pipe()");
+
+    if (closez) {
+        close(z[0]);
+        z[0] = -1;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    wfd[0] = z[1];
+    wfd[1] = p[1];
+    wflags[0] = IORELAY_DEFLATE;
+    wflags[1] = 0;
+    opts.wflags = wflags;
+    err = niorelayx(src[0], 2, wfd, &opts);	/* closes all of them */
+    if (err != 0) {
+        errno = err;
+        die("niorelayx()");
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        die("inflateInit2()");
+
+    fds[0].fd = z[0];
+    fds[1].fd = p[0];
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        fds[0].events = fds[1].events = POLLIN;
+        n = poll(fds, 2, WAITLIMIT);
+        if (n < 0)
+            die("poll()");
+        if (n == 0) {
+            fail(name, ztotal < PART1 ? "not flushed on idle" : "stalled");
+            break;
+        }
+
+        if (fds[1].revents) {
+            n = read(p[0], in, sizeof(in));
+            if (n <= 0) {
+                close(p[0]);
+                fds[1].fd = -1;
+            } else
+                ptotal += check(name, in, n, ptotal);
+        }
+
+        if (fds[0].fd >= 0 && fds[0].revents) {
+            n = read(z[0], in, sizeof(in));
+            if (n <= 0) {
+                close(z[0]);
+                fds[0].fd = -1;
+                continue;
+            }
+            zs.next_in = (Bytef *) in;
+            zs.avail_in = n;
+            do {
+                zs.next_out = (Bytef *) out;
+                zs.avail_out = sizeof(out);
+                err = inflate(&zs, Z_NO_FLUSH);
+                if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+                    fail(name, "broken gzip stream");
+                    break;
+                }
+                ztotal += check(name, out, sizeof(out) - zs.avail_out, ztotal);
+            } while (zs.avail_in > 0 && err == Z_OK);
+
+            /* only the flush lets the rest come */
+            if (go[1] >= 0 && ztotal >= PART1) {
+                if (write(go[1], "", 1) != 1)
+                    die("write()");
+                close(go[1]);
+                go[1] = -1;
+            }
+        }
+    }
+    inflateEnd(&zs);
+    if (go[1] >= 0)
+        close(go[1]);
+
+    if (waitpid(pid, &status, 0) < 0)
+        die("waitpid()");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fail(name, "producer failed");
+    if (ptotal != TOTAL)
+        fail(name, "plain sink is short");
+    if (!closez && ztotal != TOTAL)
+        fail(name, "compressed sink is short");
+    if (failures == before)
+        printf("PASS: %s\n", name);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    run("flush", 0);
+    run("epipe", 1);
+    return failures > 0;
+}
+
+/* vim: set et sw=4 sts=4: */
@@ -0,0 +1,233 @@
+/* Test of the zero-copy writer, IORELAY_ZEROCOPY. Built by "make test".
+
+   usage: test-zerocopy
+
+   Each case relays streams to TCP sockets over the loopback, with
+   IORELAY_ZEROCOPY, and to plain pipes:
+        stream  a socket the relay closes, and one it does not, both get
+                the whole stream, while the sink is read late
+        reuse   relays started back to back, sharing the pooled contexts
+                and buffers, each get their own stream intact
+
+   Where SO_ZEROCOPY is not available, the relay falls back to write(),
+   and the cases still have to pass. Exits with 0 if all cases have
+   passed. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iorelay.h"
+
+#define TOTAL		(4 * 1024 * 1024)
+#define CHUNK		(64 * 1024)
+#define NRELAYS		4
+#define NSINKS		(2 * NRELAYS)
+#define READDELAY	(300 * 1000)	/* in microsecond */
+#define WAITLIMIT	(10 * 1000)	/* in millisecond */
+
+static int failures = 0;
+
+static void die(const char *what)
+{
+    fprintf(stderr, "test-zerocopy: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void fail(const char *name, const char *why)
+{
+    printf("FAIL: %s: %s\n", name, why);
+    failures++;
+}
+
+static unsigned char pattern(int seed, long long offset)
+{
+    return (unsigned char) ((offset + seed) * 7 % 251);
+}
+
+/* Writes TOTAL bytes of the pattern of the seed. */
+static pid_t producer(int fd, int seed)
+{
+    static char buf[CHUNK];
+    long long offset = 0;
+    pid_t pid;
+    int n, i;
+
+    pid = fork();
+    if (pid < 0)
+        die("fork()");
+    if (pid > 0)
+        return pid;
+
+    while (offset < TOTAL) {
+        for (i = 0; i < CHUNK; i++)
+            buf[i] = pattern(seed, offset + i);
+        n = write(fd, buf, CHUNK);
+        if (n != CHUNK)
+            _exit(1);
+        offset += n;
+    }
+    _exit(0);
+}
+
+/* Returns a connected pair of TCP sockets over the loopback. */
+static void tcppair(int fds[2])
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int lfd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0)
+        die("socket()");
+    if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+        listen(lfd, 1) != 0 ||
+        getsockname(lfd, (struct sockaddr *) &sin, &len) != 0)
+        die("bind()");
+
+    fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[1] < 0)
+        die("socket()");
+    if (connect(fds[1], (struct sockaddr *) &sin, sizeof(sin)) != 0)
+        die("connect()");
+    fds[0] = accept(lfd, NULL, NULL);
+    if (fds[0] < 0)
+        die("accept()");
+    close(lfd);
+}
+
+/* Reads all the sinks, sinks[i] getting the stream of seeds[i], until
+   they have all got EOF. The sender side of a socket in keep[] is closed
+   after the whole stream has been read from it. */
+static void drain(const char *name, int n, int sinks[], int seeds[], int keep[])
+{
+    static char buf[CHUNK];
+    struct pollfd fds[NSINKS];
+    long long total[NSINKS];
+    int i, m, nopen = n;
+
+    for (i = 0; i < n; i++) {
+        fds[i].fd = sinks[i];
+        total[i] = 0;
+    }
+
+    while (nopen > 0) {
+        for (i = 0; i < n; i++)
+            fds[i].events = POLLIN;
+        m = poll(fds, n, WAITLIMIT);
+        if (m < 0)
+            die("poll()");
+        if (m == 0) {
+            fail(name, "stalled");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+            m = read(fds[i].fd, buf, sizeof(buf));
+            if (m <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                nopen--;
+                continue;
+            }
+            for (int j = 0; j < m; j++) {
+                if ((unsigned char) buf[j] != pattern(seeds[i], total[i] + j)) {
+                    fail(name, "corrupted data");
+                    break;
+                }
+            }
+            total[i] += m;
+            if (total[i] == TOTAL && keep[i] >= 0) {
+                /* left open by the relay */
+                close(keep[i]);
+                keep[i] = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (fds[i].fd >= 0)
+            close(fds[i].fd);
+        if (keep[i] >= 0)
+            close(keep[i]);
+        if (total[i] != TOTAL)
+            fail(name, "sink is short");
+    }
+}
+
+static void run(const char *name, int nrelays)
+{
+    int sinks[NSINKS], seeds[NSINKS], keep[NSINKS];
+    pid_t pids[NRELAYS];
+    int src[2], s[2], p[2], wfd[2], wflags[2], status, err, i, n = 0;
+    int before = failures;
+    struct iorelay_opts opts;
+
+    memset(&opts, 0, sizeof(opts));
+    wflags[0] = IORELAY_ZEROCOPY;
+    wflags[1] = 0;
+    opts.wflags = wflags;
+
+    for (i = 0; i < nrelays; i++) {
+        if (pipe(src) != 0 || pipe(p) != 0)
+            die("pipe()");
+        tcppair(s);
+
+        pids[i] = producer(src[1], i);
+        close(src[1]);
+
+        /* the first socket is left open by the relay, with ~fd */
+        keep[n] = (i == 0) ? s[1] : -1;
+        wfd[0] = (i == 0) ? ~s[1] : s[1];
+        wfd[1] = p[1];
+        err = niorelayx(src[0], 2, wfd, &opts);
+        if (err != 0) {
+            errno = err;
+            die("niorelayx()");
+        }
+
+        seeds[n] = i;
+        sinks[n++] = s[0];
+        keep[n] = -1;
+        seeds[n] = i;
+        sinks[n++] = p[0];
+    }
+
+    /* let the sends queue up before anything is read */
+    usleep(READDELAY);
+    drain(name, n, sinks, seeds, keep);
+
+    for (i = 0; i < nrelays; i++) {
+        if (waitpid(pids[i], &status, 0) < 0)
+            die("waitpid()");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fail(name, "producer failed");
+    }
+    if (failures == before)
+        printf("PASS: %s\n", name);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    run("stream", 1);
+    run("reuse", NRELAYS);
+    return failures > 0;
+}
+
+/* vim: set et sw=4 sts=4: */